@@ -0,0 +1,232 @@
+/**
+ * @file onion_replay.c
+ * @brief Host harness: replays recorded "RAW:" sweeps through the firmware logic and checks the HID report stream.
+ *
+ * Every "RAW:v0,...,vN-1" line (mV, the serial telemetry format) is one sweep,
+ * spaced ONION_ACTIVE_SCAN_PERIOD_MS apart. It runs through
+ * onion_pipeline_step() and the action engine exactly as in the sweep task,
+ * with the firmware's default pad table. Other lines (console log around a
+ * capture, '#' comments) are skipped. Synthetic captures may use
+ * "REPEAT:n" to replay the previous sweep n more times, and set up the action
+ * engine between sweeps:
+ *
+ *   ACT:hex       load an action table blob (see onion_action.h), as ACT:W + ACT:COMMIT
+ *   KEY:ch,code   set a pad's base code (hex), e.g. 0xF0 + n to run program n
+ *   STEP:us       spacing of sequence steps (default ONION_ACTION_DEFAULT_STEP_US)
+ *   STALL:n       the host takes no report during the next n sweeps
+ *
+ * Each report leaving the engine is written as "sweep:modifiers:k1,...,k6"
+ * (hex). With an expected file the stream must match it line by line;
+ * without one it is printed, to record the expectation of a new capture.
+ *
+ *   onion_replay capture.raw [capture.expected]
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "onion_config.h"
+#include "onion_pipeline.h"
+#include "onion_action.h"
+#include "onion_hid.h"
+
+#define REPLAY_LINE_MAX 512
+
+/** @brief Table entry with the firmware defaults (same as onion_touch.c). */
+#define REPLAY_KEY(code) { code, DEFAULT_THRESHOLD, DEFAULT_DELTA, DEFAULT_PRESS_DEBOUNCE, \
+                           DEFAULT_RELEASE_DEBOUNCE, ONION_SCAN_SETTLE_SAMPLES }
+
+static onion_key_t replay_lut[MUX_CHANNELS_COUNT] = {
+    REPLAY_KEY(0x1A), REPLAY_KEY(0x16), REPLAY_KEY(0x04), REPLAY_KEY(0x07),
+    REPLAY_KEY(0x2C), REPLAY_KEY(0x08), REPLAY_KEY(0x0B), REPLAY_KEY(0x0A),
+    REPLAY_KEY(0x14), REPLAY_KEY(0x2B), REPLAY_KEY(0x4F), REPLAY_KEY(0x50),
+    REPLAY_KEY(0x52), REPLAY_KEY(0x51), REPLAY_KEY(0x1F), REPLAY_KEY(0x29),
+};
+
+/**
+ * @brief Replay state: the logic under test and the expectation being compared.
+ */
+typedef struct {
+    onion_pipeline_t pipeline;
+    onion_action_engine_t actions;
+    onion_action_table_t table;
+    uint32_t step_us;
+    uint32_t stall;       /**< Sweeps left in which reports stay queued */
+    uint32_t sweep;
+    FILE *expected;       /**< NULL in record mode */
+    uint32_t reports;
+    uint32_t mismatches;
+} replay_t;
+
+/**
+ * @brief Parses "RAW:v0,...,vN-1".
+ * @return true if the line carries exactly MUX_CHANNELS_COUNT values.
+ */
+static bool replay_parse_raw(const char *line, uint16_t raw[MUX_CHANNELS_COUNT]) {
+    const char *p = line + 4;
+
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        char *end;
+        unsigned long v = strtoul(p, &end, 10);
+        if (end == p || v > UINT16_MAX) return false;
+        raw[ch] = (uint16_t)v;
+        p = end;
+        if (ch < MUX_CHANNELS_COUNT - 1) {
+            if (*p != ',') return false;
+            p++;
+        }
+    }
+    return *p == '\0' || *p == '\r' || *p == '\n';
+}
+
+/**
+ * @brief Parses "ACT:hex" into the action table.
+ * @return true if the hex is well-formed and the table valid.
+ */
+static bool replay_parse_act(replay_t *r, const char *line) {
+    static uint8_t blob[ONION_ACTION_TABLE_MAX];
+    const char *p = line + 4;
+    size_t len = 0;
+
+    while (len < sizeof(blob) && isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1])) {
+        char hex[3] = { p[0], p[1], '\0' };
+        blob[len++] = (uint8_t)strtoul(hex, NULL, 16);
+        p += 2;
+    }
+    if (*p != '\0' && *p != '\r' && *p != '\n') return false;
+    return onion_action_table_load(&r->table, blob, len);
+}
+
+/**
+ * @brief Next expected report line, skipping blanks and '#' comments.
+ */
+static bool replay_next_expected(FILE *f, char *buf, size_t len) {
+    while (fgets(buf, (int)len, f)) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (buf[0] != '\0' && buf[0] != '#') return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Formats one report and checks it against the expectation (or prints it).
+ */
+static void replay_report(replay_t *r, const onion_hid_report_t *report) {
+    char actual[64];
+    char want[REPLAY_LINE_MAX];
+    const onion_hid_kb_report_t *kb = &report->kb;
+
+    snprintf(actual, sizeof(actual), "%u:%02X:%02X,%02X,%02X,%02X,%02X,%02X", (unsigned)r->sweep,
+             kb->modifiers, kb->keys[0], kb->keys[1], kb->keys[2], kb->keys[3], kb->keys[4], kb->keys[5]);
+    r->reports++;
+
+    if (r->expected == NULL) {
+        printf("%s\n", actual);
+        return;
+    }
+    if (!replay_next_expected(r->expected, want, sizeof(want))) {
+        fprintf(stderr, "unexpected report %s (expectation ended)\n", actual);
+        r->mismatches++;
+    } else if (strcmp(actual, want) != 0) {
+        fprintf(stderr, "report %u: got %s, expected %s\n", (unsigned)r->reports, actual, want);
+        r->mismatches++;
+    }
+}
+
+/**
+ * @brief Runs one sweep through detection, debounce and the action engine, as the sweep task does.
+ */
+static void replay_sweep(replay_t *r, const uint16_t raw[MUX_CHANNELS_COUNT]) {
+    const int64_t now_us = (int64_t)r->sweep * ONION_ACTIVE_SCAN_PERIOD_MS * 1000;
+    const onion_hid_report_t *report;
+
+    onion_pipeline_step(&r->pipeline, raw, replay_lut, now_us, NULL);
+    onion_action_step(&r->actions, &r->table, replay_lut, r->pipeline.pressed_mask, now_us, r->step_us);
+
+    /* The host takes every report at once: drain the queue each sweep, unless stalled */
+    if (r->stall > 0) {
+        r->stall--;
+        r->sweep++;
+        return;
+    }
+    while ((report = onion_action_peek(&r->actions)) != NULL) {
+        replay_report(r, report);
+        onion_action_pop(&r->actions);
+    }
+    r->sweep++;
+}
+
+int main(int argc, char **argv) {
+    static replay_t r;
+    char line[REPLAY_LINE_MAX];
+    char want[REPLAY_LINE_MAX];
+    uint16_t raw[MUX_CHANNELS_COUNT];
+    bool have_raw = false;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s capture.raw [capture.expected]\n", argv[0]);
+        return 2;
+    }
+    FILE *capture = fopen(argv[1], "r");
+    if (capture == NULL) {
+        perror(argv[1]);
+        return 2;
+    }
+    if (argc == 3 && (r.expected = fopen(argv[2], "r")) == NULL) {
+        perror(argv[2]);
+        return 2;
+    }
+
+    onion_pipeline_init(&r.pipeline);
+    onion_action_init(&r.actions);
+    onion_action_table_load(&r.table, NULL, 0);
+    r.step_us = ONION_ACTION_DEFAULT_STEP_US;
+
+    for (unsigned n = 1; fgets(line, sizeof(line), capture); n++) {
+        unsigned long repeat;
+        unsigned ch, code;
+
+        if (strncmp(line, "RAW:", 4) == 0) {
+            if (!replay_parse_raw(line, raw)) {
+                fprintf(stderr, "%s:%u: expected %d values\n", argv[1], n, MUX_CHANNELS_COUNT);
+                return 2;
+            }
+            have_raw = true;
+            replay_sweep(&r, raw);
+        } else if (sscanf(line, "REPEAT:%lu", &repeat) == 1) {
+            if (!have_raw) {
+                fprintf(stderr, "%s:%u: REPEAT before the first RAW line\n", argv[1], n);
+                return 2;
+            }
+            while (repeat-- > 0) replay_sweep(&r, raw);
+        } else if (strncmp(line, "ACT:", 4) == 0) {
+            if (!replay_parse_act(&r, line)) {
+                fprintf(stderr, "%s:%u: malformed action table\n", argv[1], n);
+                return 2;
+            }
+        } else if (sscanf(line, "KEY:%u,%x", &ch, &code) == 2) {
+            if (ch >= MUX_CHANNELS_COUNT || code > 0xFF) {
+                fprintf(stderr, "%s:%u: bad pad or code\n", argv[1], n);
+                return 2;
+            }
+            replay_lut[ch].keycode = (uint8_t)code;
+        } else if (sscanf(line, "STEP:%lu", &repeat) == 1) {
+            r.step_us = (uint32_t)repeat;
+        } else if (sscanf(line, "STALL:%lu", &repeat) == 1) {
+            r.stall = (uint32_t)repeat;
+        }
+    }
+    fclose(capture);
+
+    if (r.expected == NULL) return 0;
+    while (replay_next_expected(r.expected, want, sizeof(want))) {
+        fprintf(stderr, "missing report, expected %s\n", want);
+        r.mismatches++;
+    }
+    fclose(r.expected);
+
+    printf("%s: %u sweeps, %u reports, %u mismatches\n", argv[1], (unsigned)r.sweep, (unsigned)r.reports,
+           (unsigned)r.mismatches);
+    return r.mismatches == 0 ? 0 : 1;
+}
@@ -2,16 +2,16 @@
  * @file OnionController.c
  * @brief Main entry point for the Onion Controller HID device.
  * * This file orchestrates the initialization of NVS, Bluetooth (NimBLE),
- * and touch peripherals, and manages the main scanning loop.
+ * and touch peripherals, then starts the sweep task that runs the scanning loop.
  */
 
 #include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "driver/touch_pad.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_rom_sys.h"
+#include "esp_timer.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
 #include "services/gap/ble_svc_gap.h"
@@ -28,51 +28,64 @@
 #include "onion_config.h"
 #include "onion_ble.h"
 #include "onion_touch.h"
+#include "onion_cali.h"
+#include "onion_evlog.h"
+#include "onion_hid.h"
+#include "onion_power.h"
+#include "onion_telemetry.h"
+#include "onion_comms.h"
+#include "onion_storage.h"
+#include "onion_sweep.h"
 
 static const char *TAG = "ONION_MAIN";
 
+/**
+ * @brief Logs the time since boot at which an init step finished.
+ */
+static void boot_mark(const char *step) {
+    ESP_LOGI(TAG, "Boot: %s done at %lld us", step, (long long)esp_timer_get_time());
+}
+
 /**
  * @brief Application entry point.
- * * Initializes the system components in the required order and runs 
- * the infinite polling loop for touch input and BLE HID reporting.
+ * * Initializes the system components in the required order and starts
+ * the sweep task (see onion_sweep.h) for touch input and BLE HID reporting.
+ * Nothing waits for the BLE link: the NimBLE host syncs in its own task while
+ * the pads come up, the first sweeps seed the baselines, and presses made
+ * before a host subscribes are replayed to it (see send_key_report()).
+ * The milestones after app_main (pads live, host synced, first link) are in
+ * the event log as ONION_EVLOG_BOOT_STAGE.
  */
 void app_main(void) {
-    /* 1. Initialize system-wide configuration (NVS, storage) */
+    /* 1. Initialize system-wide configuration (locks, ADC calibration curves, NVS, storage);
+     *    NVS comes first because the bond store and the pad table both live there */
+    onion_lut_init();
+    onion_comms_early_init();
+    onion_cali_init();
     onion_config_init();
+    onion_evlog_init();
+    boot_mark("config");
 
-    /* 2. Initialize Bluetooth HID stack (NimBLE, GATT services) */
+    /* 2. Initialize Bluetooth HID stack (NimBLE, GATT services); returns before the host syncs */
     onion_ble_init();
+    boot_mark("ble");
 
-    /* 3. Initialize hardware-specific touch components (MUX and Pads) */
-    onion_touch_init();
+    /* 3. Configure automatic light sleep before the ADC driver takes its PM locks */
+    onion_power_init();
 
-    ESP_LOGI(TAG, "Controller is ready! Starting main loop.");
-
-    while (1) {
-        bool activity_detected = false;
+    /* 4. Initialize hardware-specific touch components (MUX and Pads) */
+    onion_touch_init();
+    boot_mark("touch");
 
-        /* Scan all 16 channels of the multiplexer */
-        for (int channel_idx = 0; channel_idx < MUX_CHANNELS_COUNT; channel_idx++) {
-            
-            /** * @note We check for state changes first to prevent flooding 
-             * the BLE stack with redundant HID reports.
-             */
-            if (onion_touch_has_changed(channel_idx)) {
-                bool is_pressed = onion_touch_read(channel_idx);
-                
-                /* Dispatch the HID report to the connected BLE host */
-                send_key_report(onion_lut[channel_idx].keycode, is_pressed);
-                
-                ESP_LOGD(TAG, "Channel %d: %s", channel_idx, is_pressed ? "Pressed" : "Released");
-                activity_detected = true;
-            }
-        }
+    /* 5. Serial link to the configurator (console driver, commands, telemetry); after the
+     *    scan engine exists, so an early CAL or SETTLE finds it running */
+    onion_comms_init();
 
-        /**
-         * Adaptive Task Delay:
-         * Provides low-latency response (10ms) during active use,
-         * and reduces CPU overhead (50ms) during idle periods.
-         */
-        vTaskDelay(pdMS_TO_TICKS(activity_detected ? 10 : 50));
+    /* 6. Hand the input pipeline to the pinned, timer-paced sweep task */
+    if (onion_sweep_start() != ESP_OK) {
+        ESP_LOGE(TAG, "Sweep task start failed");
+        return;
     }
-}
\ No newline at end of file
+
+    ESP_LOGI(TAG, "Controller is ready! Sweep task running on core %d.", ONION_SWEEP_TASK_CORE);
+}
@@ -0,0 +1,393 @@
+/**
+ * @file onion_action.c
+ * @brief Implementation of the tap/hold, layer, chord and macro engine.
+ */
+
+#include "onion_action.h"
+#include "string.h"
+
+#define ACTION_HDR_LEN    5
+#define ACTION_CHORD_LEN  5
+/** @brief Engine slot of the active chord, after the pad slots. */
+#define ACTION_SLOT_CHORD MUX_CHANNELS_COUNT
+/** @brief Sequence pc of a bare tap (no program behind it). */
+#define ACTION_PC_NONE    0xFFFF
+
+_Static_assert(ONION_ACTION_LAYERS <= 8, "layer bits are kept in a uint8_t");
+_Static_assert(ONION_ACTION_TABLE_MAX < ACTION_PC_NONE, "table offsets must fit below ACTION_PC_NONE");
+
+static uint16_t action_rd16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t action_rd32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* --- Table --- */
+
+/**
+ * @brief Checks that the program at off is complete and uses only known ops.
+ */
+static bool action_program_valid(const onion_action_table_t *t, uint32_t off) {
+    const uint8_t *b = t->blob;
+
+    if (off >= t->len) return false;
+    switch (b[off]) {
+    case ONION_OP_TAPHOLD:
+        return off + 4 <= t->len;
+    case ONION_OP_LAYER_MO:
+    case ONION_OP_LAYER_TG:
+        return off + 2 <= t->len && b[off + 1] >= 1 && b[off + 1] <= t->layers;
+    default:
+        break;
+    }
+
+    /* Macro: two-byte ops up to END */
+    while (off < t->len) {
+        if (b[off] == ONION_OP_END) return true;
+        if (b[off] < ONION_OP_PRESS || b[off] > ONION_OP_WAIT || off + 2 > t->len) return false;
+        off += 2;
+    }
+    return false;
+}
+
+bool onion_action_table_load(onion_action_table_t *t, const uint8_t *blob, size_t len) {
+    t->len = 0;
+    t->layers = t->chords = t->programs = 0;
+    if (len == 0) return true;
+    if (len < ACTION_HDR_LEN || len > ONION_ACTION_TABLE_MAX) return false;
+    if (blob[0] != ONION_ACTION_TABLE_VERSION || blob[1] != MUX_CHANNELS_COUNT) return false;
+    if (blob[2] > ONION_ACTION_LAYERS - 1 || blob[3] > ONION_ACTION_MAX_CHORDS || blob[4] > ONION_ACTION_MAX) return false;
+
+    const size_t layer_off = ACTION_HDR_LEN;
+    const size_t chord_off = layer_off + (size_t)blob[2] * MUX_CHANNELS_COUNT;
+    const size_t index_off = chord_off + (size_t)blob[3] * ACTION_CHORD_LEN;
+    const size_t code_off = index_off + (size_t)blob[4] * 2;
+    if (code_off > len) return false;
+
+    memcpy(t->blob, blob, len);
+    t->len = (uint16_t)len;
+    t->layers = blob[2];
+    t->chords = blob[3];
+    t->layer_off = (uint16_t)layer_off;
+    t->chord_off = (uint16_t)chord_off;
+    for (int i = 0; i < blob[4]; i++) {
+        uint32_t off = code_off + action_rd16(&blob[index_off + 2 * i]);
+        if (!action_program_valid(t, off)) {
+            t->len = 0;
+            t->layers = t->chords = 0;
+            return false;
+        }
+        t->program_off[i] = (uint16_t)off;
+    }
+    t->programs = blob[4];
+    return true;
+}
+
+/**
+ * @brief First op of the program an action code runs, or NULL if the table has none.
+ */
+static const uint8_t *action_program(const onion_action_table_t *t, uint8_t code) {
+    unsigned n = code - ONION_ACTION_FIRST;
+    if (!ONION_ACTION_IS_PROGRAM(code) || n >= t->programs) return NULL;
+    return &t->blob[t->program_off[n]];
+}
+
+static onion_mask_t action_chord_mask(const onion_action_table_t *t, int i) {
+    return (onion_mask_t)action_rd32(&t->blob[t->chord_off + i * ACTION_CHORD_LEN]);
+}
+
+/* --- Sequences --- */
+
+static void action_seq_push(onion_action_engine_t *e, uint16_t pc, uint8_t tap_usage) {
+    if (e->seq_count == ONION_ACTION_SEQ_DEPTH) return;   /* Dropped: the player is saturated */
+    onion_action_seq_t *s = &e->seq[(e->seq_head + e->seq_count++) % ONION_ACTION_SEQ_DEPTH];
+    s->pc = pc;
+    s->press_usage = tap_usage;
+    s->release_usage = 0;
+}
+
+static void action_seq_pop(onion_action_engine_t *e) {
+    e->seq_head = (uint8_t)((e->seq_head + 1) % ONION_ACTION_SEQ_DEPTH);
+    e->seq_count--;
+}
+
+/**
+ * @brief Presses or releases a usage held by the sequence player.
+ */
+static void action_seq_key(onion_action_engine_t *e, uint8_t usage, bool down) {
+    int free_slot = -1;
+
+    if (usage == 0) return;
+    for (int i = 0; i < ONION_ACTION_SEQ_KEYS; i++) {
+        if (e->seq_keys[i] == usage) {
+            if (!down) e->seq_keys[i] = 0;
+            return;
+        }
+        if (e->seq_keys[i] == 0 && free_slot < 0) free_slot = i;
+    }
+    if (down && free_slot >= 0) e->seq_keys[free_slot] = usage;
+}
+
+static bool action_seq_keys_held(const onion_action_engine_t *e) {
+    for (int i = 0; i < ONION_ACTION_SEQ_KEYS; i++) {
+        if (e->seq_keys[i]) return true;
+    }
+    return false;
+}
+
+/* --- Slots (pads and the active chord) --- */
+
+/**
+ * @brief Highest active layer (0 = base).
+ */
+static int action_layer(const onion_action_engine_t *e) {
+    uint8_t active = e->layer_held | e->layer_toggled;
+    return active ? 31 - __builtin_clz(active) : 0;
+}
+
+/**
+ * @brief Code of a pad on the active layer.
+ */
+static uint8_t action_resolve(const onion_action_engine_t *e, const onion_action_table_t *t,
+                              const onion_key_t *lut, int ch) {
+    for (int l = action_layer(e); l >= 1; l--) {
+        if (l > t->layers) continue;
+        uint8_t code = t->blob[t->layer_off + (l - 1) * MUX_CHANNELS_COUNT + ch];
+        if (code != ONION_ACTION_TRANSPARENT) return code;
+    }
+    return lut[ch].keycode;
+}
+
+static void action_press(onion_action_engine_t *e, const onion_action_table_t *t, int slot,
+                         uint8_t code, int64_t now_us) {
+    e->code[slot] = code;
+    e->press_us[slot] = now_us;
+    e->hold[slot] = 0;
+    e->tap_pending[slot] = false;
+
+    if (!ONION_ACTION_IS_PROGRAM(code)) {
+        e->hold[slot] = (code == ONION_ACTION_TRANSPARENT) ? 0 : code;
+        return;
+    }
+    const uint8_t *p = action_program(t, code);
+    if (p == NULL) return;
+    switch (p[0]) {
+    case ONION_OP_TAPHOLD:
+        e->tap_pending[slot] = true;
+        break;
+    case ONION_OP_LAYER_MO:
+        break;   /* Held layers are recomputed from the slots */
+    case ONION_OP_LAYER_TG:
+        e->layer_toggled ^= (uint8_t)(1u << p[1]);
+        break;
+    default:
+        action_seq_push(e, (uint16_t)(p - t->blob), 0);
+        break;
+    }
+}
+
+static void action_release(onion_action_engine_t *e, const onion_action_table_t *t, int slot) {
+    const uint8_t *p = action_program(t, e->code[slot]);
+
+    /* Released within the term: the tap usage goes out as a press/release pair */
+    if (p != NULL && p[0] == ONION_OP_TAPHOLD && e->tap_pending[slot]) {
+        action_seq_push(e, ACTION_PC_NONE, p[1]);
+    }
+    e->code[slot] = 0;
+    e->hold[slot] = 0;
+    e->tap_pending[slot] = false;
+}
+
+/**
+ * @brief A chord pad released before its chord formed: it was a tap of its own code.
+ */
+static void action_tap_pad(onion_action_engine_t *e, const onion_action_table_t *t,
+                           const onion_key_t *lut, int ch) {
+    uint8_t code = action_resolve(e, t, lut, ch);
+
+    action_press(e, t, ch, code, e->press_us[ch]);
+    if (e->hold[ch]) action_seq_push(e, ACTION_PC_NONE, e->hold[ch]);
+    action_release(e, t, ch);
+}
+
+/**
+ * @brief Rebuilds the held-layer bits from the slots holding a LAYER_MO program.
+ */
+static void action_update_layers(onion_action_engine_t *e, const onion_action_table_t *t) {
+    uint8_t held = 0;
+
+    for (int slot = 0; slot <= ACTION_SLOT_CHORD; slot++) {
+        const uint8_t *p = action_program(t, e->code[slot]);
+        if (p != NULL && p[0] == ONION_OP_LAYER_MO) held |= (uint8_t)(1u << p[1]);
+    }
+    e->layer_held = held;
+}
+
+/* --- Output --- */
+
+static void action_out_push(onion_action_engine_t *e) {
+    if (e->out_count == ONION_ACTION_OUT_LEN) {
+        /* Full: the newest state supersedes the newest queued one */
+        e->out[(e->out_head + e->out_count - 1) % ONION_ACTION_OUT_LEN] = e->state;
+        return;
+    }
+    e->out[(e->out_head + e->out_count++) % ONION_ACTION_OUT_LEN] = e->state;
+}
+
+/**
+ * @brief Rebuilds the keyboard state from the slots and the sequence player; queues it if it changed.
+ */
+static void action_emit(onion_action_engine_t *e) {
+    uint8_t usages[ACTION_SLOT_CHORD + 1 + ONION_ACTION_SEQ_KEYS];
+    size_t n = 0;
+    onion_hid_report_t report;
+
+    for (int slot = 0; slot <= ACTION_SLOT_CHORD; slot++) {
+        if (e->hold[slot]) usages[n++] = e->hold[slot];
+    }
+    for (int i = 0; i < ONION_ACTION_SEQ_KEYS; i++) {
+        if (e->seq_keys[i]) usages[n++] = e->seq_keys[i];
+    }
+    onion_hid_build_usages(usages, n, &report);
+    if (onion_hid_report_equal(&report, &e->state)) return;
+    e->state = report;
+    action_out_push(e);
+}
+
+/**
+ * @brief Plays sequence steps that are due, one report each, within the per-sweep budget.
+ */
+static void action_play(onion_action_engine_t *e, const onion_action_table_t *t, int64_t now_us, uint32_t step_us) {
+    int budget = ONION_ACTION_OPS_PER_SWEEP;
+
+    /* Coming out of idle: start now instead of catching up in a burst */
+    if (e->seq_next_us + step_us < now_us) e->seq_next_us = now_us;
+
+    while (e->seq_count > 0 && budget-- > 0 && e->seq_next_us <= now_us && e->out_count < ONION_ACTION_OUT_LEN) {
+        onion_action_seq_t *s = &e->seq[e->seq_head];
+
+        if (s->press_usage) {
+            action_seq_key(e, s->press_usage, true);
+            s->release_usage = s->press_usage;
+            s->press_usage = 0;
+        } else if (s->release_usage) {
+            action_seq_key(e, s->release_usage, false);
+            s->release_usage = 0;
+        } else if (s->pc + 1 >= t->len || t->blob[s->pc] < ONION_OP_PRESS || t->blob[s->pc] > ONION_OP_WAIT) {
+            /* END (or a table swapped under the sequence): let go of what it still holds */
+            bool held = action_seq_keys_held(e);
+            memset(e->seq_keys, 0, sizeof(e->seq_keys));
+            action_seq_pop(e);
+            if (!held) continue;
+        } else {
+            uint8_t op = t->blob[s->pc];
+            uint8_t arg = t->blob[s->pc + 1];
+            s->pc += 2;
+            if (op == ONION_OP_WAIT) {
+                e->seq_next_us = now_us + (int64_t)arg * 10000;
+                continue;
+            }
+            action_seq_key(e, arg, op != ONION_OP_RELEASE);
+            if (op == ONION_OP_TAP) s->release_usage = arg;
+        }
+        action_emit(e);
+        e->seq_next_us += step_us;
+    }
+    /* Idle with the last spacing served: the next sequence restarts the clock at its first step */
+    if (e->seq_count == 0 && e->seq_next_us <= now_us) e->seq_next_us = 0;
+}
+
+/* --- Engine --- */
+
+void onion_action_init(onion_action_engine_t *e) {
+    memset(e, 0, sizeof(*e));
+}
+
+void onion_action_step(onion_action_engine_t *e, const onion_action_table_t *t, const onion_key_t *lut,
+                       onion_mask_t pressed_mask, int64_t now_us, uint32_t step_us) {
+    const onion_mask_t rise = pressed_mask & ~e->prev_mask;
+    const onion_mask_t fall = e->prev_mask & ~pressed_mask;
+    onion_mask_t chord_pads = 0;
+
+    for (int i = 0; i < t->chords; i++) {
+        chord_pads |= action_chord_mask(t, i);
+    }
+
+    /* Releases first, so a layer let go of in this sweep no longer applies to new presses */
+    for (onion_mask_t m = fall; m != 0; m &= m - 1) {
+        const int ch = __builtin_ctz(m);
+        const onion_mask_t bit = ONION_MASK_BIT(ch);
+        if (e->chord_used & bit) {
+            /* The first chord pad let go of ends the chord */
+            e->chord_used &= ~bit;
+            if (e->code[ACTION_SLOT_CHORD]) action_release(e, t, ACTION_SLOT_CHORD);
+        } else if (e->chord_wait & bit) {
+            e->chord_wait &= ~bit;
+            action_tap_pad(e, t, lut, ch);
+        } else {
+            action_release(e, t, ch);
+        }
+    }
+    action_update_layers(e, t);
+
+    for (onion_mask_t m = rise; m != 0; m &= m - 1) {
+        const int ch = __builtin_ctz(m);
+        if (chord_pads & ONION_MASK_BIT(ch)) {
+            e->chord_wait |= ONION_MASK_BIT(ch);
+            e->press_us[ch] = now_us;
+        } else {
+            action_press(e, t, ch, action_resolve(e, t, lut, ch), now_us);
+        }
+    }
+
+    /* Chords: every pad of one chord down within the window */
+    if (e->chord_wait != 0 && e->chord_used == 0) {
+        for (int i = 0; i < t->chords; i++) {
+            const onion_mask_t chord = action_chord_mask(t, i);
+            if (chord == 0 || (chord & ~e->chord_wait) != 0) continue;
+            e->chord_wait &= ~chord;
+            e->chord_used = chord;
+            action_press(e, t, ACTION_SLOT_CHORD, t->blob[t->chord_off + i * ACTION_CHORD_LEN + 4], now_us);
+            break;
+        }
+    }
+    for (onion_mask_t m = e->chord_wait; m != 0; m &= m - 1) {
+        const int ch = __builtin_ctz(m);
+        if (now_us - e->press_us[ch] < (int64_t)ONION_ACTION_CHORD_MS * 1000) continue;
+        e->chord_wait &= ~ONION_MASK_BIT(ch);
+        action_press(e, t, ch, action_resolve(e, t, lut, ch), e->press_us[ch]);
+    }
+    action_update_layers(e, t);
+
+    /* Tap-hold slots past their term turn into holds */
+    for (int slot = 0; slot <= ACTION_SLOT_CHORD; slot++) {
+        if (!e->tap_pending[slot]) continue;
+        const uint8_t *p = action_program(t, e->code[slot]);
+        if (p == NULL || p[0] != ONION_OP_TAPHOLD) {
+            e->tap_pending[slot] = false;
+        } else if (now_us - e->press_us[slot] >= (int64_t)p[3] * 10000) {
+            e->tap_pending[slot] = false;
+            e->hold[slot] = p[2];
+        }
+    }
+
+    e->prev_mask = pressed_mask;
+    action_emit(e);
+    action_play(e, t, now_us, step_us);
+}
+
+const onion_hid_report_t *onion_action_peek(const onion_action_engine_t *e) {
+    return e->out_count ? &e->out[e->out_head] : NULL;
+}
+
+void onion_action_pop(onion_action_engine_t *e) {
+    if (e->out_count == 0) return;
+    e->out_head = (uint8_t)((e->out_head + 1) % ONION_ACTION_OUT_LEN);
+    e->out_count--;
+}
+
+const onion_hid_report_t *onion_action_state(const onion_action_engine_t *e) {
+    return &e->state;
+}
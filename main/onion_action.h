@@ -0,0 +1,136 @@
+/**
+ * @file onion_action.h
+ * @brief Action engine between the debounced pressed mask and the HID report builder.
+ *
+ * A pad's keycode is either a HID usage (0x01-0xE7), sent while the pad is
+ * held, or an action code 0xF0 + n that runs program n of the action table:
+ * tap vs hold, a momentary or toggled layer, or a macro sequence. Layers remap
+ * pads to other codes; chords map several pads pressed together to one code.
+ * With an empty table every pad sends its keycode, exactly as without the
+ * engine.
+ *
+ * Sequences (macros, and the press/release pair of a tap) are played one step
+ * per report, spaced by the connection interval, so every step reaches the
+ * host as its own notification. Each onion_action_step() interprets at most
+ * ONION_ACTION_OPS_PER_SWEEP ops and queues at most ONION_ACTION_OUT_LEN
+ * reports, which bounds its cost per sweep whatever the table holds.
+ *
+ * Table blob (little-endian), validated once by onion_action_table_load():
+ *   [version][channels][layers L][chords C][programs P]
+ *   L * channels bytes : code per pad on layers 1..L (ONION_ACTION_TRANSPARENT = layer below)
+ *   C * 5 bytes        : chord {pad mask u32, code}
+ *   P * 2 bytes        : program offsets into the bytecode area
+ *   bytecode           : programs, see ONION_OP_*
+ *
+ * Pure logic like onion_pipeline.h: builds on a PC with -DONION_HOST_BUILD.
+ */
+
+#ifndef ONION_ACTION_H
+#define ONION_ACTION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "onion_config.h"
+#include "onion_hid.h"
+
+#define ONION_ACTION_TABLE_VERSION 1
+
+/* --- Codes (pad keycode, layer map entry or chord result) --- */
+#define ONION_ACTION_NONE        0x00 /**< Nothing */
+#define ONION_ACTION_TRANSPARENT 0xE8 /**< Layer maps only: use the code of the layer below */
+#define ONION_ACTION_FIRST       0xF0 /**< 0xF0 + n runs program n */
+#define ONION_ACTION_IS_PROGRAM(code) ((code) >= ONION_ACTION_FIRST)
+
+/* --- Bytecode. A program is either one behaviour op or a macro ending in END --- */
+#define ONION_OP_END      0x00 /**< End of a macro */
+#define ONION_OP_TAPHOLD  0x01 /**< tap, hold, term (10 ms): tap usage if released within term, else hold usage while held */
+#define ONION_OP_LAYER_MO 0x02 /**< layer: active while the pad is held */
+#define ONION_OP_LAYER_TG 0x03 /**< layer: toggled on every press */
+#define ONION_OP_PRESS    0x10 /**< usage: press and keep held */
+#define ONION_OP_RELEASE  0x11 /**< usage: release */
+#define ONION_OP_TAP      0x12 /**< usage: press, then release on the next step */
+#define ONION_OP_WAIT     0x13 /**< n: pause n * 10 ms */
+
+/**
+ * @brief Validated action table with its section offsets.
+ */
+typedef struct {
+    uint16_t len;                           /**< Blob length, 0 for an empty table */
+    uint8_t  layers;                        /**< Layer maps (layers above the base layer) */
+    uint8_t  chords;
+    uint8_t  programs;
+    uint16_t layer_off;
+    uint16_t chord_off;
+    uint16_t program_off[ONION_ACTION_MAX]; /**< Absolute offsets of the programs in blob */
+    uint8_t  blob[ONION_ACTION_TABLE_MAX];
+} onion_action_table_t;
+
+/**
+ * @brief A sequence being played or waiting (engine internal).
+ */
+typedef struct {
+    uint16_t pc;                            /**< Next op in the table blob, 0xFFFF for a bare tap */
+    uint8_t  press_usage;                   /**< Usage to press on the next step (bare tap) */
+    uint8_t  release_usage;                 /**< Usage to release on the next step (second half of a tap) */
+} onion_action_seq_t;
+
+/**
+ * @brief Engine state (zero-initialize with onion_action_init()).
+ */
+typedef struct {
+    uint8_t  code[MUX_CHANNELS_COUNT + 1];      /**< Code resolved at press time; last slot is the active chord */
+    uint8_t  hold[MUX_CHANNELS_COUNT + 1];      /**< Usage held for the slot, 0 while none */
+    int64_t  press_us[MUX_CHANNELS_COUNT + 1];
+    bool     tap_pending[MUX_CHANNELS_COUNT + 1]; /**< Tap-hold slot still within its term */
+    onion_mask_t prev_mask;
+    onion_mask_t chord_wait;                    /**< Chord pads pressed but not yet resolved */
+    onion_mask_t chord_used;                    /**< Pads consumed by the active chord */
+    uint8_t  layer_held;                        /**< Bit n: layer n held by a LAYER_MO pad */
+    uint8_t  layer_toggled;
+    onion_action_seq_t seq[ONION_ACTION_SEQ_DEPTH];
+    uint8_t  seq_head;
+    uint8_t  seq_count;
+    int64_t  seq_next_us;                       /**< Earliest time of the next sequence step */
+    uint8_t  seq_keys[ONION_ACTION_SEQ_KEYS];   /**< Usages held by sequences */
+    onion_hid_report_t state;                   /**< Newest keyboard state */
+    onion_hid_report_t out[ONION_ACTION_OUT_LEN];
+    uint8_t  out_head;
+    uint8_t  out_count;
+} onion_action_engine_t;
+
+/**
+ * @brief Validates a table blob and indexes its sections.
+ * @param len 0 loads the empty table.
+ * @return false if the blob is malformed; t is then the empty table.
+ */
+bool onion_action_table_load(onion_action_table_t *t, const uint8_t *blob, size_t len);
+
+/**
+ * @brief Resets the engine: nothing held, no layer, no sequence.
+ */
+void onion_action_init(onion_action_engine_t *e);
+
+/**
+ * @brief Runs one sweep through the engine and queues the resulting reports.
+ * @param t Action table of this sweep's configuration bank.
+ * @param lut Pad table of the same bank (base layer).
+ * @param pressed_mask Debounced pressed mask.
+ * @param now_us Sweep time.
+ * @param step_us Spacing of sequence steps (the connection interval).
+ */
+void onion_action_step(onion_action_engine_t *e, const onion_action_table_t *t, const onion_key_t *lut,
+                       onion_mask_t pressed_mask, int64_t now_us, uint32_t step_us);
+
+/**
+ * @brief Oldest queued report, or NULL if none; remove it with onion_action_pop() once delivered.
+ */
+const onion_hid_report_t *onion_action_peek(const onion_action_engine_t *e);
+void onion_action_pop(onion_action_engine_t *e);
+
+/**
+ * @brief Newest keyboard state (for re-submission to a new host).
+ */
+const onion_hid_report_t *onion_action_state(const onion_action_engine_t *e);
+
+#endif // ONION_ACTION_H
@@ -0,0 +1,96 @@
+/**
+ * @file onion_baseline.c
+ * @brief Live baseline estimator, CAL pass and threshold conversions.
+ */
+
+#include "onion_baseline.h"
+#include "onion_config.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+static const char *TAG = "ONION_BASELINE";
+
+/** @brief Estimator of the live pipeline (written only by the sweep task). */
+static onion_baseline_t live;
+
+/** @brief CAL pass state: sums are owned by the sweep task while cal_remaining > 0. */
+static uint32_t cal_sum[MUX_CHANNELS_COUNT];
+static uint32_t cal_sweeps = 0;
+static uint32_t cal_remaining = 0;
+static SemaphoreHandle_t cal_done = NULL;
+static StaticSemaphore_t cal_done_buf;
+
+/**
+ * @brief Accumulates one sweep of a CAL pass and applies the averages when it completes.
+ */
+static void baseline_calibrate_step(const uint16_t raw[MUX_CHANNELS_COUNT], uint32_t remaining) {
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        cal_sum[ch] += raw[ch];
+    }
+    /* Fails if onion_baseline_calibrate() gave up on the pass meanwhile */
+    if (!__atomic_compare_exchange_n(&cal_remaining, &remaining, remaining - 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (remaining > 1) return;
+
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        live.q[ch] = (cal_sum[ch] << ONION_BASELINE_FRAC_BITS) / cal_sweeps;
+    }
+    live.held_mask = 0;
+    live.valid = true;
+    xSemaphoreGive(cal_done);
+}
+
+onion_mask_t onion_baseline_process(const uint16_t raw[MUX_CHANNELS_COUNT], onion_mask_t prev_mask,
+                                    const onion_key_t *lut, int64_t now_us) {
+    uint32_t remaining = __atomic_load_n(&cal_remaining, __ATOMIC_ACQUIRE);
+    if (remaining > 0) {
+        baseline_calibrate_step(raw, remaining);
+        return 0;
+    }
+
+    return onion_baseline_classify(&live, raw, prev_mask, lut, now_us);
+}
+
+bool onion_baseline_calibrate(uint8_t sweeps, uint32_t timeout_ms) {
+    if (sweeps == 0) return false;
+    if (cal_done == NULL) cal_done = xSemaphoreCreateBinaryStatic(&cal_done_buf);
+    if (__atomic_load_n(&cal_remaining, __ATOMIC_ACQUIRE) > 0) return false;
+
+    xSemaphoreTake(cal_done, 0);
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        cal_sum[ch] = 0;
+    }
+    cal_sweeps = sweeps;
+    /* Hands the sums over to the sweep task */
+    __atomic_store_n(&cal_remaining, sweeps, __ATOMIC_RELEASE);
+
+    if (xSemaphoreTake(cal_done, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        ESP_LOGW(TAG, "Calibration timed out");
+        __atomic_store_n(&cal_remaining, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+    ESP_LOGI(TAG, "Baselines calibrated over %u sweeps", sweeps);
+    return true;
+}
+
+uint16_t onion_baseline_get(int ch) {
+    return (uint16_t)(__atomic_load_n(&live.q[ch], __ATOMIC_RELAXED) >> ONION_BASELINE_FRAC_BITS);
+}
+
+uint16_t onion_baseline_get_threshold(int ch, const onion_key_t *key) {
+    uint16_t delta = key->delta;
+    if (ONION_BASELINE_IS_ABSOLUTE(delta) || !live.valid) return key->threshold;
+
+    uint16_t base = onion_baseline_get(ch);
+    return (base > delta) ? (uint16_t)(base - delta) : 0;
+}
+
+uint16_t onion_baseline_delta_for(int ch, uint16_t threshold) {
+    if (!live.valid) return 0;
+
+    uint16_t base = onion_baseline_get(ch);
+    return (base > threshold) ? (uint16_t)(base - threshold) : 1;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file onion_baseline.h
+ * @brief Per-channel adaptive baseline tracking and touch classification.
+ *
+ * Every channel keeps an untouched reference level in Q4 fixed point. It is
+ * updated from idle readings with an asymmetric IIR: readings above the
+ * baseline pull it up quickly (ONION_BASELINE_RISE_SHIFT), readings below pull
+ * it down slowly (ONION_BASELINE_FALL_SHIFT), so humidity and temperature drift
+ * are followed while a slow approaching finger is not absorbed. A channel is
+ * pressed once it sinks delta mV below its baseline and released below
+ * delta minus the hysteresis band. A pad that stays pressed for
+ * ONION_BASELINE_STUCK_MS is re-seeded at its current reading, so a step change
+ * of the untouched level cannot latch it pressed. Integer arithmetic only.
+ */
+
+#ifndef ONION_BASELINE_H
+#define ONION_BASELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "onion_config.h"
+
+/** @brief Fractional bits of the baseline accumulators. */
+#define ONION_BASELINE_FRAC_BITS 4
+
+/**
+ * @brief true if a pad with this delta uses the absolute threshold (CONFIG_ONION_FILTER_*).
+ * Constant in the fixed filter modes, so the sweep loop carries no mode test.
+ */
+#if CONFIG_ONION_FILTER_ABSOLUTE
+#define ONION_BASELINE_IS_ABSOLUTE(delta) ((void)(delta), true)
+#elif CONFIG_ONION_FILTER_ADAPTIVE
+#define ONION_BASELINE_IS_ABSOLUTE(delta) ((void)(delta), false)
+#else
+#define ONION_BASELINE_IS_ABSOLUTE(delta) ((delta) == 0)
+#endif
+
+/**
+ * @brief Estimator state: baseline per channel in Q4 fixed point.
+ */
+typedef struct {
+    uint32_t q[MUX_CHANNELS_COUNT];
+    uint32_t held_since_ms[MUX_CHANNELS_COUNT]; /**< Start of the current press (valid in held_mask) */
+    onion_mask_t held_mask; /**< Pads pressed since held_since_ms, for the stuck-press recovery */
+    bool     valid;   /**< false until seeded from the first sweep */
+} onion_baseline_t;
+
+/**
+ * @brief Classifies one sweep against an estimator and updates its idle channels.
+ * * Pure function of its arguments (defined in onion_pipeline.c); the live
+ * pipeline uses onion_baseline_process().
+ * @param b Estimator state (zero-initialize to start unseeded).
+ * @param raw Raw value per channel.
+ * @param prev_mask Pressed mask of the previous sweep (hysteresis state).
+ * @param lut Configuration table.
+ * @param now_us Time of the sweep, for the stuck-press recovery.
+ * @return Pressed mask of this sweep.
+ */
+onion_mask_t onion_baseline_classify(onion_baseline_t *b, const uint16_t raw[MUX_CHANNELS_COUNT],
+                                     onion_mask_t prev_mask, const onion_key_t *lut, int64_t now_us);
+
+/**
+ * @brief Classifies one sweep and updates the baselines of the idle channels.
+ * * The first sweep after boot seeds the baselines directly. While a CAL pass is
+ * collecting, the sweep is accumulated and reported as untouched.
+ * @param raw Raw value per channel.
+ * @param prev_mask Pressed mask of the previous sweep (hysteresis state).
+ * @param lut Configuration bank of this sweep.
+ * @param now_us esp_timer time of the sweep.
+ * @return Pressed mask of this sweep.
+ * @note Called only from the task that runs onion_touch_sweep().
+ */
+onion_mask_t onion_baseline_process(const uint16_t raw[MUX_CHANNELS_COUNT], onion_mask_t prev_mask,
+                                    const onion_key_t *lut, int64_t now_us);
+
+/**
+ * @brief Re-measures every baseline by averaging the next sweeps (pads must be untouched).
+ * * Blocks the calling task until the pass completes; must not be called from the sweep task.
+ * @param sweeps Number of sweeps to average.
+ * @param timeout_ms Maximum time to wait.
+ * @return true if the new baselines were applied.
+ */
+bool onion_baseline_calibrate(uint8_t sweeps, uint32_t timeout_ms);
+
+/**
+ * @brief Returns the current baseline of a channel, in mV.
+ */
+uint16_t onion_baseline_get(int ch);
+
+/**
+ * @brief Returns the absolute level at which the channel currently triggers.
+ * * baseline - delta in adaptive mode, the stored threshold otherwise.
+ */
+uint16_t onion_baseline_get_threshold(int ch, const onion_key_t *key);
+
+/**
+ * @brief Converts an absolute trigger level into a delta against the current baseline.
+ * * Used for SET commands from configurators that still send absolute thresholds.
+ * @return The delta (at least 1), or 0 if the baseline is not known yet.
+ */
+uint16_t onion_baseline_delta_for(int ch, uint16_t threshold);
+
+#endif // ONION_BASELINE_H
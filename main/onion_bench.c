@@ -0,0 +1,125 @@
+/**
+ * @file onion_bench.c
+ * @brief Synthetic signal generator and pipeline micro-benchmarks.
+ */
+
+#include "onion_bench.h"
+
+#if CONFIG_ONION_BENCH
+
+#include "onion_config.h"
+#include "onion_touch.h"
+#include "onion_scan.h"
+#include "onion_pipeline.h"
+#include "onion_telemetry.h"
+#include "onion_storage.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include "string.h"
+
+#define BENCH_FRAMES        64     /**< Synthetic frames, replayed cyclically */
+/** @brief Synthetic readings in mV: idle above the default trigger level, touches well past it. */
+#define BENCH_IDLE_LEVEL    (DEFAULT_THRESHOLD + DEFAULT_DELTA / 2)
+#define BENCH_TOUCH_DEPTH   (2 * DEFAULT_DELTA)
+#define BENCH_NOISE         6
+#define BENCH_SWEEPS        4000
+#define BENCH_REPORTS       10000
+#define BENCH_ENCODES       2000
+#define BENCH_ENGINE_MS     1000
+
+_Static_assert(BENCH_IDLE_LEVEL + MUX_CHANNELS_COUNT + BENCH_FRAMES / 4 + BENCH_NOISE <= ONION_CALI_NOMINAL_MV,
+               "Synthetic idle readings must stay inside the calibrated range");
+_Static_assert(BENCH_IDLE_LEVEL - BENCH_TOUCH_DEPTH + MUX_CHANNELS_COUNT + BENCH_FRAMES / 4 + BENCH_NOISE <
+               DEFAULT_THRESHOLD, "Synthetic touches must cross the absolute threshold");
+
+static uint16_t bench_frames[BENCH_FRAMES][MUX_CHANNELS_COUNT];
+static onion_mask_t bench_masks[BENCH_FRAMES];
+
+/**
+ * @brief Fills the frame set: per-channel idle level with drift and noise, one touched pad per 8 frames.
+ */
+static void bench_generate(void) {
+    uint32_t lcg = 0x1234567u;
+
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        int touched = (f / 8) % MUX_CHANNELS_COUNT;
+        bench_masks[f] = 0;
+        for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+            lcg = lcg * 1664525u + 1013904223u;
+            int32_t v = BENCH_IDLE_LEVEL + ch + f / 4;
+            v += (int32_t)((lcg >> 24) % (2 * BENCH_NOISE + 1)) - BENCH_NOISE;
+            if (ch == touched && (f % 8) >= 2) {
+                v -= BENCH_TOUCH_DEPTH;
+                bench_masks[f] |= ONION_MASK_BIT(ch);
+            }
+            bench_frames[f][ch] = (uint16_t)v;
+        }
+    }
+}
+
+static void bench_print(const char *name, uint32_t iterations, int64_t total_us) {
+    printf("BENCH:%s,%lu,%lld,%lu\n", name, (unsigned long)iterations, (long long)total_us,
+           (unsigned long)(iterations ? (uint64_t)total_us * 1000u / iterations : 0));
+}
+
+void onion_bench_run(void) {
+    static onion_pipeline_t pipeline;
+    onion_key_t lut[MUX_CHANNELS_COUNT];
+    volatile uint16_t sink = 0;
+    int64_t t0;
+
+    bench_generate();
+    onion_lut_snapshot(lut);
+
+    /* Classification throughput: baseline + hysteresis + debounce (+ report on change) per sweep */
+    onion_hid_report_t report;
+    onion_pipeline_init(&pipeline);
+    t0 = esp_timer_get_time();
+    for (int i = 0; i < BENCH_SWEEPS; i++) {
+        sink ^= onion_pipeline_step(&pipeline, bench_frames[i % BENCH_FRAMES], lut,
+                                    (int64_t)i * ONION_ACTIVE_SCAN_PERIOD_MS * 1000, &report);
+    }
+    bench_print("classify", BENCH_SWEEPS, esp_timer_get_time() - t0);
+
+    /* Report builder */
+    t0 = esp_timer_get_time();
+    for (int i = 0; i < BENCH_REPORTS; i++) {
+        onion_hid_build_report(bench_masks[i % BENCH_FRAMES], lut, &report);
+        sink ^= report.kb.keys[0];
+    }
+    bench_print("hid_build", BENCH_REPORTS, esp_timer_get_time() - t0);
+
+    /* Telemetry framing of one sweep (COBS + CRC) */
+    onion_tlm_frame_t pkt = { .pressed_mask = bench_masks[3] };
+    uint8_t out[2 * sizeof(pkt) + 8];
+    memcpy(pkt.raw, bench_frames[3], sizeof(pkt.raw));
+    t0 = esp_timer_get_time();
+    for (int i = 0; i < BENCH_ENCODES; i++) {
+        pkt.timestamp_us = (uint32_t)i;
+        sink ^= (uint16_t)onion_telemetry_encode(ONION_TLM_PKT_FRAME, (uint16_t)i, &pkt, sizeof(pkt), out, sizeof(out));
+    }
+    bench_print("tlm_encode", BENCH_ENCODES, esp_timer_get_time() - t0);
+
+    /* Live scan engine rate (real MUX and ADC) */
+    uint32_t steps = onion_scan_get_step_count();
+    t0 = esp_timer_get_time();
+    vTaskDelay(pdMS_TO_TICKS(BENCH_ENGINE_MS));
+    int64_t elapsed = esp_timer_get_time() - t0;
+    steps = onion_scan_get_step_count() - steps;
+    printf("BENCH:engine,%lu,%lld,%lu,%lu\n", (unsigned long)steps, (long long)elapsed,
+           (unsigned long)(steps ? (uint64_t)elapsed * 1000u / steps : 0),
+           (unsigned long)((uint64_t)steps * 1000000u / (uint64_t)elapsed / ONION_MUX_ADDRESSES));
+
+    /* Stall of a synchronous NVS commit of the full configuration */
+    t0 = esp_timer_get_time();
+    onion_config_save();
+    bench_print("nvs_save", 1, esp_timer_get_time() - t0);
+
+    printf("BENCH:END\n");
+    fflush(stdout);
+    (void)sink;
+}
+
+#endif // CONFIG_ONION_BENCH
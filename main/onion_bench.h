@@ -0,0 +1,29 @@
+/**
+ * @file onion_bench.h
+ * @brief On-device benchmark of the scan and report pipeline (BENCH command).
+ *
+ * Built only with CONFIG_ONION_BENCH; the overlay sdkconfig.bench enables it:
+ *   idf.py -D SDKCONFIG_DEFAULTS="sdkconfig.defaults;sdkconfig.bench" build
+ *
+ * The processing stages run on frames from a synthetic signal generator
+ * (idle level, slow drift, noise, periodic touches) with private filter
+ * state, so the live pipeline keeps running undisturbed. The scan engine
+ * rate is measured on the real hardware. Results are printed as
+ *   BENCH:name,iterations,total_us,ns_per_op[,value]
+ * followed by BENCH:END, one line per benchmark, for regression tracking.
+ */
+
+#ifndef ONION_BENCH_H
+#define ONION_BENCH_H
+
+#include "sdkconfig.h"
+
+#if CONFIG_ONION_BENCH
+/**
+ * @brief Runs every benchmark and prints the results (blocks for about two seconds).
+ * @note Call from the serial command task; includes one real NVS commit.
+ */
+void onion_bench_run(void);
+#endif
+
+#endif // ONION_BENCH_H
@@ -14,7 +14,13 @@
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
 #include "store/config/ble_store_config.h"
+#include "onion_report_queue.h"
+#include "onion_link.h"
+#include "onion_stats.h"
+#include "onion_gatt_tlm.h"
+#include "onion_evlog.h"
 #include "driver/gpio.h"
+#include "esp_timer.h"
 #include "string.h"
 
 /* Forward declaration for private storage initialization */
@@ -22,7 +28,8 @@ extern void ble_store_config_init(void);
 
 /**
  * @brief HID Report Descriptor for a standard Keyboard profile.
- * Defines the structure of data sent to the host (modifiers, reserved, 6 keycodes).
+ * Defines the structure of data sent to the host (modifiers, reserved, 6 keycodes)
+ * and, with ONION_HID_NKRO, a second report carrying a full usage bitmap.
  */
 const uint8_t hid_report_map[] = {
     0x05, 0x01, /* Usage Page (Generic Desktop) */
@@ -48,21 +55,83 @@ const uint8_t hid_report_map[] = {
     0x19, 0x00, /* Usage Minimum (0) */
     0x29, 0x65, /* Usage Maximum (101) */
     0x81, 0x00, /* Input (Data, Array) - Key array */
-    0xc0        /* End Collection */
+    0xc0,       /* End Collection */
+#if ONION_HID_NKRO
+    0x05, 0x01, /* Usage Page (Generic Desktop) */
+    0x09, 0x06, /* Usage (Keyboard) */
+    0xa1, 0x01, /* Collection (Application) */
+    0x85, 0x02, /* Report ID (2) */
+    0x05, 0x07, /* Usage Page (Key Codes) */
+    0x19, 0xe0, /* Usage Minimum (224 - Left Control) */
+    0x29, 0xe7, /* Usage Maximum (231 - Right GUI) */
+    0x15, 0x00, /* Logical Minimum (0) */
+    0x25, 0x01, /* Logical Maximum (1) */
+    0x75, 0x01, /* Report Size (1) */
+    0x95, 0x08, /* Report Count (8) */
+    0x81, 0x02, /* Input (Data, Variable, Absolute) - Modifier byte */
+    0x19, 0x00, /* Usage Minimum (0) */
+    0x29, 0x67, /* Usage Maximum (103) */
+    0x95, 0x68, /* Report Count (104) */
+    0x81, 0x02, /* Input (Data, Variable, Absolute) - Key bitmap */
+    0xc0,       /* End Collection */
+#endif
 };
 
 static const char *TAG = "ONION_BLE";
 
-/** @brief Local storage for BLE address type and connection handles */
+/** @brief Local storage for BLE address type and characteristic handles */
 uint8_t addr_type;
-uint16_t conn_handle = 0xFFFF;
 uint16_t report_handle;
-static uint16_t *telemetry_source = NULL;
-static onion_key_t *local_lut_ptr = NULL;
-static bool is_app_connected = false;
+#if ONION_HID_NKRO
+uint16_t nkro_report_handle;
+#endif
 
-
-uint16_t last_raw_values[16] = {0};
+/**
+ * @brief Per-host state of the report pipeline (NimBLE host task only).
+ */
+typedef struct {
+    uint16_t handle;                  /**< BLE_HS_CONN_HANDLE_NONE while the slot is free */
+    bool subscribed;                  /**< Host enabled notifications of the active input report */
+    onion_report_cursor_t cursor;     /**< Next shared report this host has not been sent */
+    onion_hid_report_t last_sent;     /**< Newest state notified to this host */
+    onion_hid_report_t catchup[ONION_BLE_CATCHUP_LEN]; /**< Merged states skipped over while lagging */
+    onion_report_stamp_t catchup_stamps[ONION_BLE_CATCHUP_LEN];
+    uint8_t catchup_count;            /**< Sent before the shared queue */
+    bool holdoff;                     /**< Waiting for this host's next connection event */
+    esp_timer_handle_t holdoff_timer;
+    struct ble_npl_event holdoff_ev;
+} onion_conn_t;
+
+/* --- HID report pipeline (scan loop -> NimBLE host task -> every subscribed host) --- */
+static onion_report_queue_t report_queue;
+static onion_conn_t conns[ONION_BLE_MAX_CONNS];
+static uint32_t conn_count = 0;            /**< Connected hosts */
+static uint32_t subscribed_count = 0;      /**< Hosts receiving reports (read by the producer) */
+static onion_hid_report_t last_submitted;  /**< Producer side: newest state accepted */
+static uint32_t submitted_generation = 0;  /**< Producer side: subscription set last_submitted belongs to */
+static uint32_t conn_generation = 0;       /**< Bumped by the host task whenever a host subscribes */
+/* Producer side: states built before the first subscription, see ONION_PRELINK_REPLAY_LEN */
+static onion_hid_report_t prelink_reports[ONION_PRELINK_REPLAY_LEN];
+static uint32_t prelink_count = 0;
+static bool prelink_open = true;
+static struct ble_npl_event report_tx_ev;
+static controller_state_t adv_state = STATE_ACTIVE;
+/** @brief Reconnect sequence, see ble_app_advertise(). */
+typedef enum {
+    ADV_PHASE_DIRECTED,
+    ADV_PHASE_FAST,
+    ADV_PHASE_SLOW,
+} adv_phase_t;
+static adv_phase_t adv_phase = ADV_PHASE_DIRECTED;
+static ble_addr_t reconnect_peer;          /**< Identity of the last host that encrypted the link */
+static bool reconnect_peer_valid = false;
+static struct ble_npl_event adv_update_ev;
+static uint32_t reports_merged = 0;
+static uint32_t reports_retried = 0;
+static uint32_t reports_resynced = 0;
+
+_Static_assert(ONION_BLE_MAX_CONNS <= CONFIG_BT_NIMBLE_MAX_CONNECTIONS,
+               "ONION_BLE_MAX_CONNS exceeds CONFIG_BT_NIMBLE_MAX_CONNECTIONS");
 
 /* Private function prototypes */
 static int gatt_svr_chr_access_hid(uint16_t conn_handle, uint16_t attr_handle,
@@ -71,7 +140,8 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg);
 
 /**
  * @brief GATT Service Definitions
- * Includes Device Information Service (DIS) and Human Interface Device (HID).
+ * Includes Device Information Service (DIS), Human Interface Device (HID) and
+ * the Onion telemetry / configuration service (see onion_gatt_tlm.h).
  */
 static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
     {
@@ -106,10 +176,27 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
                 .uuid = BLE_UUID16_DECLARE(0x2908), /* Report Reference Descriptor */
                 .access_cb = gatt_svr_chr_access_hid,
                 .att_flags = BLE_ATT_F_READ,
+                .arg = (void *)ONION_HID_REPORT_ID_KEYBOARD,
             }, {
                 0,
             } },
         }, {
+#if ONION_HID_NKRO
+            /* 2b. NKRO Bitmap Input Report */
+            .uuid = BLE_UUID16_DECLARE(BLE_SVC_HID_CHR_UUID16_REPORT),
+            .access_cb = gatt_svr_chr_access_hid,
+            .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+            .val_handle = &nkro_report_handle,
+            .descriptors = (struct ble_gatt_dsc_def[]) { {
+                .uuid = BLE_UUID16_DECLARE(0x2908), /* Report Reference Descriptor */
+                .access_cb = gatt_svr_chr_access_hid,
+                .att_flags = BLE_ATT_F_READ,
+                .arg = (void *)ONION_HID_REPORT_ID_NKRO,
+            }, {
+                0,
+            } },
+        }, {
+#endif
             /* 3. HID Information */
             .uuid = BLE_UUID16_DECLARE(BLE_SVC_HID_CHR_UUID16_HID_INFO),
             .access_cb = gatt_svr_chr_access_hid,
@@ -129,28 +216,374 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
             0,
         } },
     },
+    {
+        /*** Service: Onion Telemetry / Configuration ***/
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = ONION_GATT_TLM_SVC_UUID,
+        .characteristics = (struct ble_gatt_chr_def[]) { {
+            /* 1. Raw sweep stream */
+            .uuid = ONION_GATT_TLM_STREAM_UUID,
+            .access_cb = onion_gatt_tlm_access,
+            .flags = BLE_GATT_CHR_F_NOTIFY,
+            .val_handle = &onion_gatt_tlm_stream_handle,
+        }, {
+            /* 2. Command lines in, responses out (bonded hosts only) */
+            .uuid = ONION_GATT_TLM_CMD_UUID,
+            .access_cb = onion_gatt_tlm_access,
+            .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_WRITE_ENC |
+                     BLE_GATT_CHR_F_NOTIFY,
+            .val_handle = &onion_gatt_tlm_cmd_handle,
+        }, {
+            0,
+        } },
+    },
     {
         0,
     },
 };
 
 /**
- * @brief Sends a 8-byte HID keyboard report.
- * Format: [modifiers, reserved, key1, key2, key3, key4, key5, key6]
+ * @brief Finds the table slot of a connection (NULL if unknown).
  */
-void send_key_report(uint8_t keycode, bool pressed) {
-    if (conn_handle == 0xFFFF) return;
-    uint8_t report[8] = {0};
-    if (pressed) report[2] = keycode; /* Map keycode to the first key slot */
-    struct os_mbuf *om = ble_hs_mbuf_from_flat(report, sizeof(report));
-    ble_gatts_notify_custom(conn_handle, report_handle, om);
+static onion_conn_t *conn_find(uint16_t handle) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (conns[i].handle == handle && handle != BLE_HS_CONN_HANDLE_NONE) return &conns[i];
+    }
+    return NULL;
 }
 
 /**
- * @brief Configures and starts the BLE advertising process.
+ * @brief Returns true if the host with this identity address is connected.
  */
-void ble_app_advertise(void) {
-    struct ble_gap_adv_params adv_params;
+static bool conn_peer_connected(const ble_addr_t *addr) {
+    struct ble_gap_conn_desc desc;
+
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (conns[i].handle == BLE_HS_CONN_HANDLE_NONE) continue;
+        if (ble_gap_conn_find(conns[i].handle, &desc) == 0 &&
+            memcmp(&desc.peer_id_addr, addr, sizeof(*addr)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Sends the keyboard state as one HID input report notification.
+ * 6KRO format: [modifiers, reserved, key1, key2, key3, key4, key5, key6]
+ * @note Runs in the NimBLE host task only. The shared queue slot is the only
+ * copy of the state; each host gets its own mbuf, as NimBLE consumes it.
+ */
+static int report_notify(uint16_t handle, const onion_hid_report_t *report) {
+#if ONION_HID_NKRO
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(&report->nkro, sizeof(report->nkro));
+    uint16_t attr = nkro_report_handle;
+#else
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(&report->kb, sizeof(report->kb));
+    uint16_t attr = report_handle;
+#endif
+    if (om == NULL) return BLE_HS_ENOMEM;
+    return ble_gatts_notify_custom(handle, attr, om);
+}
+
+/**
+ * @brief Holds further sends to one host back for one of its connection intervals.
+ * Everything queued meanwhile is merged and goes out at its next connection event.
+ */
+static void report_start_holdoff(onion_conn_t *c) {
+    struct ble_gap_conn_desc desc;
+    uint64_t itvl_us = 7500;
+
+    if (ble_gap_conn_find(c->handle, &desc) == 0) {
+        itvl_us = (uint64_t)desc.conn_itvl * 1250;
+    }
+    c->holdoff = true;
+    esp_timer_start_once(c->holdoff_timer, itvl_us);
+}
+
+/**
+ * @brief Drops the state just handled: the head of the catch-up list or of the shared queue.
+ */
+static void report_consume(onion_conn_t *c, bool catchup) {
+    if (!catchup) {
+        onion_report_queue_advance(&report_queue, &c->cursor, 1);
+        return;
+    }
+    c->catchup_count--;
+    memmove(&c->catchup[0], &c->catchup[1], c->catchup_count * sizeof(c->catchup[0]));
+    memmove(&c->catchup_stamps[0], &c->catchup_stamps[1], c->catchup_count * sizeof(c->catchup_stamps[0]));
+}
+
+/**
+ * @brief Drains the shared queue towards one host.
+ *
+ * Transient states are merged away, the oldest remaining one is notified.
+ * On mbuf or controller buffer exhaustion the report stays queued and the
+ * pump retries after the holdoff, so key-ups are delayed, never dropped.
+ * States merged while the host was skipped ahead go out first.
+ */
+static void report_pump_conn(onion_conn_t *c) {
+    if (!c->subscribed || c->holdoff) return;
+
+    const onion_hid_report_t *head = NULL;
+    const onion_report_stamp_t *stamp = NULL;
+    const onion_hid_report_t *next;
+    const bool catchup = c->catchup_count > 0;
+    if (catchup) {
+        /* Already merged when the host was skipped ahead */
+        head = &c->catchup[0];
+        stamp = &c->catchup_stamps[0];
+    }
+    while (!catchup) {
+        head = onion_report_queue_peek(&report_queue, &c->cursor, 0);
+        while (head != NULL && (next = onion_report_queue_peek(&report_queue, &c->cursor, 1)) != NULL &&
+               onion_hid_report_is_transient(&c->last_sent, head, next)) {
+            onion_report_queue_advance(&report_queue, &c->cursor, 1);
+            reports_merged++;
+            head = onion_report_queue_peek(&report_queue, &c->cursor, 0);
+        }
+        if (head == NULL) return;
+        /* Re-submitted for a new host; this one has it already */
+        if (!onion_hid_report_equal(head, &c->last_sent)) {
+            stamp = onion_report_queue_peek_stamp(&report_queue, &c->cursor, 0);
+            break;
+        }
+        onion_report_queue_advance(&report_queue, &c->cursor, 1);
+    }
+
+    int rc = report_notify(c->handle, head);
+    const int64_t now = esp_timer_get_time();
+    if (rc == 0) {
+        const int64_t latency_us = now - stamp->origin_us;
+#if CONFIG_ONION_STATS
+        onion_stats_record(ONION_STAT_NOTIFY, now - stamp->queued_us);
+        onion_stats_record(ONION_STAT_E2E, latency_us);
+#endif
+        onion_evlog_record(now, ONION_EVLOG_NOTIFY_OK, (uint8_t)c->handle,
+                           (uint16_t)(latency_us < UINT16_MAX ? latency_us : UINT16_MAX));
+        c->last_sent = *head;
+        report_consume(c, catchup);
+    } else if (rc == BLE_HS_ENOMEM || rc == BLE_HS_EBUSY) {
+        onion_evlog_record(now, ONION_EVLOG_NOTIFY_RETRY, (uint8_t)c->handle, (uint16_t)rc);
+        reports_retried++;
+    } else {
+        ESP_LOGW(TAG, "HID notify to %u failed (rc=%d), report dropped", c->handle, rc);
+        onion_evlog_record(now, ONION_EVLOG_NOTIFY_FAIL, (uint8_t)c->handle, (uint16_t)rc);
+        report_consume(c, catchup);
+    }
+    report_start_holdoff(c);
+}
+
+/**
+ * @brief Moves the states a lagging host is skipped over into its catch-up list.
+ *
+ * They are merged as the pump would merge them, so every press and release
+ * still reaches the host. Only when the list is full is a state that carries
+ * an edge overwritten; that is logged as NOTIFY_FAIL with value 0.
+ */
+static void report_skip_ahead(onion_conn_t *c, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const onion_hid_report_t *s = onion_report_queue_peek(&report_queue, &c->cursor, 0);
+        const onion_report_stamp_t *stamp = onion_report_queue_peek_stamp(&report_queue, &c->cursor, 0);
+        uint8_t k = c->catchup_count;
+        const onion_hid_report_t *ref = k > 1 ? &c->catchup[k - 2] : &c->last_sent;
+
+        if (onion_hid_report_equal(s, k ? &c->catchup[k - 1] : &c->last_sent)) {
+            /* Nothing new for this host */
+        } else if (k > 0 && onion_hid_report_is_transient(ref, &c->catchup[k - 1], s)) {
+            c->catchup[k - 1] = *s;
+            reports_merged++;
+        } else if (k < ONION_BLE_CATCHUP_LEN) {
+            c->catchup[k] = *s;
+            c->catchup_stamps[k] = *stamp;
+            c->catchup_count++;
+        } else {
+            c->catchup[k - 1] = *s;
+            onion_evlog_record(esp_timer_get_time(), ONION_EVLOG_NOTIFY_FAIL, (uint8_t)c->handle, 0);
+        }
+        onion_report_queue_advance(&report_queue, &c->cursor, 1);
+    }
+}
+
+/**
+ * @brief Hands queue slots every subscribed host has consumed back to the producer.
+ * A host lagging close to the queue length skips to the newest state, so a
+ * slow host never makes the producer wait and never delays the others. The
+ * states it skips are kept merged in its catch-up list.
+ */
+static void report_release(void) {
+    onion_conn_t *slowest = NULL;
+    size_t slowest_count = 0;
+
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        onion_conn_t *c = &conns[i];
+        if (c->handle == BLE_HS_CONN_HANDLE_NONE || !c->subscribed) continue;
+
+        size_t count = onion_report_queue_count(&report_queue, &c->cursor);
+        if (count > ONION_REPORT_QUEUE_LEN - 2) {
+            report_skip_ahead(c, count - 1);
+            reports_resynced++;
+            count = 1;
+        }
+        if (slowest == NULL || count > slowest_count) {
+            slowest = c;
+            slowest_count = count;
+        }
+    }
+    onion_report_queue_release(&report_queue, slowest ? &slowest->cursor : NULL);
+}
+
+/**
+ * @brief NimBLE event handler: new states were queued, pump every host that is not held off.
+ */
+static void report_tx_pump(struct ble_npl_event *ev) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (conns[i].handle != BLE_HS_CONN_HANDLE_NONE) report_pump_conn(&conns[i]);
+    }
+    report_release();
+}
+
+/**
+ * @brief NimBLE event handler: one host's connection event has passed, resume its pump.
+ */
+static void report_holdoff_done(struct ble_npl_event *ev) {
+    onion_conn_t *c = ble_npl_event_get_arg(ev);
+
+    c->holdoff = false;
+    if (c->handle == BLE_HS_CONN_HANDLE_NONE) return;
+    report_pump_conn(c);
+    report_release();
+}
+
+/**
+ * @brief esp_timer callback: hands the holdoff expiry over to the host task.
+ */
+static void report_holdoff_expired(void *arg) {
+    onion_conn_t *c = arg;
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &c->holdoff_ev);
+}
+
+/**
+ * @brief Keeps a state built while no host is subscribed, until the first
+ * subscription or the end of the boot window (producer side).
+ */
+static void prelink_capture(const onion_hid_report_t *report) {
+    if (!prelink_open) return;
+    if (esp_timer_get_time() > (int64_t)ONION_PRELINK_WINDOW_MS * 1000) {
+        prelink_open = false;
+        prelink_count = 0;
+        return;
+    }
+    const onion_hid_report_t *prev = prelink_count ? &prelink_reports[prelink_count - 1] : &last_submitted;
+    if (prelink_count == ONION_PRELINK_REPLAY_LEN || onion_hid_report_equal(report, prev)) return;
+    prelink_reports[prelink_count++] = *report;
+}
+
+/**
+ * @brief Queues the captured pre-link states for the first subscribed host (producer side).
+ * The host's cursor was reset on subscription, so it receives them in order.
+ */
+static void prelink_replay(int64_t origin_us) {
+    uint32_t replayed = 0;
+
+    prelink_open = false;
+    if (esp_timer_get_time() > (int64_t)ONION_PRELINK_WINDOW_MS * 1000) prelink_count = 0;  /* Stale by now */
+    while (replayed < prelink_count &&
+           onion_report_queue_push(&report_queue, &prelink_reports[replayed], origin_us)) {
+        last_submitted = prelink_reports[replayed++];
+    }
+    prelink_count = 0;
+    onion_evlog_record(esp_timer_get_time(), ONION_EVLOG_BOOT_STAGE, ONION_BOOT_LINK_UP, (uint16_t)replayed);
+    if (replayed) {
+        ESP_LOGI(TAG, "Replayed %lu key states captured before the link was up", (unsigned long)replayed);
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &report_tx_ev);
+    }
+}
+
+/**
+ * @brief Queues the keyboard state of one sweep for the NimBLE host task.
+ * Identical consecutive states are filtered here; a full queue is reported
+ * back so the caller re-submits its current state on the next sweep.
+ */
+int send_key_report(const onion_hid_report_t *report, int64_t origin_us) {
+    if (__atomic_load_n(&subscribed_count, __ATOMIC_ACQUIRE) == 0) {
+        prelink_capture(report);
+        return BLE_HS_ENOTCONN;
+    }
+
+    uint32_t generation = __atomic_load_n(&conn_generation, __ATOMIC_ACQUIRE);
+    if (generation != submitted_generation) {
+        /* New host: it has seen nothing yet */
+        memset(&last_submitted, 0, sizeof(last_submitted));
+        submitted_generation = generation;
+        if (prelink_open) prelink_replay(origin_us);
+    }
+    if (onion_hid_report_equal(report, &last_submitted)) return 0;
+
+    if (!onion_report_queue_push(&report_queue, report, origin_us)) return BLE_HS_EBUSY;
+    last_submitted = *report;
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &report_tx_ev);
+    return 0;
+}
+
+bool onion_ble_report_resync_due(void) {
+    return __atomic_load_n(&conn_generation, __ATOMIC_ACQUIRE) != submitted_generation;
+}
+
+void onion_ble_get_report_stats(uint32_t *merged, uint32_t *retried, uint32_t *resynced) {
+    *merged = reports_merged;
+    *retried = reports_retried;
+    *resynced = reports_resynced;
+}
+
+/**
+ * @brief Hooks a host's CCCD change on the active input report into the pipeline (host task).
+ */
+static void conn_on_subscribe(uint16_t handle, bool notify) {
+    onion_conn_t *c = conn_find(handle);
+    if (c == NULL || c->subscribed == notify) return;
+
+    c->subscribed = notify;
+    if (notify) {
+        onion_report_queue_cursor_reset(&report_queue, &c->cursor);
+        memset(&c->last_sent, 0, sizeof(c->last_sent));
+        c->catchup_count = 0;
+        __atomic_add_fetch(&subscribed_count, 1, __ATOMIC_RELEASE);
+        /* Makes the producer re-submit the current state for this host */
+        __atomic_add_fetch(&conn_generation, 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_sub_fetch(&subscribed_count, 1, __ATOMIC_RELEASE);
+    }
+    report_release();
+}
+
+/**
+ * @brief Picks the host for the directed burst: the last one this session, else the newest bond.
+ * Hosts that are connected already are skipped.
+ */
+static bool adv_get_reconnect_peer(ble_addr_t *out) {
+    if (reconnect_peer_valid && !conn_peer_connected(&reconnect_peer)) {
+        *out = reconnect_peer;
+        return true;
+    }
+
+    ble_addr_t peers[CONFIG_BT_NIMBLE_MAX_BONDS];
+    int num = 0;
+    if (ble_store_util_bonded_peers(peers, &num, CONFIG_BT_NIMBLE_MAX_BONDS) != 0) return false;
+    /* The store appends new bonds, so the last entries are the most recent ones */
+    while (num-- > 0) {
+        if (!conn_peer_connected(&peers[num])) {
+            *out = peers[num];
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Sets the advertising data (name, appearance, HID UUID) for undirected advertising.
+ */
+static void adv_set_fields(void) {
     struct ble_hs_adv_fields fields;
 
     memset(&fields, 0, sizeof(fields));
@@ -165,12 +598,78 @@ void ble_app_advertise(void) {
     fields.uuids16_is_complete = 1;
 
     ble_gap_adv_set_fields(&fields);
+}
+
+/**
+ * @brief Starts advertising for adv_phase (host task).
+ * The directed and fast phases end with BLE_GAP_EVENT_ADV_COMPLETE, which moves on to the next one.
+ */
+static void adv_start_phase(void) {
+    struct ble_gap_adv_params adv_params;
+    ble_addr_t peer;
+    int rc;
+
     memset(&adv_params, 0, sizeof(adv_params));
+    if (adv_phase == ADV_PHASE_DIRECTED) {
+        if (adv_get_reconnect_peer(&peer)) {
+            adv_params.conn_mode = BLE_GAP_CONN_MODE_DIR;
+            adv_params.high_duty_cycle = 1;
+            rc = ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, &peer, ONION_ADV_DIRECTED_DURATION_MS,
+                                   &adv_params, ble_gap_event, NULL);
+            if (rc == 0) return;
+            ESP_LOGW(TAG, "Directed advertising failed (rc=%d)", rc);
+        }
+        adv_phase = ADV_PHASE_FAST;
+    }
+    if (adv_phase == ADV_PHASE_FAST && adv_state != STATE_ACTIVE) {
+        adv_phase = ADV_PHASE_SLOW;
+    }
+
+    adv_set_fields();
     adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
     adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    adv_params.itvl_min = 0;
-    adv_params.itvl_max = 0;
-    ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, NULL, BLE_HS_FOREVER, &adv_params, ble_gap_event, NULL);
+    int32_t duration_ms;
+    if (adv_phase == ADV_PHASE_FAST) {
+        adv_params.itvl_min = ONION_ADV_FAST_ITVL_MIN;
+        adv_params.itvl_max = ONION_ADV_FAST_ITVL_MAX;
+        duration_ms = ONION_ADV_FAST_DURATION_MS;
+    } else {
+        adv_params.itvl_min = ONION_ADV_SLOW_ITVL_MIN;
+        adv_params.itvl_max = ONION_ADV_SLOW_ITVL_MAX;
+        duration_ms = BLE_HS_FOREVER;
+    }
+    rc = ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, NULL, duration_ms, &adv_params, ble_gap_event, NULL);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Advertising start failed (rc=%d)", rc);
+    }
+}
+
+void ble_app_advertise(void) {
+    if (conn_count >= ONION_BLE_MAX_CONNS) return;
+    if (ble_gap_adv_active()) ble_gap_adv_stop();
+    adv_phase = ADV_PHASE_DIRECTED;
+    adv_start_phase();
+}
+
+/**
+ * @brief NimBLE event handler: adapts a running advertisement to the new power state.
+ */
+static void adv_update_event(struct ble_npl_event *ev) {
+    if (!ble_gap_adv_active()) return;
+
+    if (adv_state == STATE_ACTIVE) {
+        adv_phase = ADV_PHASE_DIRECTED; /* Woken up: somebody wants to use the controller now */
+    } else if (adv_phase != ADV_PHASE_FAST) {
+        return;                         /* The directed burst ends by itself, slow is slow already */
+    }
+    ble_gap_adv_stop();
+    adv_start_phase();
+}
+
+void onion_ble_set_adv_state(controller_state_t state) {
+    if (state == adv_state) return;
+    adv_state = state;
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &adv_update_ev);
 }
 
 /**
@@ -178,29 +677,100 @@ void ble_app_advertise(void) {
  */
 static int ble_gap_event(struct ble_gap_event *event, void *arg) {
     switch (event->type) {
-        case BLE_GAP_EVENT_CONNECT:
-            if (event->connect.status == 0) {
-                conn_handle = event->connect.conn_handle;
-                ESP_LOGI(TAG, "Connection established. Handle: %d", conn_handle);
-                ble_gap_security_initiate(conn_handle);
-                gpio_set_level(STATUS_LED_GPIO, 1);
-            } else {
+        case BLE_GAP_EVENT_CONNECT: {
+            if (event->connect.status != 0) {
                 ble_app_advertise();
+                break;
             }
+            uint16_t handle = event->connect.conn_handle;
+            onion_conn_t *c = NULL;
+            for (int i = 0; c == NULL && i < ONION_BLE_MAX_CONNS; i++) {
+                if (conns[i].handle == BLE_HS_CONN_HANDLE_NONE) c = &conns[i];
+            }
+            if (c == NULL) {
+                ble_gap_terminate(handle, BLE_ERR_REM_USER_CONN_TERM);
+                break;
+            }
+            c->handle = handle;
+            c->subscribed = false;
+            c->holdoff = false;
+            c->catchup_count = 0;
+            conn_count++;
+            ESP_LOGI(TAG, "Connection established. Handle: %d (%lu of %d)", handle,
+                     (unsigned long)conn_count, ONION_BLE_MAX_CONNS);
+            onion_link_on_connect(handle);
+            onion_gatt_tlm_on_connect(handle);
+            ble_gap_security_initiate(handle);
+            gpio_set_level(STATUS_LED_GPIO, 1);
+            /* Stay reachable for the next host */
+            ble_app_advertise();
             break;
-        case BLE_GAP_EVENT_DISCONNECT:
-            conn_handle = 0xFFFF;
-            ESP_LOGI(TAG, "Device disconnected. Restarting advertising.");
-            gpio_set_level(STATUS_LED_GPIO, 0);
+        }
+        case BLE_GAP_EVENT_DISCONNECT: {
+            uint16_t handle = event->disconnect.conn.conn_handle;
+            onion_conn_t *c = conn_find(handle);
+            if (c != NULL) {
+                esp_timer_stop(c->holdoff_timer);
+                if (c->subscribed) __atomic_sub_fetch(&subscribed_count, 1, __ATOMIC_RELEASE);
+                c->handle = BLE_HS_CONN_HANDLE_NONE;
+                c->subscribed = false;
+                c->holdoff = false;
+                conn_count--;
+                report_release();
+            }
+            ESP_LOGI(TAG, "Device %d disconnected (reason %d). Restarting advertising.", handle,
+                     event->disconnect.reason);
+            if (conn_count == 0) gpio_set_level(STATUS_LED_GPIO, 0);
+            onion_link_on_disconnect(handle);
+            onion_gatt_tlm_on_disconnect(handle);
             ble_app_advertise();
             break;
+        }
         case BLE_GAP_EVENT_ENC_CHANGE:
             ESP_LOGI(TAG, "Encryption status changed: %d", event->enc_change.status);
+            if (event->enc_change.status == 0) {
+                struct ble_gap_conn_desc desc;
+                if (ble_gap_conn_find(event->enc_change.conn_handle, &desc) == 0) {
+                    /* Bonding is mandatory, so an encrypted host is a bonded one */
+                    reconnect_peer = desc.peer_id_addr;
+                    reconnect_peer_valid = true;
+                }
+                onion_link_on_encrypted(event->enc_change.conn_handle);
+            }
+            break;
+        case BLE_GAP_EVENT_ADV_COMPLETE:
+            /* Directed or fast phase timed out without a connection */
+            if (event->adv_complete.reason != 0 && conn_count < ONION_BLE_MAX_CONNS && adv_phase != ADV_PHASE_SLOW) {
+                adv_phase = (adv_phase == ADV_PHASE_DIRECTED) ? ADV_PHASE_FAST : ADV_PHASE_SLOW;
+                adv_start_phase();
+            }
+            break;
+        case BLE_GAP_EVENT_CONN_UPDATE:
+            onion_link_on_conn_update(event->conn_update.conn_handle, event->conn_update.status);
+            break;
+        case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+            onion_link_on_phy_update(event->phy_updated.conn_handle, event->phy_updated.status,
+                                     event->phy_updated.tx_phy, event->phy_updated.rx_phy);
+            break;
+        case BLE_GAP_EVENT_DATA_LEN_CHG:
+            onion_link_on_data_len(event->data_len_chg.conn_handle, event->data_len_chg.max_tx_octets,
+                                   event->data_len_chg.max_rx_octets);
             break;
 
         case BLE_GAP_EVENT_MTU:
             ESP_LOGI(TAG, "MTU updated to: %d", event->mtu.value);
             break;
+        case BLE_GAP_EVENT_SUBSCRIBE:
+#if ONION_HID_NKRO
+            if (event->subscribe.attr_handle == nkro_report_handle) {
+#else
+            if (event->subscribe.attr_handle == report_handle) {
+#endif
+                conn_on_subscribe(event->subscribe.conn_handle, event->subscribe.cur_notify);
+            }
+            onion_gatt_tlm_on_subscribe(event->subscribe.conn_handle, event->subscribe.attr_handle,
+                                        event->subscribe.cur_notify);
+            break;
         case BLE_GAP_EVENT_PASSKEY_ACTION: {
             struct ble_sm_io pk;
             ESP_LOGI(TAG, "Passkey Action; type=%d", event->passkey.params.action);
@@ -240,7 +810,7 @@ static int gatt_svr_chr_access_hid(uint16_t conn_handle, uint16_t attr_handle,
         return 0;
     }
     if (uuid == 0x2908) {
-        uint8_t desc[] = {0x01, 0x01}; /* Report ID 1, Type Input */
+        uint8_t desc[] = {(uint8_t)(uintptr_t)arg, 0x01}; /* Report ID, Type Input */
         os_mbuf_append(ctxt->om, desc, sizeof(desc));
         return 0;
     }
@@ -261,6 +831,8 @@ void gatt_svr_init(void) {
 }
 
 void ble_app_on_sync(void) {
+    onion_evlog_record(esp_timer_get_time(), ONION_EVLOG_BOOT_STAGE, ONION_BOOT_BLE_SYNC, 0);
+    ESP_LOGI(TAG, "Host synced %lld ms after boot", (long long)(esp_timer_get_time() / 1000));
     ble_hs_id_infer_auto(0, &addr_type);
     ble_app_advertise();
 }
@@ -269,6 +841,9 @@ void ble_app_on_reset(int reason) {
     ESP_LOGE(TAG, "BLE Host reset occurred. Reason: %d", reason);
 }
 
+static StackType_t host_task_stack[ONION_NIMBLE_HOST_STACK];
+static StaticTask_t host_task_buf;
+
 void ble_host_task(void *param) {
     ESP_LOGI(TAG, "NimBLE Host Task operational.");
     nimble_port_run(); 
@@ -276,91 +851,11 @@ void ble_host_task(void *param) {
     vTaskDelete(NULL);
 }
 
-/**
- * FreeRTOS Task: onion_comms_task
- * Handles serial commands from the PC application and streams real-time sensor telemetry.
- * * Protocol Support:
- * - Inbound: "CONNECT", "DISCONNECT", "SET:ch,thr,key"
- * - Outbound: "CFG:ch,thr,key", "RAW:v0,v1,...,v15"
- */
-void onion_comms_task(void *pvParameters) {
-    char line[128];      // Buffer to accumulate characters from serial
-    int line_ptr = 0;    // Current write position in the buffer
-
-    while(1) {
-        /* --- 1. COMMAND PROCESSING (Inbound) --- */
-        // Non-blocking read from stdin (Serial interface)
-        int c = fgetc(stdin); 
-        
-        if (c != EOF) {
-            // Check for line terminators or buffer overflow
-            if (c == '\n' || c == '\r' || line_ptr >= sizeof(line) - 1) {
-                line[line_ptr] = '\0'; // Null-terminate the string
-                
-                if (line_ptr > 0) {
-                    // HANDSHAKE: PC app requested telemetry start
-                    if (strcmp(line, "CONNECT") == 0) {
-                        is_app_connected = true;
-                        // Synchronize full configuration state back to PC immediately
-                        for(int i = 0; i < 16; i++) {
-                            printf("CFG:%d,%d,%d\n", i, local_lut_ptr[i].threshold, local_lut_ptr[i].keycode);
-                        }
-                    } 
-                    // TERMINATION: PC app requested telemetry stop
-                    else if (strcmp(line, "DISCONNECT") == 0) {
-                        is_app_connected = false;
-                    } 
-                    // CONFIGURATION UPDATE: Received new parameters for a specific sensor
-                    else if (strncmp(line, "SET:", 4) == 0) {
-                        int ch, thr, key;
-                        // Parse format: SET:channel,threshold,hid_keycode
-                        if (sscanf(line, "SET:%d,%d,%d", &ch, &thr, &key) == 3) {
-                            if (ch >= 0 && ch < 16) {
-                                local_lut_ptr[ch].threshold = thr;
-                                local_lut_ptr[ch].keycode = (uint8_t)key;
-                                
-                                // Persist changes to NVS (Non-Volatile Storage)
-                                onion_config_save();
-                            }
-                        }
-                    }
-                }
-                line_ptr = 0; // Reset buffer pointer after processing every line
-            } else {
-                // Character is part of a command, add to buffer
-                line[line_ptr++] = (char)c;
-            }
-        }
-
-        /* --- 2. TELEMETRY STREAMING (Outbound) --- */
-        // Send sensor data only if a handshake has been established
-        if (is_app_connected) {
-            printf("RAW:");
-            for (int i = 0; i < 16; i++) {
-                // Output raw ADC values separated by commas
-                printf("%u%s", last_raw_values[i], (i == 15) ? "" : ",");
-            }
-            printf("\n");
-            
-            // Ensure data is pushed through the serial bridge immediately
-            fflush(stdout); 
-        }
-
-        /**
-         * Task pacing: 50ms (20Hz)
-         * Balancing UI responsiveness on PC vs CPU load on ESP32.
-         */
-        vTaskDelay(pdMS_TO_TICKS(50));
-    }
-}
-
-
 /**
  * @brief Complete BLE and HID stack initialization.
  */
 int onion_ble_init(void){  
-    vTaskDelay(pdMS_TO_TICKS(2000));
-    /* Initialize Bluetooth Stack (NimBLE) */
+    /* Initialize Bluetooth Stack (NimBLE); the host syncs in its own task while the pads come up */
     nimble_port_init();
     ble_svc_gap_init();
     ble_svc_gatt_init();
@@ -384,12 +879,27 @@ int onion_ble_init(void){
     ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
     ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
 
-    /* Start the NimBLE host task */
-    xTaskCreate(ble_host_task, "nimble_host", 4096, NULL, 5, NULL);
+    onion_link_init();
+    onion_gatt_tlm_init();
+
+    /* Report pipeline: broadcast queue drained per host by events on the host's default queue */
+    onion_report_queue_init(&report_queue);
+    ble_npl_event_init(&report_tx_ev, report_tx_pump, NULL);
+    ble_npl_event_init(&adv_update_ev, adv_update_event, NULL);
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        conns[i].handle = BLE_HS_CONN_HANDLE_NONE;
+        ble_npl_event_init(&conns[i].holdoff_ev, report_holdoff_done, &conns[i]);
+        const esp_timer_create_args_t holdoff_args = {
+            .callback = report_holdoff_expired,
+            .arg = &conns[i],
+            .name = "hid_holdoff",
+        };
+        esp_timer_create(&holdoff_args, &conns[i].holdoff_timer);
+    }
 
-    local_lut_ptr = onion_lut;
-    telemetry_source = last_raw_values;
-    xTaskCreate(onion_comms_task, "telemetry_task", 4096, NULL, 5, NULL);
+    /* Start the NimBLE host task */
+    xTaskCreateStatic(ble_host_task, "nimble_host", ONION_NIMBLE_HOST_STACK, NULL, 5,
+                      host_task_stack, &host_task_buf);
 
     return 0;
 }
\ No newline at end of file
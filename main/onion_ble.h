@@ -13,18 +13,27 @@
 #include <stdbool.h>
 #include "host/ble_hs.h"
 #include "nimble/ble.h"
+#include "onion_hid.h"
+#include "onion_config.h"
 
 /** * @brief Reference to the HID Report Map defined in config. 
  */
 extern const uint8_t hid_report_map[];
 
-extern uint16_t last_raw_values[16];
-
 /**
- * @brief Starts BLE GAP advertising to make the device discoverable.
+ * @brief Starts the reconnect sequence: a high-duty directed burst to the last
+ * bonded host, fast undirected advertising, then slow advertising until a host connects.
+ * * Without a bond the directed burst is skipped.
  */
 void ble_app_advertise(void);
 
+/**
+ * @brief Adapts a running advertisement to the given power state.
+ * * STATE_ACTIVE (a wake-up) restarts the reconnect sequence; STATE_STANDBY
+ * cuts the fast phase short. Safe from any task.
+ */
+void onion_ble_set_adv_state(controller_state_t state);
+
 /**
  * @brief Initializes the GATT server and registers HID services.
  * @note Renamed from onion_gatt_svr_init if you followed the name-conflict fix.
@@ -32,11 +41,35 @@ void ble_app_advertise(void);
 void gatt_svr_init(void);
  
 /**
- * @brief Constructs and sends a HID keyboard report over BLE.
- * * @param keycode HID scan code to be sent in the report array.
- * @param pressed True for KeyDown event, false for KeyUp event.
+ * @brief Queues the keyboard state of one sweep for transmission as one HID notification.
+ * * The state is stored once and sent to every subscribed host (up to
+ * ONION_BLE_MAX_CONNS). Per host the NimBLE host task sends at most one
+ * report per connection event, merging states that are superseded before
+ * transmission; a host that falls behind skips to the newest state. Uses the 6KRO report, or the
+ * NKRO bitmap report when ONION_HID_NKRO is enabled.
+ * @param report Keyboard state built by onion_hid_build_report().
+ * @param origin_us Start of the sweep that produced the state (latency statistics).
+ * Without a subscribed host, states built in the first ONION_PRELINK_WINDOW_MS
+ * after boot are kept and replayed to the first host that subscribes.
+ * @return 0 if queued (or unchanged), BLE_HS_ENOTCONN without a subscribed host,
+ *         BLE_HS_EBUSY if the queue is full and the state must be re-submitted.
  */
-void send_key_report(uint8_t keycode, bool pressed);
+int send_key_report(const onion_hid_report_t *report, int64_t origin_us);
+
+/**
+ * @brief Whether a host subscribed since the last submitted state (producer side).
+ * The scan loop then submits its current state even without a transition,
+ * which also flushes the presses captured before the first link came up.
+ */
+bool onion_ble_report_resync_due(void);
+
+/**
+ * @brief Reads the report pipeline counters (summed over all hosts).
+ * @param merged Reports skipped because a later state superseded them.
+ * @param retried Sends postponed because of mbuf or controller buffer exhaustion.
+ * @param resynced Times a lagging host skipped to the newest state.
+ */
+void onion_ble_get_report_stats(uint32_t *merged, uint32_t *retried, uint32_t *resynced);
 
 /**
  * @brief Callback triggered when the BLE host and controller are in sync.
@@ -63,7 +96,4 @@ void ble_host_task(void *param);
  */
 int onion_ble_init(void);
 
-/* Starts a FreeRTOS task that sends raw sensor data over Serial */
-void onion_ble_start_telemetry(uint16_t *data_to_watch);
-
 #endif // ONION_BLE_H
\ No newline at end of file
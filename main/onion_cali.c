@@ -0,0 +1,107 @@
+/**
+ * @file onion_cali.c
+ * @brief Implementation of the per-input millivolt curves on top of adc_cali.
+ */
+
+#include "onion_cali.h"
+#include "onion_config.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+#include "esp_log.h"
+#include "esp_err.h"
+
+static const char *TAG = "ONION_CALI";
+
+/** @brief ADC1 input of each MUX (same topology table as the scan engine). */
+static const uint8_t cali_adc_channel[ONION_MUX_COUNT] = ONION_MUX_ADC_CHANNELS;
+
+/** @brief Millivolts at code i << ONION_CALI_SEG_SHIFT, per MUX input (sweep task reads, init writes). */
+static uint16_t curve[ONION_MUX_COUNT][ONION_CALI_POINTS];
+static bool calibrated = false;
+
+/**
+ * @brief Creates the best calibration scheme the chip offers for one input.
+ */
+static esp_err_t cali_create(uint8_t channel, adc_cali_handle_t *out) {
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+    adc_cali_curve_fitting_config_t cfg = {
+        .unit_id = ADC_UNIT_1,
+        .chan = channel,
+        .atten = ONION_SCAN_ATTEN,
+        .bitwidth = ADC_BITWIDTH_12,
+    };
+    return adc_cali_create_scheme_curve_fitting(&cfg, out);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_line_fitting_efuse_val_t efuse;
+    if (adc_cali_scheme_line_fitting_check_efuse(&efuse) != ESP_OK ||
+        efuse == ADC_CALI_LINE_FITTING_EFUSE_VAL_DEFAULT_VREF) {
+        /* No per-chip data burnt: a default Vref would only pretend to calibrate */
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    adc_cali_line_fitting_config_t cfg = {
+        .unit_id = ADC_UNIT_1,
+        .atten = ONION_SCAN_ATTEN,
+        .bitwidth = ADC_BITWIDTH_12,
+#if CONFIG_IDF_TARGET_ESP32
+        .default_vref = ONION_CALI_DEFAULT_VREF_MV,
+#endif
+    };
+    return adc_cali_create_scheme_line_fitting(&cfg, out);
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static void cali_delete(adc_cali_handle_t handle) {
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+    adc_cali_delete_scheme_curve_fitting(handle);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_delete_scheme_line_fitting(handle);
+#endif
+}
+
+int onion_cali_init(void) {
+    esp_err_t result = ESP_OK;
+
+    for (int m = 0; m < ONION_MUX_COUNT; m++) {
+        adc_cali_handle_t handle = NULL;
+        esp_err_t err = cali_create(cali_adc_channel[m], &handle);
+
+        for (int i = 0; i < ONION_CALI_POINTS; i++) {
+            int raw = i << ONION_CALI_SEG_SHIFT;
+            if (raw > 4095) raw = 4095;
+            int mv = raw * ONION_CALI_NOMINAL_MV / 4095;
+            if (err == ESP_OK && adc_cali_raw_to_voltage(handle, raw, &mv) != ESP_OK) {
+                mv = raw * ONION_CALI_NOMINAL_MV / 4095;
+            }
+            curve[m][i] = (uint16_t)(mv < 0 ? 0 : mv);
+        }
+        if (err == ESP_OK) {
+            cali_delete(handle);
+        } else {
+            result = ESP_ERR_NOT_SUPPORTED;
+        }
+        ESP_LOGI(TAG, "MUX %d (ADC1 ch %u): %s, %u mV at mid-scale, %u mV at full scale", m,
+                 cali_adc_channel[m], err == ESP_OK ? "calibrated" : "nominal line",
+                 curve[m][ONION_CALI_POINTS / 2], curve[m][ONION_CALI_POINTS - 1]);
+    }
+
+    calibrated = (result == ESP_OK);
+    if (!calibrated) {
+        ESP_LOGW(TAG, "No ADC calibration data; thresholds will not match other boards exactly.");
+    }
+    return result;
+}
+
+uint16_t onion_cali_raw_to_mv(int ch, uint16_t raw) {
+    const uint16_t *c = curve[ch / ONION_MUX_ADDRESSES];
+    const uint32_t i = raw >> ONION_CALI_SEG_SHIFT;
+    const uint32_t f = raw & ((1u << ONION_CALI_SEG_SHIFT) - 1);
+
+    if (i >= ONION_CALI_POINTS - 1) return c[ONION_CALI_POINTS - 1];
+    return (uint16_t)(c[i] + (((int32_t)c[i + 1] - (int32_t)c[i]) * (int32_t)f >> ONION_CALI_SEG_SHIFT));
+}
+
+bool onion_cali_is_calibrated(void) {
+    return calibrated;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file onion_cali.h
+ * @brief ADC calibration: conversion codes to millivolts, per MUX input.
+ *
+ * At boot the esp_adc calibration driver (curve fitting where the chip
+ * supports it, eFuse line fitting on the classic ESP32) is sampled into a
+ * piecewise-linear curve of ONION_CALI_POINTS points per MUX input. The sweep
+ * task converts every averaged reading with one table lookup, so baselines,
+ * thresholds and deltas are kept in millivolts and a configuration tuned on
+ * one board carries over to another. Without calibration data a nominal
+ * straight line is used and onion_cali_is_calibrated() reports false.
+ */
+
+#ifndef ONION_CALI_H
+#define ONION_CALI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "onion_config.h"
+
+/** @brief Conversion codes per curve segment (log2). */
+#define ONION_CALI_SEG_SHIFT 6
+/** @brief Points per curve, covering codes 0..4095 (the last point is code 4095). */
+#define ONION_CALI_POINTS ((4096 >> ONION_CALI_SEG_SHIFT) + 1)
+
+/**
+ * @brief Creates the calibration scheme of every MUX input and samples its curve.
+ * @note Independent of the scan engine; call before onion_config_init() so stored raw thresholds can be migrated.
+ * @return ESP_OK, or ESP_ERR_NOT_SUPPORTED if the nominal line is in use.
+ */
+int onion_cali_init(void);
+
+/**
+ * @brief Converts an averaged conversion code of a channel to millivolts.
+ * @param ch Channel (selects the curve of its MUX input).
+ * @param raw 12-bit conversion code.
+ */
+uint16_t onion_cali_raw_to_mv(int ch, uint16_t raw);
+
+/**
+ * @brief true if the curves come from the chip's calibration data.
+ */
+bool onion_cali_is_calibrated(void);
+
+#endif // ONION_CALI_H
@@ -0,0 +1,620 @@
+/**
+ * @file onion_comms.c
+ * @brief Event-driven serial command reader and protocol handlers.
+ * The same command table serves lines written over BLE (see onion_gatt_tlm.h).
+ *
+ * Protocol Support:
+ * - Inbound: "CONNECT", "CONNECT:BIN[,baud]", "DISCONNECT", "SET:ch,thr,key", "SAVE", "CAL",
+ *   "DB:ch,press,release", "BOUNCE", "SETTLE", "STATS[:RESET]",
+ *   "DUMP[:CRASH]", "ACT:...", "GETALL", "SETALL:W,offset,hex", "SETALL:COMMIT,len"
+ * - Outbound: "CFG:ch,thr,key", "DB:ch,press,release", "ALL:D,offset,hex" ... "ALL:END,len", "CAL:b0,...,b15", "BOUNCE:n0,...,n15",
+ *   "SETTLE:s0,...,s15", "STATS:stage,count,min,avg,p99,max", "RAW:v0,v1,...,v15", "LINK:itvl_us,latency,timeout_ms,tx_phy,rx_phy,tx_octets,rx_octets",
+ *   "EV:timestamp_us,type,channel,value" ... "DUMP:END,n" / "DUMP:NONE"
+ * - Binary mode (after "BIN:OK"): COBS-framed packets, see onion_telemetry.h
+ */
+
+#include "onion_comms.h"
+#include "onion_config.h"
+#include "onion_touch.h"
+#include "onion_telemetry.h"
+#include "onion_storage.h"
+#include "onion_baseline.h"
+#include "onion_scan.h"
+#include "onion_stats.h"
+#include "onion_bench.h"
+#include "onion_debounce.h"
+#include "onion_evlog.h"
+#include "onion_prof.h"
+#include "onion_action.h"
+#include "onion_sweep.h"
+#include "onion_ble.h"
+#include "onion_gatt_tlm.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include "string.h"
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+#include "driver/usb_serial_jtag.h"
+#include "driver/usb_serial_jtag_vfs.h"
+#else
+#include "driver/uart.h"
+#include "driver/uart_vfs.h"
+#endif
+
+static const char *TAG = "ONION_COMMS";
+
+#define COMMS_LINE_MAX   ONION_GATT_CMD_LINE_MAX
+#define COMMS_RX_CHUNK   64
+
+#if !CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+static QueueHandle_t uart_queue = NULL;
+#endif
+
+/**
+ * @brief Handler for one inbound command line (NUL-terminated, without terminator).
+ * @param reply Sink for the response lines of the link the command came from.
+ */
+typedef void (*onion_cmd_handler_t)(const char *line, onion_comms_reply_t reply);
+
+/**
+ * @brief Command table entry: a line starting with prefix goes to handler.
+ */
+typedef struct {
+    const char *prefix;
+    onion_cmd_handler_t handler;
+} onion_cmd_t;
+
+/** @brief Serialises commands from the serial and BLE links (CAL, SETTLE and the LUT editor are single-user). */
+static SemaphoreHandle_t dispatch_lock = NULL;
+static StaticSemaphore_t dispatch_lock_buf;
+
+static StackType_t comms_task_stack[ONION_COMMS_TASK_STACK];
+static StaticTask_t comms_task_buf;
+
+void onion_comms_set_baudrate(uint32_t baud) {
+#if !CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    fflush(stdout);
+    uart_wait_tx_done(CONFIG_ESP_CONSOLE_UART_NUM, pdMS_TO_TICKS(100));
+    uart_set_baudrate(CONFIG_ESP_CONSOLE_UART_NUM, baud);
+#endif
+}
+
+/**
+ * @brief Reply sink of the serial link.
+ */
+static void comms_reply_serial(const char *line) {
+    printf("%s\n", line);
+    fflush(stdout);
+}
+
+/**
+ * @brief Formats one response line and hands it to the sink.
+ */
+static void __attribute__((format(printf, 2, 3))) comms_replyf(onion_comms_reply_t reply, const char *fmt, ...) {
+    char buf[ONION_COMMS_REPLY_MAX];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    reply(buf);
+}
+
+/**
+ * @brief Replies "<prefix>v0,...,vN-1" for a per-channel table.
+ */
+static void comms_reply_channels(onion_comms_reply_t reply, const char *prefix, const uint32_t values[MUX_CHANNELS_COUNT]) {
+    char buf[ONION_COMMS_REPLY_MAX];
+    int n = snprintf(buf, sizeof(buf), "%s", prefix);
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%lu%s", (unsigned long)values[i], (i == MUX_CHANNELS_COUNT - 1) ? "" : ",");
+    }
+    reply(buf);
+}
+
+/* --- Command handlers --- */
+
+/**
+ * HANDSHAKE: PC app requested telemetry start (optionally binary framed).
+ * Synchronizes the full configuration state back to the PC immediately.
+ * Over BLE only the configuration is sent; the stream follows the subscription.
+ */
+static void cmd_connect(const char *line, onion_comms_reply_t reply) {
+    onion_key_t lut[MUX_CHANNELS_COUNT];
+    onion_lut_snapshot(lut);
+
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        comms_replyf(reply, "CFG:%d,%d,%d", i, onion_baseline_get_threshold(i, &lut[i]), lut[i].keycode);
+    }
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        comms_replyf(reply, "DB:%d,%d,%d", i, lut[i].press_debounce, lut[i].release_debounce);
+    }
+    if (reply != comms_reply_serial) return;
+
+    bool binary = (strncmp(line, "CONNECT:BIN", 11) == 0);
+    if (binary) {
+        unsigned baud = 0;
+        sscanf(line, "CONNECT:BIN,%u", &baud);
+        reply("BIN:OK");
+        if (baud > 0) onion_comms_set_baudrate(baud);
+    }
+    onion_telemetry_start(binary);
+}
+
+/**
+ * TERMINATION: PC app requested telemetry stop.
+ */
+static void cmd_disconnect(const char *line, onion_comms_reply_t reply) {
+    if (reply != comms_reply_serial) return;
+
+    bool was_binary = onion_telemetry_is_binary();
+    onion_telemetry_stop();
+    if (was_binary) onion_comms_set_baudrate(CONFIG_ESP_CONSOLE_UART_BAUDRATE);
+}
+
+/**
+ * CONFIGURATION UPDATE: Received new parameters for a specific sensor.
+ * Format: SET:channel,threshold,hid_keycode
+ */
+static void cmd_set(const char *line, onion_comms_reply_t reply) {
+    int ch, thr, key;
+    if (sscanf(line, "SET:%d,%d,%d", &ch, &thr, &key) != 3) return;
+    if (ch < 0 || ch >= MUX_CHANNELS_COUNT) return;
+
+    /* Absolute thresholds become a depth below the tracked baseline, so they follow drift */
+    onion_key_t *lut = onion_lut_edit_begin();
+    lut[ch].threshold = thr;
+    lut[ch].delta = onion_baseline_delta_for(ch, (uint16_t)thr);
+#if CONFIG_ONION_FILTER_ADAPTIVE
+    /* No absolute fallback compiled in: keep the default depth until a baseline exists */
+    if (lut[ch].delta == 0) lut[ch].delta = DEFAULT_DELTA;
+#endif
+    lut[ch].keycode = (uint8_t)key;
+    onion_lut_edit_commit();
+
+    // Persisted to NVS once the configurator has been quiet for a moment
+    onion_config_mark_dirty();
+}
+
+/** @brief Hex bytes per D line (fits COMMS_LINE_MAX, serial or BLE, on the way back in as a W line). */
+#define COMMS_HEX_CHUNK 48
+_Static_assert(sizeof("SETALL:W,65535,") - 1 + 2 * COMMS_HEX_CHUNK < COMMS_LINE_MAX,
+               "A D line must fit a W line");
+
+/** @brief Action table being uploaded with ACT:W (dispatch lock held). */
+static uint8_t act_stage[ONION_ACTION_TABLE_MAX];
+static onion_action_table_t act_check;
+
+/** @brief Configuration image being uploaded with SETALL:W (dispatch lock held). */
+static uint8_t all_stage[ONION_CONFIG_IMAGE_MAX];
+
+/**
+ * @brief GETALL image and ACT:GET table (dispatch lock held). Kept apart from the
+ * staging buffers, so a read between W lines never overwrites a pending upload.
+ */
+static uint8_t export_buf[ONION_CONFIG_IMAGE_MAX];
+
+static int comms_hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * @brief Decodes hex into stage at off.
+ * @return End offset of the written bytes, or -1 if the hex is malformed or overruns stage.
+ */
+static int comms_stage_hex(uint8_t *stage, int size, int off, const char *hex) {
+    if (off < 0 || off > size) return -1;
+    while (hex[0] != '\0' && hex[1] != '\0' && off < size) {
+        int hi = comms_hex_nibble(hex[0]), lo = comms_hex_nibble(hex[1]);
+        if (hi < 0 || lo < 0) break;
+        stage[off++] = (uint8_t)((hi << 4) | lo);
+        hex += 2;
+    }
+    return hex[0] == '\0' ? off : -1;
+}
+
+/**
+ * @brief Replies data as "<prefix>D,offset,hex" lines followed by "<prefix>END,len".
+ */
+static void comms_reply_hex(onion_comms_reply_t reply, const char *prefix, const uint8_t *data, size_t len) {
+    for (size_t pos = 0; pos < len; pos += COMMS_HEX_CHUNK) {
+        char buf[16 + 2 * COMMS_HEX_CHUNK];
+        int w = snprintf(buf, sizeof(buf), "%sD,%u,", prefix, (unsigned)pos);
+        for (size_t i = pos; i < len && i < pos + COMMS_HEX_CHUNK; i++) {
+            w += snprintf(buf + w, sizeof(buf) - w, "%02X", data[i]);
+        }
+        reply(buf);
+    }
+    comms_replyf(reply, "%sEND,%u", prefix, (unsigned)len);
+}
+
+/**
+ * @brief Validates a table and publishes it with the next configuration bank.
+ */
+static bool comms_apply_actions(const uint8_t *blob, size_t len) {
+    if (!onion_action_table_load(&act_check, blob, len)) return false;
+    onion_lut_edit_begin();
+    memcpy(onion_lut_edit_actions(), &act_check, sizeof(act_check));
+    onion_lut_edit_commit();
+    onion_config_mark_dirty();
+    return true;
+}
+
+/**
+ * ACTIONS: transfers the action table (tap/hold, layers, chords, macros; see onion_action.h) in hex.
+ * ACT:W,offset,hex stages bytes, ACT:COMMIT,len validates and applies them (ACT:ERR leaves the
+ * running table untouched), ACT:CLEAR removes every action, ACT:GET replies ACT:D,offset,hex
+ * lines followed by ACT:END,len.
+ */
+static void cmd_action(const char *line, onion_comms_reply_t reply) {
+    int off, len, n = 0;
+
+    if (sscanf(line, "ACT:W,%d,%n", &off, &n) == 1 && n > 0) {
+        int end = comms_stage_hex(act_stage, sizeof(act_stage), off, line + n);
+        if (end < 0) {
+            reply("ACT:ERR");
+        } else {
+            comms_replyf(reply, "ACT:OK,%d", end);
+        }
+    } else if (sscanf(line, "ACT:COMMIT,%d", &len) == 1) {
+        bool ok = len >= 0 && len <= ONION_ACTION_TABLE_MAX && comms_apply_actions(act_stage, (size_t)len);
+        reply(ok ? "ACT:OK" : "ACT:ERR");
+    } else if (strcmp(line, "ACT:CLEAR") == 0) {
+        comms_apply_actions(NULL, 0);
+        reply("ACT:OK");
+    } else if (strcmp(line, "ACT:GET") == 0) {
+        comms_reply_hex(reply, "ACT:", export_buf, onion_lut_snapshot_actions(export_buf));
+    }
+}
+
+/**
+ * BULK READ: the whole configuration as one checksummed image (see onion_storage.h) in hex.
+ * Replies ALL:D,offset,hex lines followed by ALL:END,len.
+ */
+static void cmd_getall(const char *line, onion_comms_reply_t reply) {
+    comms_reply_hex(reply, "ALL:", export_buf, onion_config_export(export_buf));
+}
+
+/**
+ * BULK WRITE: SETALL:W,offset,hex stages image bytes (ALL:OK,end), SETALL:COMMIT,len checks the
+ * CRC and layout, applies pads and actions as one bank and stores them with a single NVS commit.
+ * Replies ALL:OK, ALL:ERR (running configuration untouched) or ALL:NVS (applied, not stored).
+ */
+static void cmd_setall(const char *line, onion_comms_reply_t reply) {
+    int off, len, n = 0;
+
+    if (sscanf(line, "SETALL:W,%d,%n", &off, &n) == 1 && n > 0) {
+        int end = comms_stage_hex(all_stage, sizeof(all_stage), off, line + n);
+        if (end < 0) {
+            reply("ALL:ERR");
+        } else {
+            comms_replyf(reply, "ALL:OK,%d", end);
+        }
+    } else if (sscanf(line, "SETALL:COMMIT,%d", &len) == 1) {
+        int err = len >= 0 ? onion_config_import(all_stage, (size_t)len) : ESP_ERR_INVALID_SIZE;
+        if (err == ESP_OK) {
+            reply("ALL:OK");
+        } else if (err == ESP_ERR_INVALID_SIZE || err == ESP_ERR_INVALID_CRC || err == ESP_ERR_INVALID_ARG) {
+            reply("ALL:ERR");
+        } else {
+            reply("ALL:NVS");
+        }
+    }
+}
+
+/**
+ * DEBOUNCE UPDATE: sweeps a press / release must persist on a channel (1 = immediate).
+ * Format: DB:channel,press,release
+ */
+static void cmd_debounce(const char *line, onion_comms_reply_t reply) {
+    int ch, press, release;
+    if (sscanf(line, "DB:%d,%d,%d", &ch, &press, &release) != 3) return;
+    if (ch < 0 || ch >= MUX_CHANNELS_COUNT) return;
+    if (press < 1 || press > ONION_DEBOUNCE_MAX || release < 1 || release > ONION_DEBOUNCE_MAX) return;
+
+    onion_key_t *lut = onion_lut_edit_begin();
+    lut[ch].press_debounce = (uint8_t)press;
+    lut[ch].release_debounce = (uint8_t)release;
+    onion_lut_edit_commit();
+    onion_config_mark_dirty();
+}
+
+/**
+ * DIAGNOSTICS: rejected debounce transitions per channel.
+ */
+static void cmd_bounce(const char *line, onion_comms_reply_t reply) {
+    if (reply == comms_reply_serial) {
+        /* Follows the serial stream format (packet while binary is negotiated) */
+        fflush(stdout);
+        onion_telemetry_report_bounces();
+        return;
+    }
+
+    uint32_t counts[MUX_CHANNELS_COUNT];
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        counts[i] = onion_debounce_get_bounces(i);
+    }
+    comms_reply_channels(reply, "BOUNCE:", counts);
+}
+
+/**
+ * SETTLING: measure per-channel MUX settle times, apply them and store them with the LUT.
+ * The DMA frame shrinks to what the slowest channel needs.
+ */
+static void cmd_settle(const char *line, onion_comms_reply_t reply) {
+    uint8_t settle[MUX_CHANNELS_COUNT];
+    TickType_t timeout = pdMS_TO_TICKS(ONION_SETTLE_CAL_SWEEPS * (ONION_STANDBY_SCAN_PERIOD_MS + 20) * 2);
+
+    /* Stored only once the engine runs with them; on failure it keeps the previous frame */
+    if (!onion_scan_calibrate_settle(settle, timeout) || onion_scan_set_settle(settle) != ESP_OK) {
+        reply("SETTLE:ERR");
+        return;
+    }
+
+    uint32_t values[MUX_CHANNELS_COUNT];
+    onion_key_t *lut = onion_lut_edit_begin();
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        lut[i].settle_samples = settle[i];
+        values[i] = settle[i];
+    }
+    onion_lut_edit_commit();
+    onion_config_mark_dirty();
+
+    comms_reply_channels(reply, "SETTLE:", values);
+}
+
+/**
+ * DIAGNOSTICS: latency histogram summary per pipeline stage (microseconds).
+ * "STATS:RESET" starts every histogram over after printing.
+ */
+static void cmd_stats(const char *line, onion_comms_reply_t reply) {
+    onion_stat_summary_t sum;
+
+    if (!onion_stats_get(ONION_STAT_WAKE, &sum)) {
+        reply("STATS:OFF");
+        return;
+    }
+    for (int i = 0; i < ONION_STAT_COUNT; i++) {
+        onion_stats_get((onion_stat_id_t)i, &sum);
+        comms_replyf(reply, "STATS:%s,%lu,%lu,%lu,%lu,%lu", onion_stats_name((onion_stat_id_t)i),
+                     (unsigned long)sum.count, (unsigned long)sum.min, (unsigned long)sum.avg,
+                     (unsigned long)sum.p99, (unsigned long)sum.max);
+    }
+    if (strcmp(line, "STATS:RESET") == 0) onion_stats_reset();
+}
+
+/**
+ * DIAGNOSTICS: runtime profile for the configurator's load graphs, one CSV record per line:
+ * PROF:TASK,name,core,prio,cpu_permille,stack_free per task, PROF:MEM,heap_free,heap_min,
+ * heap_largest,mbuf_free,mbuf_total, PROF:SWEEP,sweeps,timeouts,max_wake_us,max_cycle_us,
+ * steps,overruns,frame_drops, PROF:BLE,merged,retried,resynced,tlm_dropped,tlm_retried, then
+ * PROF:END,window_us. CPU shares cover the time since the previous PROF.
+ */
+static void cmd_prof(const char *line, onion_comms_reply_t reply) {
+    static onion_prof_task_t tasks[ONION_PROF_MAX_TASKS];
+    onion_prof_mem_t mem;
+    onion_sweep_stats_t sweep;
+    uint32_t window_us, merged, retried, resynced, tlm_dropped, tlm_retried;
+
+    if (!onion_prof_mem(&mem)) {
+        reply("PROF:OFF");
+        return;
+    }
+    size_t n = onion_prof_tasks(tasks, ONION_PROF_MAX_TASKS, &window_us);
+    for (size_t i = 0; i < n; i++) {
+        comms_replyf(reply, "PROF:TASK,%s,%d,%u,%u,%lu", tasks[i].name, tasks[i].core, tasks[i].priority,
+                     tasks[i].cpu_permille, (unsigned long)tasks[i].stack_free);
+    }
+    comms_replyf(reply, "PROF:MEM,%lu,%lu,%lu,%u,%u", (unsigned long)mem.heap_free, (unsigned long)mem.heap_min,
+                 (unsigned long)mem.heap_largest, mem.mbuf_free, mem.mbuf_total);
+
+    onion_sweep_get_stats(&sweep, false);
+    comms_replyf(reply, "PROF:SWEEP,%lu,%lu,%lu,%lu,%lu,%lu,%lu", (unsigned long)sweep.sweeps,
+                 (unsigned long)sweep.timeouts, (unsigned long)sweep.max_wake_us,
+                 (unsigned long)sweep.max_cycle_us, (unsigned long)onion_scan_get_step_count(),
+                 (unsigned long)onion_scan_get_overruns(), (unsigned long)onion_scan_get_frame_drops());
+
+    onion_ble_get_report_stats(&merged, &retried, &resynced);
+    onion_gatt_tlm_get_stats(&tlm_dropped, &tlm_retried);
+    comms_replyf(reply, "PROF:BLE,%lu,%lu,%lu,%lu,%lu", (unsigned long)merged, (unsigned long)retried,
+                 (unsigned long)resynced, (unsigned long)tlm_dropped, (unsigned long)tlm_retried);
+
+    comms_replyf(reply, "PROF:END,%lu", (unsigned long)window_us);
+}
+
+#if CONFIG_ONION_BENCH
+/**
+ * DIAGNOSTICS: pipeline benchmark on synthetic data (benchmark builds only).
+ * Results go to the console, so the command is serial only.
+ */
+static void cmd_bench(const char *line, onion_comms_reply_t reply) {
+    if (reply != comms_reply_serial) {
+        reply("BENCH:ERR");
+        return;
+    }
+    fflush(stdout);
+    onion_bench_run();
+}
+#endif
+
+/**
+ * PERSISTENCE: commit pending configuration changes to NVS right now.
+ */
+static void cmd_save(const char *line, onion_comms_reply_t reply) {
+    reply(onion_config_flush() == ESP_OK ? "SAVE:OK" : "SAVE:ERR");
+}
+
+/**
+ * CALIBRATION: re-measure every baseline over ONION_CAL_SWEEPS untouched sweeps.
+ * Replies with the new baselines, or CAL:ERR if the scan engine did not deliver.
+ */
+static void cmd_cal(const char *line, onion_comms_reply_t reply) {
+    uint32_t timeout_ms = ONION_CAL_SWEEPS * (ONION_STANDBY_SCAN_PERIOD_MS + 20) * 2;
+    if (!onion_baseline_calibrate(ONION_CAL_SWEEPS, timeout_ms)) {
+        reply("CAL:ERR");
+        return;
+    }
+
+    uint32_t values[MUX_CHANNELS_COUNT];
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        values[i] = onion_baseline_get(i);
+    }
+    comms_reply_channels(reply, "CAL:", values);
+}
+
+/**
+ * @brief Prints one flight-recorder event as "EV:timestamp_us,type,channel,value".
+ */
+static void comms_reply_event(const onion_evlog_entry_t *e, void *ctx) {
+    comms_replyf(*(const onion_comms_reply_t *)ctx, "EV:%lu,%u,%u,%u", (unsigned long)e->timestamp_us,
+                 e->type, e->channel, e->value);
+}
+
+/**
+ * DIAGNOSTICS: streams the event log (press/release history and notify outcomes).
+ * "DUMP" sends the live log, "DUMP:CRASH" the one saved after the last crash reset.
+ */
+static void cmd_dump(const char *line, onion_comms_reply_t reply) {
+    if (strcmp(line, "DUMP:CRASH") == 0) {
+        int n = onion_evlog_foreach_crash(comms_reply_event, &reply);
+        if (n < 0) {
+            reply("DUMP:NONE");
+        } else {
+            comms_replyf(reply, "DUMP:END,%d", n);
+        }
+        return;
+    }
+    size_t n = onion_evlog_foreach(comms_reply_event, &reply);
+    comms_replyf(reply, "DUMP:END,%u", (unsigned)n);
+}
+
+static const onion_cmd_t commands[] = {
+    { "CONNECT",    cmd_connect },
+    { "DISCONNECT", cmd_disconnect },
+    { "SET:",       cmd_set },
+    { "SAVE",       cmd_save },
+    { "CAL",        cmd_cal },
+    { "DB:",        cmd_debounce },
+    { "SETTLE",     cmd_settle },
+    { "STATS",      cmd_stats },
+    { "PROF",       cmd_prof },
+#if CONFIG_ONION_BENCH
+    { "BENCH",      cmd_bench },
+#endif
+    { "BOUNCE",     cmd_bounce },
+    { "DUMP",       cmd_dump },
+    { "ACT:",       cmd_action },
+    { "GETALL",     cmd_getall },
+    { "SETALL:",    cmd_setall },
+};
+
+void onion_comms_execute(const char *line, onion_comms_reply_t reply) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strncmp(line, commands[i].prefix, strlen(commands[i].prefix)) == 0) {
+            xSemaphoreTake(dispatch_lock, portMAX_DELAY);
+            commands[i].handler(line, reply);
+            xSemaphoreGive(dispatch_lock);
+            return;
+        }
+    }
+    ESP_LOGD(TAG, "Unknown command: %s", line);
+}
+
+/**
+ * @brief Splits received bytes into lines and dispatches each complete one.
+ */
+static void comms_feed(const uint8_t *data, size_t len) {
+    static char line[COMMS_LINE_MAX];
+    static size_t line_ptr = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = (char)data[i];
+        // Check for line terminators or buffer overflow
+        if (c == '\n' || c == '\r' || line_ptr >= sizeof(line) - 1) {
+            line[line_ptr] = '\0';
+            if (line_ptr > 0) onion_comms_execute(line, comms_reply_serial);
+            line_ptr = 0;
+        } else {
+            line[line_ptr++] = c;
+        }
+    }
+}
+
+/**
+ * FreeRTOS Task: onion_comms_task
+ * Sleeps on the console driver until bytes arrive, so a command takes effect
+ * milliseconds after its terminator is received.
+ */
+static void onion_comms_task(void *pvParameters) {
+    uint8_t buf[COMMS_RX_CHUNK];
+
+    while (1) {
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+        int n = usb_serial_jtag_read_bytes(buf, sizeof(buf), portMAX_DELAY);
+        if (n > 0) comms_feed(buf, (size_t)n);
+#else
+        uart_event_t event;
+        if (xQueueReceive(uart_queue, &event, portMAX_DELAY) != pdTRUE) continue;
+
+        switch (event.type) {
+            case UART_DATA: {
+                size_t pending = event.size;
+                while (pending > 0) {
+                    int n = uart_read_bytes(CONFIG_ESP_CONSOLE_UART_NUM, buf,
+                                            pending < sizeof(buf) ? pending : sizeof(buf), 0);
+                    if (n <= 0) break;
+                    comms_feed(buf, (size_t)n);
+                    pending -= (size_t)n;
+                }
+                break;
+            }
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                ESP_LOGW(TAG, "Serial RX overflow, input flushed");
+                uart_flush_input(CONFIG_ESP_CONSOLE_UART_NUM);
+                xQueueReset(uart_queue);
+                break;
+            default:
+                break;
+        }
+#endif
+    }
+}
+
+void onion_comms_early_init(void) {
+    dispatch_lock = xSemaphoreCreateMutexStatic(&dispatch_lock_buf);
+}
+
+int onion_comms_init(void) {
+    esp_err_t err;
+
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    usb_serial_jtag_driver_config_t cfg = { .rx_buffer_size = 256, .tx_buffer_size = 2048 };
+    err = usb_serial_jtag_driver_install(&cfg);
+    if (err == ESP_OK) usb_serial_jtag_vfs_use_driver();
+#else
+    err = uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 2048, 16, &uart_queue, 0);
+    /* stdio must share the driver, otherwise printf races the driver's TX FIFO */
+    if (err == ESP_OK) uart_vfs_dev_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+#endif
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Console driver install failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    err = onion_telemetry_init();
+    if (err != ESP_OK) return err;
+
+    xTaskCreateStatic(onion_comms_task, "telemetry_task", ONION_COMMS_TASK_STACK, NULL, 5,
+                      comms_task_stack, &comms_task_buf);
+    return ESP_OK;
+}
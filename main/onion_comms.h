@@ -0,0 +1,51 @@
+/**
+ * @file onion_comms.h
+ * @brief Serial link to the OnionConfigurator PC application.
+ *
+ * Owns the console driver. The command task blocks on the driver (UART event
+ * queue or USB-Serial-JTAG read) and parses complete lines as soon as they
+ * arrive; outbound telemetry is paced separately by onion_telemetry. The
+ * command table is shared with the BLE link, each response going back to the
+ * link the command came from.
+ */
+
+#ifndef ONION_COMMS_H
+#define ONION_COMMS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "onion_config.h"
+
+/** @brief Longest response line handed to a reply sink (terminator excluded); fits one 32-bit value per channel. */
+#define ONION_COMMS_REPLY_MAX (16 + MUX_CHANNELS_COUNT * 11)
+
+/**
+ * @brief Response sink: receives one line without its terminator.
+ */
+typedef void (*onion_comms_reply_t)(const char *line);
+
+/**
+ * @brief Creates the command dispatch lock.
+ * @note Call before onion_ble_init(): its command task dispatches BLE lines through the same lock.
+ */
+void onion_comms_early_init(void);
+
+/**
+ * @brief Installs the console driver, starts telemetry and the command task.
+ * @return ESP_OK on success, or an error code from the driver.
+ */
+int onion_comms_init(void);
+
+/**
+ * @brief Changes the console baud rate once pending output has drained (UART consoles only).
+ */
+void onion_comms_set_baudrate(uint32_t baud);
+
+/**
+ * @brief Runs one command line and sends its responses to reply.
+ * Commands from different links are serialised; slow ones (CAL, SETTLE) block the caller.
+ * @note Stream control (CONNECT / DISCONNECT) and BENCH only act on the serial link.
+ */
+void onion_comms_execute(const char *line, onion_comms_reply_t reply);
+
+#endif // ONION_COMMS_H
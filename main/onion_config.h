@@ -8,7 +8,21 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "driver/touch_pad.h"
+/* ONION_HOST_BUILD: compiling the pure pipeline (onion_pipeline.h) on a PC */
+#ifndef ONION_HOST_BUILD
+#include "hal/adc_types.h"
+#include "sdkconfig.h"
+#else
+/* Kconfig defaults (main/Kconfig.projbuild): the host build has no sdkconfig.h */
+#define CONFIG_ONION_MUX_COUNT        1
+#define CONFIG_ONION_MUX0_ADC_CHANNEL 6
+#define CONFIG_ONION_MUX_S0_GPIO      18
+#define CONFIG_ONION_MUX_S1_GPIO      19
+#define CONFIG_ONION_MUX_S2_GPIO      21
+#define CONFIG_ONION_MUX_S3_GPIO      22
+#define CONFIG_ONION_SCAN_AVG_SAMPLES 8
+#define CONFIG_ONION_FILTER_MIXED     1
+#endif
 
 /** @brief Device name advertised over Bluetooth GAP. */
 #define DEVICE_NAME "OnionController"
@@ -21,25 +35,244 @@
 #define BLE_SVC_HID_CHR_UUID16_HID_CTRL_POINT        0x2a4c
 #define BLE_SVC_HID_CHR_UUID16_PROTOCOL_MODE        0x2a4e
 
-/* --- Hardware Pins & Multiplexer Config --- */
-#define MUX_S0 18
-#define MUX_S1 19
-#define MUX_S2 21
-#define MUX_S3 22
-#define MUX_INPUT_PIN ADC1_CHANNEL_6
-#define MUX_CHANNELS_COUNT 16
+/* --- Hardware Pins & Multiplexer Config (menuconfig → OnionController → Scan pipeline) --- */
+#define MUX_S0 CONFIG_ONION_MUX_S0_GPIO
+#define MUX_S1 CONFIG_ONION_MUX_S1_GPIO
+#define MUX_S2 CONFIG_ONION_MUX_S2_GPIO
+#define MUX_S3 CONFIG_ONION_MUX_S3_GPIO
 #define STATUS_LED_GPIO 2
 
-/** @brief Global default threshold for touch detection. */
-#define DEFAULT_THRESHOLD  3900
+/*
+ * Channel topology: ONION_MUX_COUNT CD74HC4067s share the S0-S3 select lines,
+ * and MUX m drives its own ADC1 input, ONION_MUX_ADC_CHANNELS[m]. Every
+ * address step converts all MUX outputs in one interleaved DMA frame, so the
+ * sweep time does not grow with the number of multiplexers. Pad index
+ * (channel) = m * ONION_MUX_ADDRESSES + address.
+ */
+/** @brief Addresses per multiplexer (S0-S3). */
+#define ONION_MUX_ADDRESSES 16
+/** @brief Multiplexers on the board (1 or 2 keeps the pressed mask in 32 bits). */
+#define ONION_MUX_COUNT CONFIG_ONION_MUX_COUNT
+/** @brief ADC1 input of each multiplexer, in MUX order. */
+#if ONION_MUX_COUNT == 1
+#define ONION_MUX_ADC_CHANNELS { CONFIG_ONION_MUX0_ADC_CHANNEL }
+#else
+#define ONION_MUX_ADC_CHANNELS { CONFIG_ONION_MUX0_ADC_CHANNEL, CONFIG_ONION_MUX1_ADC_CHANNEL }
+#endif
+/** @brief Total pads; sizes every per-channel table. */
+#define MUX_CHANNELS_COUNT (ONION_MUX_COUNT * ONION_MUX_ADDRESSES)
+
+/** @brief One bit per channel (bit n = channel n); 16 bits while a single MUX is fitted. */
+#if MUX_CHANNELS_COUNT <= 16
+typedef uint16_t onion_mask_t;
+#else
+typedef uint32_t onion_mask_t;
+#endif
+#define ONION_MASK_BIT(ch) ((onion_mask_t)((onion_mask_t)1u << (ch)))
+
+_Static_assert(MUX_CHANNELS_COUNT <= 32, "Pressed masks hold at most 32 channels");
+
+/* --- Scan Engine (continuous ADC / DMA) --- */
+/**
+ * @brief Conversion rate per MUX output of the DMA engine. The classic ESP32 converts
+ * up to 2 MHz; the C3 and S3 stop at 83.3 kHz (SOC_ADC_SAMPLE_FREQ_THRES_HIGH), shared
+ * by every MUX output.
+ */
+#if CONFIG_IDF_TARGET_ESP32
+#define ONION_SCAN_SAMPLE_FREQ_HZ   200000
+#else
+#define ONION_SCAN_SAMPLE_FREQ_HZ   (80000 / ONION_MUX_COUNT)
+#endif
+/** @brief Longest DMA frame per MUX step (used while settling is uncalibrated or measured). Must be even. */
+#define ONION_SCAN_SAMPLES_PER_STEP 16
+/** @brief Default leading conversions discarded per step while the MUX output settles. */
+#define ONION_SCAN_SETTLE_SAMPLES   8
+/** @brief Deepest averaging requested by the power manager (a power of two); frames are sized for it. */
+#define ONION_SCAN_AVG_SAMPLES_MAX  CONFIG_ONION_SCAN_AVG_SAMPLES
+/** @brief Sweeps observed by the SETTLE calibration. */
+#define ONION_SETTLE_CAL_SWEEPS     32
+/** @brief A sample is settled once it is within this many counts of the step's final value. */
+#define ONION_SETTLE_TOLERANCE      8
+/** @brief Extra samples added to each measured settle time. */
+#define ONION_SETTLE_MARGIN         1
+/** @brief Depth of the tagged-sample ring buffer (power of two). */
+#define ONION_SCAN_RING_LEN         64
+/** @brief Input attenuation of every MUX input (range ~0-3.1 V); the calibration curves are built for it. */
+#define ONION_SCAN_ATTEN            ADC_ATTEN_DB_12
+
+/* --- ADC Calibration (see onion_cali.h) --- */
+/** @brief Full-scale voltage of the nominal line used when the chip has no calibration data. */
+#define ONION_CALI_NOMINAL_MV       3100
+/** @brief Reference voltage passed to classic-ESP32 line fitting. */
+#define ONION_CALI_DEFAULT_VREF_MV  1100
+
+/**
+ * @brief Set to 1 to expose an NKRO bitmap input report (Report ID 2).
+ * When enabled keys are reported through the bitmap only; 0 keeps the
+ * boot-compatible 6KRO report.
+ */
+#define ONION_HID_NKRO 0
+
+/** @brief Hosts connected at the same time; each subscribed one receives every report. */
+#define ONION_BLE_MAX_CONNS 2
+
+/** @brief Keyboard states buffered between the scan loop and the NimBLE host (power of two). */
+#define ONION_REPORT_QUEUE_LEN 8
+/** @brief Merged states kept per host when it lags and is skipped ahead in the queue. */
+#define ONION_BLE_CATCHUP_LEN  (ONION_REPORT_QUEUE_LEN - 2)
+/**
+ * @brief Keyboard states captured before the first host subscribed after boot,
+ * replayed to it on connect. Only presses within the first
+ * ONION_PRELINK_WINDOW_MS after boot are kept; older input would be stale.
+ */
+#define ONION_PRELINK_REPLAY_LEN  (ONION_REPORT_QUEUE_LEN - 2)
+#define ONION_PRELINK_WINDOW_MS   5000
+
+/* --- BLE Connection Parameters (interval 1.25 ms, timeout 10 ms units) --- */
+#define ONION_CONN_ACTIVE_ITVL_MIN      6    /**< 7.5 ms */
+#define ONION_CONN_ACTIVE_ITVL_MAX      12   /**< 15 ms, the floor of several hosts */
+#define ONION_CONN_ACTIVE_ITVL_FALLBACK 24   /**< 30 ms max if the host rejects the above */
+#define ONION_CONN_ACTIVE_LATENCY       0
+#define ONION_CONN_STANDBY_ITVL_MIN     48   /**< 60 ms */
+#define ONION_CONN_STANDBY_ITVL_MAX     80   /**< 100 ms */
+#define ONION_CONN_STANDBY_LATENCY      4
+#define ONION_CONN_SUPERVISION_TIMEOUT  600  /**< 6 s */
+
+/* --- BLE Radio (requested after connecting; the link stays on 1M / 27 bytes if refused) --- */
+/** @brief Set to 1 to ask for the 2M PHY (BLE 5 controllers: ESP32-S3 / C3; the classic ESP32 refuses). */
+#define ONION_LINK_PREFER_2M_PHY   1
+/** @brief Data Length Extension: largest LL payload and its air time (251 octets on 1M, so 2M fits too). */
+#define ONION_LINK_DATA_LEN_OCTETS 251
+#define ONION_LINK_DATA_LEN_TIME   2120 /**< us */
+
+/* --- Advertising (0.625 ms units): reconnect sequence after boot, a disconnect or a wake-up --- */
+/** @brief High-duty directed burst to the last bonded host (the spec caps it at 1.28 s). */
+#define ONION_ADV_DIRECTED_DURATION_MS  1280
+/** @brief Then fast undirected advertising (STATE_ACTIVE only)... */
+#define ONION_ADV_FAST_ITVL_MIN         32   /**< 20 ms */
+#define ONION_ADV_FAST_ITVL_MAX         48   /**< 30 ms */
+#define ONION_ADV_FAST_DURATION_MS      30000
+/** @brief ...and slow undirected advertising until a host connects. */
+#define ONION_ADV_SLOW_ITVL_MIN         1600 /**< 1 s */
+#define ONION_ADV_SLOW_ITVL_MAX         1760 /**< 1.1 s */
+
+/* --- Power Management --- */
+/** @brief Idle time after the last touch before the controller drops to STATE_STANDBY. */
+#define ONION_STANDBY_TIMEOUT_MS 5000
+/** @brief Sweep timer period while active / in standby (standby bounds the wake latency). */
+#define ONION_ACTIVE_SCAN_PERIOD_MS  10
+#define ONION_STANDBY_SCAN_PERIOD_MS 50
+/** @brief Sweep task placement: the core without the BT controller (core 0 on single-core chips), above the NimBLE host (5). */
+#if CONFIG_FREERTOS_UNICORE || (defined(CONFIG_BTDM_CTRL_PINNED_TO_CORE) && CONFIG_BTDM_CTRL_PINNED_TO_CORE == 1) || \
+    (defined(CONFIG_BT_CTRL_PINNED_TO_CORE) && CONFIG_BT_CTRL_PINNED_TO_CORE == 1)
+#define ONION_SWEEP_TASK_CORE 0
+#else
+#define ONION_SWEEP_TASK_CORE 1
+#endif
+#define ONION_SWEEP_TASK_PRIO 10
+
+/** @brief Settled samples averaged per MUX step while active / in standby (powers of two). */
+#define ONION_ACTIVE_AVG_SAMPLES  ONION_SCAN_AVG_SAMPLES_MAX
+#define ONION_STANDBY_AVG_SAMPLES ((ONION_SCAN_AVG_SAMPLES_MAX + 1) / 2)
+
+/** @brief Sweeps buffered for the telemetry TX task. */
+#define ONION_TLM_QUEUE_LEN 16
+/** @brief Pacing of the ASCII "RAW:" stream (the binary stream follows the scan rate). */
+#define ONION_TLM_ASCII_PERIOD_MS 50
+
+/* --- BLE Telemetry / Configuration Service (see onion_gatt_tlm.h) --- */
+/** @brief ATT MTU offered to the host; stream packets carry as many sweeps as the negotiated MTU fits. */
+#define ONION_GATT_TLM_MTU 247
+/** @brief Minimum spacing of streamed sweeps (100 Hz). */
+#define ONION_GATT_TLM_PERIOD_MS 10
+/** @brief Longest a streamed sweep waits for its packet to fill up. */
+#define ONION_GATT_TLM_BATCH_MS 40
+/** @brief Sweeps buffered between the sweep task and the NimBLE host (power of two). */
+#define ONION_GATT_TLM_RING_LEN 32
+/**
+ * @brief Command lines buffered from the command characteristic, and their maximum length.
+ * As long as a serial line, so the ALL:D/ACT:D data lines go back in as one W write each
+ * (one write fits the ATT MTU).
+ */
+#define ONION_GATT_CMD_QUEUE_LEN 4
+#define ONION_GATT_CMD_LINE_MAX  128
+_Static_assert(ONION_GATT_CMD_LINE_MAX <= ONION_GATT_TLM_MTU - 3, "A command line must fit one ATT write");
+
+/* --- Task Stacks --- */
+/**
+ * @brief Statically allocated stacks, in bytes. PROF reports each task's
+ * high-water mark (stack_free); keep at least 512 bytes of it under load.
+ */
+#define ONION_NIMBLE_HOST_STACK 4096  /**< NimBLE host: GAP/GATT callbacks, SM crypto */
+#define ONION_SWEEP_TASK_STACK  4096  /**< Classification, report building, event log */
+#define ONION_COMMS_TASK_STACK  4096  /**< Serial commands: vsnprintf, NVS commits from SAVE */
+#define ONION_GATT_CMD_STACK    4096  /**< BLE commands: same handlers as the serial link */
+#define ONION_TLM_TX_STACK      3072  /**< Telemetry framing and console writes */
+#define ONION_FLUSH_TASK_STACK  2560  /**< Deferred NVS commits */
+
+/** @brief Events kept by the flight recorder (see onion_evlog.h), 8 bytes each; power of two. */
+#define ONION_EVLOG_LEN 512
+
+/** @brief Quiet time after the last configuration change before it is committed to NVS. */
+#define ONION_CONFIG_FLUSH_DELAY_MS 2000
+
+/** @brief Global default threshold for touch detection, in mV. */
+#define DEFAULT_THRESHOLD  2950
+
+/* --- Adaptive Baseline (see onion_baseline.h) --- */
+/** @brief Default press depth below the tracked baseline, in mV. */
+#define DEFAULT_DELTA               150
+/** @brief Release once the depth falls below delta - (delta >> SHIFT). */
+#define ONION_TOUCH_HYSTERESIS_SHIFT 2
+/** @brief IIR step while the reading rises above the baseline (fast recovery). */
+#define ONION_BASELINE_RISE_SHIFT   3
+/** @brief IIR step while the reading sinks below the baseline (slow, so a touch is not absorbed). */
+#define ONION_BASELINE_FALL_SHIFT   7
+/**
+ * @brief A pad pressed without a break for this long is taken as a step change of its
+ * level (wet pad, moved vegetable) rather than a touch: the baseline is re-seeded at
+ * the current reading, which releases the pad.
+ */
+#define ONION_BASELINE_STUCK_MS     30000
+/** @brief Sweeps averaged by the CAL command. */
+#define ONION_CAL_SWEEPS            16
+
+/* --- Debounce (consecutive sweeps a new state must persist, 1 = immediate) --- */
+#define DEFAULT_PRESS_DEBOUNCE   2
+#define DEFAULT_RELEASE_DEBOUNCE 2
+/** @brief Upper bound accepted from the serial protocol. */
+#define ONION_DEBOUNCE_MAX       8
+
+/* --- Action Engine (tap/hold, layers, chords, macros; see onion_action.h) --- */
+/** @brief Largest action table (bytecode blob, stored in NVS next to the pad table). */
+#define ONION_ACTION_TABLE_MAX     512
+/** @brief Layers including the base layer (the pad table); layer maps cover the others. */
+#define ONION_ACTION_LAYERS        4
+/** @brief Action programs addressable from keycodes 0xF0-0xFF. */
+#define ONION_ACTION_MAX           16
+#define ONION_ACTION_MAX_CHORDS    8
+/** @brief Pads of a chord must all be down within this window; chord pads wait up to this long. */
+#define ONION_ACTION_CHORD_MS      50
+/** @brief Sequences (macros, taps) queued behind the one being played. */
+#define ONION_ACTION_SEQ_DEPTH     4
+/** @brief Keys a sequence may hold down at once. */
+#define ONION_ACTION_SEQ_KEYS      6
+/** @brief Per-sweep budget: bytecode ops interpreted, and reports queued for BLE. */
+#define ONION_ACTION_OPS_PER_SWEEP 16
+#define ONION_ACTION_OUT_LEN       4
+/** @brief Spacing of sequence steps without a connection (one 7.5 ms connection interval). */
+#define ONION_ACTION_DEFAULT_STEP_US 7500
 
 /**
  * @brief Structure representing a single touch-key mapping.
  */
 typedef struct {
     uint8_t  keycode;   /**< HID Keyboard scan code */
-    uint16_t threshold; /**< Capacitive touch trigger level */
-    bool     is_pressed;/**< Current debounce/state flag */
+    uint16_t threshold; /**< Absolute trigger level in mV, used only while delta is 0 */
+    uint16_t delta;     /**< Press depth below the adaptive baseline in mV (0 = absolute threshold) */
+    uint8_t  press_debounce;   /**< Sweeps a touch must persist before it is reported */
+    uint8_t  release_debounce; /**< Sweeps a release must persist before it is reported */
+    uint8_t  settle_samples;   /**< Conversions discarded after switching the MUX to this channel */
 } onion_key_t;
 
 /**
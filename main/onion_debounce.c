@@ -0,0 +1,18 @@
+/**
+ * @file onion_debounce.c
+ * @brief Live debounce filter bank and its bounce counters.
+ */
+
+#include "onion_debounce.h"
+#include "onion_config.h"
+
+/** @brief Filter bank of the live pipeline (written only by the sweep task). */
+static onion_debounce_t live;
+
+onion_mask_t onion_debounce_process(onion_mask_t detect_mask, const onion_key_t *lut) {
+    return onion_debounce_filter(&live, detect_mask, lut);
+}
+
+uint32_t onion_debounce_get_bounces(int ch) {
+    return __atomic_load_n(&live.bounces[ch], __ATOMIC_RELAXED);
+}
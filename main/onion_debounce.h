@@ -0,0 +1,46 @@
+/**
+ * @file onion_debounce.h
+ * @brief Per-channel counter-integrator debounce between detection and HID dispatch.
+ *
+ * A detector transition is reported only after it has persisted for the
+ * channel's press_debounce (or release_debounce) consecutive sweeps, so a
+ * setting of 2 costs at most one sweep of latency. A transition that reverts
+ * before that is counted as a rejected bounce.
+ */
+
+#ifndef ONION_DEBOUNCE_H
+#define ONION_DEBOUNCE_H
+
+#include <stdint.h>
+#include "onion_config.h"
+
+/**
+ * @brief Filter bank state (zero-initialize to start with every channel released).
+ */
+typedef struct {
+    onion_mask_t stable_mask;
+    uint8_t  pending[MUX_CHANNELS_COUNT];  /**< Sweeps the detector has disagreed with stable_mask */
+    uint32_t bounces[MUX_CHANNELS_COUNT];
+} onion_debounce_t;
+
+/**
+ * @brief Filters one sweep through a filter bank (pure, defined in onion_pipeline.c).
+ * @return Debounced pressed mask.
+ */
+onion_mask_t onion_debounce_filter(onion_debounce_t *d, onion_mask_t detect_mask, const onion_key_t *lut);
+
+/**
+ * @brief Filters one sweep of detector output through the live filter bank.
+ * @param detect_mask Undebounced pressed mask (bit n = channel n).
+ * @param lut Configuration bank of this sweep.
+ * @return Debounced pressed mask.
+ * @note Called only from the task that runs onion_touch_sweep().
+ */
+onion_mask_t onion_debounce_process(onion_mask_t detect_mask, const onion_key_t *lut);
+
+/**
+ * @brief Number of rejected bounces on a channel since boot.
+ */
+uint32_t onion_debounce_get_bounces(int ch);
+
+#endif // ONION_DEBOUNCE_H
@@ -0,0 +1,148 @@
+/**
+ * @file onion_evlog.c
+ * @brief Lock-free multi-writer event ring in no-init RAM, with an NVS crash snapshot.
+ */
+
+#include "onion_evlog.h"
+#include "onion_config.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "string.h"
+#include <stdlib.h>
+
+static const char *TAG = "ONION_EVLOG";
+static const char *NVS_NAMESPACE = "onion_evlog";
+static const char *NVS_KEY_CRASH = "crash";
+
+#define EVLOG_MASK  (ONION_EVLOG_LEN - 1)
+/** @brief Marks the no-init ring as written by this firmware ("EVLG"). */
+#define EVLOG_MAGIC 0x45564C47u
+
+_Static_assert((ONION_EVLOG_LEN & EVLOG_MASK) == 0, "ONION_EVLOG_LEN must be a power of two");
+
+/**
+ * @brief Ring state. seq[i] holds n + 1 once event n is complete in slots[i]
+ * and 0 while a writer is filling it, so readers detect torn and stale slots.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t head;                          /**< Next event number to reserve */
+    uint32_t seq[ONION_EVLOG_LEN];
+    onion_evlog_entry_t slots[ONION_EVLOG_LEN];
+} evlog_t;
+
+static __NOINIT_ATTR evlog_t evlog;
+
+void onion_evlog_record(int64_t timestamp_us, uint8_t type, uint8_t channel, uint16_t value) {
+    const uint32_t n = __atomic_fetch_add(&evlog.head, 1, __ATOMIC_RELAXED);
+    const uint32_t i = n & EVLOG_MASK;
+
+    __atomic_store_n(&evlog.seq[i], 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    evlog.slots[i] = (onion_evlog_entry_t){
+        .timestamp_us = (uint32_t)timestamp_us,
+        .value = value,
+        .channel = channel,
+        .type = type,
+    };
+    __atomic_store_n(&evlog.seq[i], n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Copies event n if it is still in the ring and complete.
+ */
+static bool evlog_get(uint32_t n, onion_evlog_entry_t *out) {
+    const uint32_t i = n & EVLOG_MASK;
+
+    if (__atomic_load_n(&evlog.seq[i], __ATOMIC_ACQUIRE) != n + 1) return false;
+    *out = evlog.slots[i];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&evlog.seq[i], __ATOMIC_RELAXED) == n + 1;
+}
+
+size_t onion_evlog_foreach(onion_evlog_visit_t visit, void *ctx) {
+    const uint32_t head = __atomic_load_n(&evlog.head, __ATOMIC_ACQUIRE);
+    const uint32_t first = (head > ONION_EVLOG_LEN) ? head - ONION_EVLOG_LEN : 0;
+    onion_evlog_entry_t e;
+    size_t visited = 0;
+
+    for (uint32_t n = first; n != head; n++) {
+        if (!evlog_get(n, &e)) continue;
+        visit(&e, ctx);
+        visited++;
+    }
+    return visited;
+}
+
+/**
+ * @brief Copies the complete events of the ring left by the previous run into NVS.
+ */
+static void evlog_save_crash(esp_reset_reason_t reason) {
+    onion_evlog_entry_t *blob = malloc(sizeof(evlog.slots));
+    nvs_handle_t nvs;
+    size_t count = 0;
+
+    if (blob == NULL) return;
+    const uint32_t head = evlog.head;
+    const uint32_t first = (head > ONION_EVLOG_LEN) ? head - ONION_EVLOG_LEN : 0;
+    for (uint32_t n = first; n != head; n++) {
+        if (evlog_get(n, &blob[count])) count++;
+    }
+
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, NVS_KEY_CRASH, blob, count * sizeof(blob[0]));
+        if (err == ESP_OK) err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    free(blob);
+
+    if (err == ESP_OK) {
+        ESP_LOGW(TAG, "Reset reason %d: saved %u events of the previous run (DUMP:CRASH)", reason, (unsigned)count);
+    } else {
+        ESP_LOGE(TAG, "Crash log save failed (%s)", esp_err_to_name(err));
+    }
+}
+
+void onion_evlog_init(void) {
+    const esp_reset_reason_t reason = esp_reset_reason();
+    const bool crashed = (reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT ||
+                          reason == ESP_RST_TASK_WDT || reason == ESP_RST_WDT);
+
+    if (crashed && evlog.magic == EVLOG_MAGIC) {
+        evlog_save_crash(reason);
+    }
+    memset(&evlog, 0, sizeof(evlog));
+    evlog.magic = EVLOG_MAGIC;
+    onion_evlog_record(esp_timer_get_time(), ONION_EVLOG_BOOT, 0, (uint16_t)reason);
+}
+
+int onion_evlog_foreach_crash(onion_evlog_visit_t visit, void *ctx) {
+    nvs_handle_t nvs;
+    size_t len = 0;
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return -1;
+    if (nvs_get_blob(nvs, NVS_KEY_CRASH, NULL, &len) != ESP_OK || len > sizeof(evlog.slots)) {
+        nvs_close(nvs);
+        return -1;
+    }
+
+    onion_evlog_entry_t *blob = malloc(len ? len : 1);
+    esp_err_t err = blob ? nvs_get_blob(nvs, NVS_KEY_CRASH, blob, &len) : ESP_ERR_NO_MEM;
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        free(blob);
+        return -1;
+    }
+
+    const size_t count = len / sizeof(blob[0]);
+    for (size_t i = 0; i < count; i++) {
+        visit(&blob[i], ctx);
+    }
+    free(blob);
+    return (int)count;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file onion_evlog.h
+ * @brief Flight recorder: fixed-size RAM ring of timestamped input and notify events.
+ *
+ * The sweep task records every debounced press and release with the reading
+ * that caused it; the NimBLE host records the outcome of every HID notify.
+ * Writers reserve a slot with one atomic increment and never block or take
+ * a lock, so recording costs the scan loop a few dozen cycles. When the ring
+ * is full the oldest entries are overwritten. "DUMP" streams the ring over
+ * the serial link.
+ *
+ * The ring lives in no-init RAM, which keeps its contents across a panic or
+ * watchdog reset. After such a reset, onion_evlog_init() stores the previous
+ * run's events in NVS, where "DUMP:CRASH" can read them.
+ */
+
+#ifndef ONION_EVLOG_H
+#define ONION_EVLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "onion_config.h"
+
+/* --- Event types (onion_evlog_entry_t.type) --- */
+#define ONION_EVLOG_BOOT         0x01 /**< value: esp_reset_reason() of this boot */
+#define ONION_EVLOG_PRESS        0x02 /**< channel, value: reading in mV */
+#define ONION_EVLOG_RELEASE      0x03 /**< channel, value: reading in mV */
+#define ONION_EVLOG_REPORT_BUSY  0x04 /**< Report queue full, state resubmitted with the next sweep */
+#define ONION_EVLOG_NOTIFY_OK    0x05 /**< channel: connection handle, value: sweep-to-notify latency in us (saturating) */
+#define ONION_EVLOG_NOTIFY_RETRY 0x06 /**< channel: connection handle, value: NimBLE rc; report stays queued */
+#define ONION_EVLOG_NOTIFY_FAIL  0x07 /**< channel: connection handle, value: NimBLE rc, 0 if lost while the host lagged */
+#define ONION_EVLOG_BOOT_STAGE   0x08 /**< channel: ONION_BOOT_*, value: stage-specific */
+
+/* --- Boot stages (channel of ONION_EVLOG_BOOT_STAGE), timestamps are time since boot --- */
+#define ONION_BOOT_SCAN_LIVE 1 /**< First sweep classified: pads are live */
+#define ONION_BOOT_BLE_SYNC  2 /**< NimBLE host synced with the controller, advertising starts */
+#define ONION_BOOT_LINK_UP   3 /**< First host subscribed; value: pre-link key states replayed */
+
+/**
+ * @brief One recorded event (8 bytes).
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp_us; /**< Low 32 bits of esp_timer time */
+    uint16_t value;        /**< Type-specific, see ONION_EVLOG_* */
+    uint8_t  channel;      /**< Pad index or connection handle */
+    uint8_t  type;         /**< ONION_EVLOG_* */
+} onion_evlog_entry_t;
+
+/**
+ * @brief Receives one event while a log is being walked.
+ */
+typedef void (*onion_evlog_visit_t)(const onion_evlog_entry_t *entry, void *ctx);
+
+/**
+ * @brief Saves the events that survived a crash reset to NVS, then starts a fresh log.
+ * @note Call after onion_config_init() (NVS must be initialized).
+ */
+void onion_evlog_init(void);
+
+/**
+ * @brief Appends an event. Lock-free and non-blocking; safe from any task or ISR.
+ */
+void onion_evlog_record(int64_t timestamp_us, uint8_t type, uint8_t channel, uint16_t value);
+
+/**
+ * @brief Walks the live log from the oldest to the newest event.
+ * * Events overwritten during the walk are skipped, not reported torn.
+ * @return Number of events visited.
+ */
+size_t onion_evlog_foreach(onion_evlog_visit_t visit, void *ctx);
+
+/**
+ * @brief Walks the log saved after the last crash reset.
+ * @return Number of events visited, or -1 if no crash log is stored.
+ */
+int onion_evlog_foreach_crash(onion_evlog_visit_t visit, void *ctx);
+
+#endif // ONION_EVLOG_H
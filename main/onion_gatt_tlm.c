@@ -0,0 +1,289 @@
+/**
+ * @file onion_gatt_tlm.c
+ * @brief Implementation of the BLE telemetry / configuration service.
+ */
+
+#include "onion_gatt_tlm.h"
+#include "onion_config.h"
+#include "onion_comms.h"
+#include "onion_telemetry.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "nimble/nimble_port.h"
+#include "string.h"
+
+static const char *TAG = "ONION_GATT_TLM";
+
+#define RING_MASK (ONION_GATT_TLM_RING_LEN - 1)
+/** @brief Stream packet header: [count, seq_lo, seq_hi]. */
+#define STREAM_HDR_LEN 3
+/** @brief Largest notification payload for ONION_GATT_TLM_MTU (ATT header excluded). */
+#define STREAM_PAYLOAD_MAX (ONION_GATT_TLM_MTU - 3)
+
+_Static_assert((ONION_GATT_TLM_RING_LEN & RING_MASK) == 0, "ONION_GATT_TLM_RING_LEN must be a power of two");
+
+uint16_t onion_gatt_tlm_stream_handle;
+uint16_t onion_gatt_tlm_cmd_handle;
+
+static uint16_t tlm_conn = BLE_HS_CONN_HANDLE_NONE;  /**< Host receiving the stream (the last to subscribe) */
+static bool stream_subscribed = false;
+static uint16_t cmd_subscribers[ONION_BLE_MAX_CONNS]; /**< Hosts with replies enabled, NONE when free */
+static uint16_t cmd_reply_conn = BLE_HS_CONN_HANDLE_NONE; /**< Command task: writer of the running command */
+
+/* --- Stream ring (sweep task -> NimBLE host task) --- */
+static onion_tlm_frame_t ring[ONION_GATT_TLM_RING_LEN];
+static uint32_t ring_head = 0;      /**< Producer owned */
+static uint32_t ring_tail = 0;      /**< Consumer owned */
+static int64_t last_publish_us = 0; /**< Producer side: timestamp of the last accepted sweep */
+static int64_t batch_start_us = 0;  /**< Producer side: timestamp of the oldest sweep of the open packet */
+static uint16_t stream_seq = 0;     /**< Consumer side: seq of the sweep at ring_tail */
+static struct ble_npl_event stream_ev;
+static uint32_t stream_drops = 0;
+static uint32_t stream_retries = 0;
+
+/* --- Command lines (NimBLE host task -> command task) --- */
+typedef struct {
+    uint16_t conn;  /**< Host that wrote the line; the replies go back to it */
+    char line[ONION_GATT_CMD_LINE_MAX];
+} gatt_cmd_t;
+
+static QueueHandle_t cmd_queue = NULL;
+static StaticQueue_t cmd_queue_buf;
+static uint8_t cmd_queue_storage[ONION_GATT_CMD_QUEUE_LEN * sizeof(gatt_cmd_t)];
+static StackType_t cmd_task_stack[ONION_GATT_CMD_STACK];
+static StaticTask_t cmd_task_buf;
+
+/**
+ * @brief Sweeps that fit into one notification at the negotiated MTU (0 below one sweep).
+ */
+static size_t stream_frames_per_packet(uint16_t conn) {
+    int mtu = ble_att_mtu(conn);
+    if (mtu > ONION_GATT_TLM_MTU) mtu = ONION_GATT_TLM_MTU;
+    if (mtu < 3 + STREAM_HDR_LEN) return 0;
+    return (size_t)(mtu - 3 - STREAM_HDR_LEN) / sizeof(onion_tlm_frame_t);
+}
+
+static bool stream_active(void) {
+    return __atomic_load_n(&stream_subscribed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Discards everything queued (consumer side).
+ */
+static void stream_flush(void) {
+    uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    stream_seq += (uint16_t)(head - ring_tail);
+    __atomic_store_n(&ring_tail, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief NimBLE event handler: packs queued sweeps into MTU-sized notifications.
+ * On mbuf or controller buffer exhaustion the sweeps stay queued and go out
+ * with the next packet; once the ring is full the producer drops new ones.
+ */
+static void stream_drain(struct ble_npl_event *ev) {
+    uint8_t pkt[STREAM_PAYLOAD_MAX];
+
+    size_t per_packet = stream_frames_per_packet(tlm_conn);
+    if (tlm_conn == BLE_HS_CONN_HANDLE_NONE || !stream_subscribed || per_packet == 0) {
+        stream_flush();
+        return;
+    }
+
+    while (1) {
+        uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        size_t n = head - ring_tail;
+        if (n == 0) return;
+        if (n > per_packet) n = per_packet;
+
+        pkt[0] = (uint8_t)n;
+        pkt[1] = (uint8_t)(stream_seq & 0xFF);
+        pkt[2] = (uint8_t)(stream_seq >> 8);
+        for (size_t i = 0; i < n; i++) {
+            memcpy(&pkt[STREAM_HDR_LEN + i * sizeof(onion_tlm_frame_t)],
+                   &ring[(ring_tail + i) & RING_MASK], sizeof(onion_tlm_frame_t));
+        }
+
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(pkt, STREAM_HDR_LEN + n * sizeof(onion_tlm_frame_t));
+        int rc = (om == NULL) ? BLE_HS_ENOMEM : ble_gatts_notify_custom(tlm_conn, onion_gatt_tlm_stream_handle, om);
+        if (rc == BLE_HS_ENOMEM || rc == BLE_HS_EBUSY) {
+            stream_retries++;
+            return;
+        }
+        if (rc != 0) {
+            ESP_LOGW(TAG, "Stream notify failed (rc=%d), %u sweeps dropped", rc, (unsigned)n);
+        }
+        stream_seq += (uint16_t)n;
+        __atomic_store_n(&ring_tail, ring_tail + (uint32_t)n, __ATOMIC_RELEASE);
+    }
+}
+
+void onion_gatt_tlm_publish(const onion_frame_t *frame) {
+    if (!stream_active()) return;
+
+    /* Decimate to ONION_GATT_TLM_PERIOD_MS; a quarter period of slack absorbs wake-up jitter */
+    const int64_t period_us = (int64_t)ONION_GATT_TLM_PERIOD_MS * 1000;
+    if (frame->timestamp_us - last_publish_us < period_us - period_us / 4) return;
+    last_publish_us = frame->timestamp_us;
+
+    uint32_t head = ring_head;
+    uint32_t queued = head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    if (queued >= ONION_GATT_TLM_RING_LEN) {
+        stream_drops++;
+        return;
+    }
+    if (queued == 0) batch_start_us = frame->timestamp_us;
+
+    onion_tlm_frame_t *slot = &ring[head & RING_MASK];
+    slot->timestamp_us = (uint32_t)frame->timestamp_us;
+    memcpy(slot->raw, frame->raw, sizeof(slot->raw));
+    slot->pressed_mask = frame->pressed_mask;
+    __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+    /* Wake the host once a packet is full, or once its oldest sweep has waited long enough */
+    size_t per_packet = stream_frames_per_packet(__atomic_load_n(&tlm_conn, __ATOMIC_ACQUIRE));
+    if (queued + 1 >= per_packet ||
+        frame->timestamp_us - batch_start_us >= (int64_t)ONION_GATT_TLM_BATCH_MS * 1000) {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &stream_ev);
+    }
+}
+
+/**
+ * @brief Reply sink for commands received over BLE: notifies the line on the command characteristic.
+ * @note Runs in the command task; lines longer than the MTU are split.
+ */
+static void gatt_tlm_reply(const char *line) {
+    uint16_t conn = cmd_reply_conn;
+    bool subscribed = false;
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (__atomic_load_n(&cmd_subscribers[i], __ATOMIC_ACQUIRE) == conn) subscribed = true;
+    }
+    if (!subscribed) return;
+
+    char buf[ONION_COMMS_REPLY_MAX + 1];
+    size_t len = strnlen(line, sizeof(buf) - 1);
+    memcpy(buf, line, len);
+    buf[len++] = '\n';
+
+    int mtu = ble_att_mtu(conn);
+    size_t chunk = (mtu > 3) ? (size_t)(mtu - 3) : 20;
+    for (size_t off = 0; off < len;) {
+        size_t n = (len - off < chunk) ? len - off : chunk;
+        int rc = BLE_HS_ENOMEM;
+        for (int attempt = 0; attempt < 5; attempt++) {
+            struct os_mbuf *om = ble_hs_mbuf_from_flat(buf + off, n);
+            rc = (om == NULL) ? BLE_HS_ENOMEM : ble_gatts_notify_custom(conn, onion_gatt_tlm_cmd_handle, om);
+            if (rc != BLE_HS_ENOMEM && rc != BLE_HS_EBUSY) break;
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        if (rc != 0) {
+            ESP_LOGW(TAG, "Reply notify failed (rc=%d)", rc);
+            return;
+        }
+        off += n;
+    }
+}
+
+/**
+ * FreeRTOS Task: gatt_cmd
+ * Runs command lines written over BLE through the serial command table, so
+ * slow commands (CAL, SETTLE, SAVE) never block the NimBLE host task.
+ */
+static void gatt_tlm_cmd_task(void *pvParameters) {
+    gatt_cmd_t cmd;
+
+    while (1) {
+        if (xQueueReceive(cmd_queue, &cmd, portMAX_DELAY) != pdTRUE) continue;
+        cmd_reply_conn = cmd.conn;
+        onion_comms_execute(cmd.line, gatt_tlm_reply);
+    }
+}
+
+int onion_gatt_tlm_access(uint16_t conn_handle, uint16_t attr_handle,
+                          struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (attr_handle != onion_gatt_tlm_cmd_handle || ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    gatt_cmd_t cmd = { .conn = conn_handle };
+    uint16_t len = 0;
+    if (OS_MBUF_PKTLEN(ctxt->om) >= sizeof(cmd.line)) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    if (ble_hs_mbuf_to_flat(ctxt->om, cmd.line, sizeof(cmd.line) - 1, &len) != 0) return BLE_ATT_ERR_UNLIKELY;
+
+    /* Accept the serial form too: strip a trailing terminator */
+    while (len > 0 && (cmd.line[len - 1] == '\n' || cmd.line[len - 1] == '\r')) len--;
+    cmd.line[len] = '\0';
+    if (len == 0) return 0;
+
+    if (xQueueSend(cmd_queue, &cmd, 0) != pdTRUE) return BLE_ATT_ERR_INSUFFICIENT_RES;
+    return 0;
+}
+
+void onion_gatt_tlm_on_connect(uint16_t conn_handle) {
+    /* Most centrals start the exchange themselves; asking covers the rest */
+    int rc = ble_gattc_exchange_mtu(conn_handle, NULL, NULL);
+    if (rc != 0 && rc != BLE_HS_EALREADY) {
+        ESP_LOGD(TAG, "MTU exchange not started (rc=%d)", rc);
+    }
+}
+
+/**
+ * @brief Adds or removes a host from the reply subscribers (host task).
+ */
+static void cmd_set_subscribed(uint16_t conn_handle, bool notify) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (cmd_subscribers[i] == conn_handle) {
+            if (!notify) __atomic_store_n(&cmd_subscribers[i], BLE_HS_CONN_HANDLE_NONE, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    for (int i = 0; notify && i < ONION_BLE_MAX_CONNS; i++) {
+        if (cmd_subscribers[i] == BLE_HS_CONN_HANDLE_NONE) {
+            __atomic_store_n(&cmd_subscribers[i], conn_handle, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+void onion_gatt_tlm_on_disconnect(uint16_t conn_handle) {
+    cmd_set_subscribed(conn_handle, false);
+    if (conn_handle != tlm_conn) return;
+
+    __atomic_store_n(&stream_subscribed, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&tlm_conn, BLE_HS_CONN_HANDLE_NONE, __ATOMIC_RELEASE);
+    stream_flush();
+}
+
+void onion_gatt_tlm_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
+    if (attr_handle == onion_gatt_tlm_stream_handle) {
+        /* One stream: it follows the host that subscribed last */
+        if (!notify && conn_handle != tlm_conn) return;
+        ESP_LOGI(TAG, "Stream %s by %u", notify ? "subscribed" : "unsubscribed", conn_handle);
+        __atomic_store_n(&stream_subscribed, false, __ATOMIC_RELEASE);
+        stream_flush();
+        __atomic_store_n(&tlm_conn, notify ? conn_handle : BLE_HS_CONN_HANDLE_NONE, __ATOMIC_RELEASE);
+        __atomic_store_n(&stream_subscribed, notify, __ATOMIC_RELEASE);
+    } else if (attr_handle == onion_gatt_tlm_cmd_handle) {
+        cmd_set_subscribed(conn_handle, notify);
+    }
+}
+
+void onion_gatt_tlm_get_stats(uint32_t *dropped, uint32_t *retried) {
+    *dropped = stream_drops;
+    *retried = stream_retries;
+}
+
+int onion_gatt_tlm_init(void) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        cmd_subscribers[i] = BLE_HS_CONN_HANDLE_NONE;
+    }
+    ble_npl_event_init(&stream_ev, stream_drain, NULL);
+    ble_att_set_preferred_mtu(ONION_GATT_TLM_MTU);
+
+    cmd_queue = xQueueCreateStatic(ONION_GATT_CMD_QUEUE_LEN, sizeof(gatt_cmd_t), cmd_queue_storage, &cmd_queue_buf);
+    xTaskCreateStatic(gatt_tlm_cmd_task, "gatt_cmd", ONION_GATT_CMD_STACK, NULL, 5, cmd_task_stack, &cmd_task_buf);
+    return ESP_OK;
+}
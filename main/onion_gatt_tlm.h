@@ -0,0 +1,68 @@
+/**
+ * @file onion_gatt_tlm.h
+ * @brief Custom GATT service: raw sweep stream and configuration commands over BLE.
+ *
+ * Offers the same functionality as the serial link without a cable. The
+ * service (UUID b3f10001-7a2e-4c1d-9e0b-6f6e696f6e00) carries two
+ * characteristics:
+ * - Stream (...0002, notify): packets of [count, seq_lo, seq_hi] followed by
+ *   count onion_tlm_frame_t sweeps. seq counts sent sweeps, so the host
+ *   detects lost packets. Each packet carries as many sweeps as the negotiated MTU
+ *   fits; streaming runs while a host is subscribed, at up to 100 Hz. With
+ *   several hosts connected the stream goes to the one that subscribed last.
+ * - Command (...0003, encrypted write / notify): one write carries one
+ *   command line of the serial protocol ("SET:...", "CAL", ...). Replies are
+ *   notified to the writing host on the same characteristic as '\n'-terminated lines, split
+ *   across notifications when longer than the MTU.
+ */
+
+#ifndef ONION_GATT_TLM_H
+#define ONION_GATT_TLM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host/ble_hs.h"
+#include "onion_touch.h"
+
+/** @brief 128-bit UUID of the service family; id selects service (0x0001) or characteristic. */
+#define ONION_GATT_UUID(id) BLE_UUID128_DECLARE(0x00, 0x6e, 0x6f, 0x69, 0x6e, 0x6f, 0x0b, 0x9e, \
+                                                0x1d, 0x4c, 0x2e, 0x7a, (id) & 0xFF, (id) >> 8, 0xf1, 0xb3)
+#define ONION_GATT_TLM_SVC_UUID    ONION_GATT_UUID(0x0001)
+#define ONION_GATT_TLM_STREAM_UUID ONION_GATT_UUID(0x0002)
+#define ONION_GATT_TLM_CMD_UUID    ONION_GATT_UUID(0x0003)
+
+/** @brief Value handles, filled in when the service is registered. */
+extern uint16_t onion_gatt_tlm_stream_handle;
+extern uint16_t onion_gatt_tlm_cmd_handle;
+
+/**
+ * @brief Creates the stream event, the command queue and the command task.
+ * @note Call before the NimBLE host task starts.
+ * @return ESP_OK on success, or ESP_ERR_NO_MEM.
+ */
+int onion_gatt_tlm_init(void);
+
+/**
+ * @brief GATT access callback for both characteristics (NimBLE host task).
+ */
+int onion_gatt_tlm_access(uint16_t conn_handle, uint16_t attr_handle,
+                          struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+/** @brief GAP hooks (NimBLE host task). */
+void onion_gatt_tlm_on_connect(uint16_t conn_handle);
+void onion_gatt_tlm_on_disconnect(uint16_t conn_handle);
+void onion_gatt_tlm_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+
+/**
+ * @brief Hands a sweep to the stream (sweep task, non-blocking).
+ * @note Does nothing unless a host is subscribed; sweeps closer together than
+ * ONION_GATT_TLM_PERIOD_MS are skipped.
+ */
+void onion_gatt_tlm_publish(const onion_frame_t *frame);
+
+/**
+ * @brief Sweeps dropped because the stream ring was full, and packets retried on mbuf or buffer exhaustion.
+ */
+void onion_gatt_tlm_get_stats(uint32_t *dropped, uint32_t *retried);
+
+#endif // ONION_GATT_TLM_H
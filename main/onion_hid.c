@@ -0,0 +1,93 @@
+/**
+ * @file onion_hid.c
+ * @brief Implementation of the 6KRO/NKRO keyboard report builder.
+ */
+
+#include "onion_hid.h"
+#include "string.h"
+
+/**
+ * @brief Adds one usage to a report under construction.
+ * @param slot Next free 6KRO slot, advanced when the usage takes one.
+ * @return false if the 6KRO report overflowed.
+ */
+static bool hid_add_usage(onion_hid_report_t *out, int *slot, uint8_t keycode) {
+    /* 0x00 is no key; codes above the modifier range are engine action codes (onion_action.h) */
+    if (keycode == 0x00 || keycode > ONION_HID_MOD_LAST) return true;
+
+    /* Modifier usages are bit-mapped in the first byte of both reports */
+    if (keycode >= ONION_HID_MOD_FIRST) {
+        out->kb.modifiers |= (uint8_t)(1u << (keycode - ONION_HID_MOD_FIRST));
+        return true;
+    }
+
+    if (keycode <= ONION_HID_NKRO_MAX_USAGE) {
+        uint8_t bit = (uint8_t)(1u << (keycode & 0x07));
+        if (out->nkro.bitmap[keycode >> 3] & bit) return true; /* Already reported by another pad */
+        out->nkro.bitmap[keycode >> 3] |= bit;
+    } else {
+        for (int i = 0; i < *slot; i++) {
+            if (out->kb.keys[i] == keycode) return true;
+        }
+    }
+
+    if (*slot >= ONION_HID_KEY_SLOTS) return false;
+    out->kb.keys[(*slot)++] = keycode;
+    return true;
+}
+
+/**
+ * @brief Finishes a report: ErrorRollOver on overflow, modifiers mirrored into the NKRO report.
+ */
+static void hid_finish(onion_hid_report_t *out, bool rollover) {
+    if (rollover) {
+        memset(out->kb.keys, ONION_HID_ERR_ROLLOVER, sizeof(out->kb.keys));
+    }
+    out->nkro.modifiers = out->kb.modifiers;
+}
+
+void onion_hid_build_report(onion_mask_t pressed_mask, const onion_key_t *lut, onion_hid_report_t *out) {
+    int slot = 0;
+    bool rollover = false;
+
+    memset(out, 0, sizeof(*out));
+
+    for (int ch = 0; pressed_mask != 0; ch++, pressed_mask >>= 1) {
+        if (!(pressed_mask & 0x01)) continue;
+        if (!hid_add_usage(out, &slot, lut[ch].keycode)) rollover = true;
+    }
+    hid_finish(out, rollover);
+}
+
+void onion_hid_build_usages(const uint8_t *usages, size_t count, onion_hid_report_t *out) {
+    int slot = 0;
+    bool rollover = false;
+
+    memset(out, 0, sizeof(*out));
+
+    for (size_t i = 0; i < count; i++) {
+        if (!hid_add_usage(out, &slot, usages[i])) rollover = true;
+    }
+    hid_finish(out, rollover);
+}
+
+bool onion_hid_report_equal(const onion_hid_report_t *a, const onion_hid_report_t *b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+bool onion_hid_report_is_transient(const onion_hid_report_t *sent, const onion_hid_report_t *mid,
+                                   const onion_hid_report_t *next) {
+    /* Usages beyond the bitmap can't be tracked per key; only merge exact repeats */
+    for (int i = 0; i < ONION_HID_KEY_SLOTS; i++) {
+        if (mid->kb.keys[i] > ONION_HID_NKRO_MAX_USAGE) return onion_hid_report_equal(mid, next);
+    }
+
+    /* A bit is lost if it flips in mid and flips back in next */
+    uint8_t lost = (uint8_t)(~(sent->nkro.modifiers ^ next->nkro.modifiers) &
+                             (sent->nkro.modifiers ^ mid->nkro.modifiers));
+    for (int i = 0; i < ONION_HID_NKRO_BYTES; i++) {
+        lost |= (uint8_t)(~(sent->nkro.bitmap[i] ^ next->nkro.bitmap[i]) &
+                          (sent->nkro.bitmap[i] ^ mid->nkro.bitmap[i]));
+    }
+    return lost == 0;
+}
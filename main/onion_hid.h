@@ -0,0 +1,102 @@
+/**
+ * @file onion_hid.h
+ * @brief HID keyboard report construction from the pressed-pad mask.
+ *
+ * Pure logic with no hardware or BLE dependencies: the whole pressed mask is
+ * turned into a single report per sweep, so chords stay chords on the host.
+ */
+
+#ifndef ONION_HID_H
+#define ONION_HID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "onion_config.h"
+
+#define ONION_HID_REPORT_ID_KEYBOARD 0x01
+#define ONION_HID_REPORT_ID_NKRO     0x02
+
+/** @brief Number of key slots in the 6KRO (boot-compatible) report. */
+#define ONION_HID_KEY_SLOTS   6
+/** @brief Highest usage covered by the NKRO bitmap (Keyboard Application). */
+#define ONION_HID_NKRO_MAX_USAGE 0x67
+/** @brief Size of the NKRO usage bitmap in bytes. */
+#define ONION_HID_NKRO_BYTES  ((ONION_HID_NKRO_MAX_USAGE + 8) / 8)
+
+/** @brief First/last HID usage of the modifier range (Left Control .. Right GUI). */
+#define ONION_HID_MOD_FIRST   0xE0
+#define ONION_HID_MOD_LAST    0xE7
+
+/** @brief Usage reported in every slot when more than six keys are held. */
+#define ONION_HID_ERR_ROLLOVER 0x01
+
+/**
+ * @brief 8-byte keyboard input report (Report ID 1).
+ * Format: [modifiers, reserved, key1, key2, key3, key4, key5, key6]
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t modifiers;
+    uint8_t reserved;
+    uint8_t keys[ONION_HID_KEY_SLOTS];
+} onion_hid_kb_report_t;
+
+/**
+ * @brief NKRO input report (Report ID 2): modifiers followed by a usage bitmap.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t modifiers;
+    uint8_t bitmap[ONION_HID_NKRO_BYTES];
+} onion_hid_nkro_report_t;
+
+/**
+ * @brief Complete keyboard state for one sweep, in both report encodings.
+ */
+typedef struct {
+    onion_hid_kb_report_t   kb;
+    onion_hid_nkro_report_t nkro;
+} onion_hid_report_t;
+
+/**
+ * @brief Builds the keyboard state for every pad set in pressed_mask.
+ *
+ * Keycodes 0xE0-0xE7 become modifier bits, 0x00 and action codes above 0xE7
+ * are ignored and duplicate keycodes occupy one slot. If more than six keys are held, the 6KRO report
+ * signals ErrorRollOver while the NKRO bitmap still carries every key.
+ *
+ * @param pressed_mask Bit n set while pad n is touched.
+ * @param lut Pad-to-keycode table with MUX_CHANNELS_COUNT entries.
+ * @param out Output report.
+ */
+void onion_hid_build_report(onion_mask_t pressed_mask, const onion_key_t *lut, onion_hid_report_t *out);
+
+/**
+ * @brief Builds the keyboard state holding the given usages (same rules as onion_hid_build_report()).
+ * @param usages HID usages; 0x00 entries are skipped.
+ * @param count Number of entries in usages.
+ * @param out Output report.
+ */
+void onion_hid_build_usages(const uint8_t *usages, size_t count, onion_hid_report_t *out);
+
+/**
+ * @brief Compares two keyboard states.
+ * @return true if both would produce identical reports.
+ */
+bool onion_hid_report_equal(const onion_hid_report_t *a, const onion_hid_report_t *b);
+
+/**
+ * @brief Checks whether an intermediate state can be skipped without losing an edge.
+ *
+ * mid is transient if no key goes sent -> mid -> next and back again, i.e. every
+ * press or release in mid survives into next. Skipping it then changes the
+ * timing of a chord but never drops a tap or a key-up.
+ *
+ * @param sent Last state delivered to the host.
+ * @param mid Candidate state to skip.
+ * @param next State queued after mid.
+ * @return true if mid can be merged into next.
+ */
+bool onion_hid_report_is_transient(const onion_hid_report_t *sent, const onion_hid_report_t *mid,
+                                   const onion_hid_report_t *next);
+
+#endif // ONION_HID_H
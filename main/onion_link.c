@@ -0,0 +1,213 @@
+/**
+ * @file onion_link.c
+ * @brief Implementation of the connection-parameter policy.
+ */
+
+#include "onion_link.h"
+#include "onion_config.h"
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+
+static const char *TAG = "ONION_LINK";
+
+/**
+ * @brief Policy state of one connection (host task).
+ */
+typedef struct {
+    uint16_t conn;                /**< BLE_HS_CONN_HANDLE_NONE while the slot is free */
+    bool encrypted;
+    bool active_fallback;         /**< Host rejected the fastest interval range */
+    onion_link_params_t params;
+} link_t;
+
+static link_t links[ONION_BLE_MAX_CONNS];
+static controller_state_t link_state = STATE_ACTIVE;
+static bool link_changed = false;
+static struct ble_npl_event state_ev;
+
+/**
+ * @brief Finds the slot of a connection (NULL if unknown).
+ */
+static link_t *link_find(uint16_t conn_handle) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (links[i].conn == conn_handle) return &links[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the parameters the controller actually applied.
+ */
+static void link_refresh_params(link_t *link) {
+    struct ble_gap_conn_desc desc;
+
+    if (ble_gap_conn_find(link->conn, &desc) != 0) return;
+    link->params.interval = desc.conn_itvl;
+    link->params.latency = desc.conn_latency;
+    link->params.timeout = desc.supervision_timeout;
+    __atomic_store_n(&link_changed, true, __ATOMIC_RELEASE);
+
+    ESP_LOGI(TAG, "Link %u params: interval %u.%02u ms, latency %u, timeout %u ms", link->conn,
+             (desc.conn_itvl * 125) / 100, (desc.conn_itvl * 125) % 100,
+             desc.conn_latency, desc.supervision_timeout * 10);
+}
+
+/**
+ * @brief Asks for the 2M PHY and the longest LL data length (host task).
+ * A refusal only costs throughput: the link keeps 1M / 27 bytes.
+ */
+static void link_request_radio(const link_t *link) {
+    int rc;
+
+#if ONION_LINK_PREFER_2M_PHY
+    rc = ble_gap_set_prefered_le_phy(link->conn, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc != 0) {
+        ESP_LOGI(TAG, "2M PHY not available (rc=%d), staying on 1M", rc);
+    }
+#endif
+    rc = ble_gap_set_data_len(link->conn, ONION_LINK_DATA_LEN_OCTETS, ONION_LINK_DATA_LEN_TIME);
+    if (rc != 0) {
+        ESP_LOGI(TAG, "Data length extension not available (rc=%d)", rc);
+    }
+}
+
+/**
+ * @brief Starts a parameter update matching link_state (host task).
+ */
+static void link_request_params(link_t *link) {
+    if (link->conn == BLE_HS_CONN_HANDLE_NONE || !link->encrypted) return;
+
+    struct ble_gap_upd_params params = {
+        .supervision_timeout = ONION_CONN_SUPERVISION_TIMEOUT,
+    };
+    if (link_state == STATE_ACTIVE) {
+        params.itvl_min = ONION_CONN_ACTIVE_ITVL_MIN;
+        params.itvl_max = link->active_fallback ? ONION_CONN_ACTIVE_ITVL_FALLBACK : ONION_CONN_ACTIVE_ITVL_MAX;
+        params.latency = ONION_CONN_ACTIVE_LATENCY;
+    } else {
+        params.itvl_min = ONION_CONN_STANDBY_ITVL_MIN;
+        params.itvl_max = ONION_CONN_STANDBY_ITVL_MAX;
+        params.latency = ONION_CONN_STANDBY_LATENCY;
+    }
+
+    /* Skip the procedure if the link already satisfies the request */
+    if (link->params.interval >= params.itvl_min && link->params.interval <= params.itvl_max &&
+        link->params.latency == params.latency) {
+        return;
+    }
+
+    int rc = ble_gap_update_params(link->conn, &params);
+    if (rc != 0 && rc != BLE_HS_EALREADY) {
+        ESP_LOGW(TAG, "Connection update request on %u failed (rc=%d)", link->conn, rc);
+    }
+}
+
+/**
+ * @brief NimBLE event handler for state changes posted from other tasks.
+ */
+static void link_state_event(struct ble_npl_event *ev) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        link_request_params(&links[i]);
+    }
+}
+
+void onion_link_init(void) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        links[i].conn = BLE_HS_CONN_HANDLE_NONE;
+    }
+    ble_npl_event_init(&state_ev, link_state_event, NULL);
+}
+
+void onion_link_on_connect(uint16_t conn_handle) {
+    link_t *link = link_find(BLE_HS_CONN_HANDLE_NONE);
+    if (link == NULL) return;
+
+    link->conn = conn_handle;
+    link->encrypted = false;
+    link->active_fallback = false;
+    link->params = (onion_link_params_t){
+        .tx_phy = BLE_GAP_LE_PHY_1M,
+        .rx_phy = BLE_GAP_LE_PHY_1M,
+        .tx_octets = 27,
+        .rx_octets = 27,
+    };
+    link_refresh_params(link);
+    link_request_radio(link);
+}
+
+void onion_link_on_encrypted(uint16_t conn_handle) {
+    link_t *link = link_find(conn_handle);
+    if (link == NULL) return;
+    link->encrypted = true;
+    link_request_params(link);
+}
+
+void onion_link_on_disconnect(uint16_t conn_handle) {
+    link_t *link = link_find(conn_handle);
+    if (link == NULL) return;
+    link->conn = BLE_HS_CONN_HANDLE_NONE;
+    link->encrypted = false;
+    link->params = (onion_link_params_t){0};
+    __atomic_store_n(&link_changed, true, __ATOMIC_RELEASE);
+}
+
+void onion_link_on_conn_update(uint16_t conn_handle, int status) {
+    link_t *link = link_find(conn_handle);
+    if (link == NULL) return;
+
+    if (status != 0) {
+        ESP_LOGW(TAG, "Host %u rejected connection parameters (status=%d)", conn_handle, status);
+        if (link_state == STATE_ACTIVE && !link->active_fallback) {
+            /* Widen the acceptable range once instead of staying on the host default */
+            link->active_fallback = true;
+            link_request_params(link);
+        }
+        return;
+    }
+    link_refresh_params(link);
+}
+
+void onion_link_on_phy_update(uint16_t conn_handle, int status, uint8_t tx_phy, uint8_t rx_phy) {
+    link_t *link = link_find(conn_handle);
+    if (link == NULL) return;
+
+    if (status != 0) {
+        ESP_LOGW(TAG, "PHY update rejected (status=%d), staying on %uM", status, link->params.tx_phy);
+        return;
+    }
+    link->params.tx_phy = tx_phy;
+    link->params.rx_phy = rx_phy;
+    __atomic_store_n(&link_changed, true, __ATOMIC_RELEASE);
+    ESP_LOGI(TAG, "Link %u PHY: tx %u, rx %u", conn_handle, tx_phy, rx_phy);
+}
+
+void onion_link_on_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t rx_octets) {
+    link_t *link = link_find(conn_handle);
+    if (link == NULL) return;
+
+    link->params.tx_octets = tx_octets;
+    link->params.rx_octets = rx_octets;
+    __atomic_store_n(&link_changed, true, __ATOMIC_RELEASE);
+    ESP_LOGI(TAG, "Link %u data length: tx %u, rx %u octets", conn_handle, tx_octets, rx_octets);
+}
+
+void onion_link_set_state(controller_state_t state) {
+    if (state == link_state) return;
+    link_state = state;
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &state_ev);
+}
+
+bool onion_link_get_params(onion_link_params_t *out) {
+    for (int i = 0; i < ONION_BLE_MAX_CONNS; i++) {
+        if (links[i].conn == BLE_HS_CONN_HANDLE_NONE) continue;
+        *out = links[i].params;
+        return true;
+    }
+    return false;
+}
+
+bool onion_link_take_changed(void) {
+    return __atomic_exchange_n(&link_changed, false, __ATOMIC_ACQ_REL);
+}
@@ -0,0 +1,89 @@
+/**
+ * @file onion_link.h
+ * @brief BLE connection-parameter policy driven by the controller power state.
+ *
+ * While STATE_ACTIVE the link asks for the shortest connection interval and
+ * zero slave latency; in STATE_STANDBY it moves to a long interval with slave
+ * latency so the radio can sleep through idle connection events. Every
+ * connected host is managed separately.
+ *
+ * Right after connecting the link also asks for the 2M PHY and the maximum
+ * LL data length, so a notification burst needs fewer and shorter packets.
+ * Either request may be refused by the host or the controller; the link
+ * then keeps the 1M PHY / 27-byte PDUs. What was negotiated is reported
+ * with the connection parameters.
+ */
+
+#ifndef ONION_LINK_H
+#define ONION_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "onion_config.h"
+
+/**
+ * @brief Connection parameters currently in effect on the link.
+ */
+typedef struct {
+    uint16_t interval;   /**< Connection interval in 1.25 ms units */
+    uint16_t latency;    /**< Slave latency in connection events */
+    uint16_t timeout;    /**< Supervision timeout in 10 ms units */
+    uint8_t  tx_phy;     /**< BLE_GAP_LE_PHY_1M / _2M / _CODED */
+    uint8_t  rx_phy;
+    uint16_t tx_octets;  /**< Largest LL payload per PDU, each direction */
+    uint16_t rx_octets;
+} onion_link_params_t;
+
+/**
+ * @brief Prepares the policy module. Call once before the NimBLE host starts.
+ */
+void onion_link_init(void);
+
+/**
+ * @brief GAP hook: a connection was established (host task).
+ */
+void onion_link_on_connect(uint16_t conn_handle);
+
+/**
+ * @brief GAP hook: the link became encrypted; the preferred parameters are requested now (host task).
+ */
+void onion_link_on_encrypted(uint16_t conn_handle);
+
+/**
+ * @brief GAP hook: the connection was closed (host task).
+ */
+void onion_link_on_disconnect(uint16_t conn_handle);
+
+/**
+ * @brief GAP hook: result of a connection-parameter update procedure (host task).
+ * @param status 0 if the update completed, a NimBLE error code if it was rejected.
+ */
+void onion_link_on_conn_update(uint16_t conn_handle, int status);
+
+/**
+ * @brief GAP hook: result of a PHY update procedure (host task).
+ */
+void onion_link_on_phy_update(uint16_t conn_handle, int status, uint8_t tx_phy, uint8_t rx_phy);
+
+/**
+ * @brief GAP hook: the LL data length changed (host task).
+ */
+void onion_link_on_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t rx_octets);
+
+/**
+ * @brief Selects the parameter set for the given power state. Safe from any task.
+ */
+void onion_link_set_state(controller_state_t state);
+
+/**
+ * @brief Reads the parameters negotiated with the first host in the connection table.
+ * @return false if no host is connected.
+ */
+bool onion_link_get_params(onion_link_params_t *out);
+
+/**
+ * @brief Returns true once after every change of the negotiated parameters.
+ */
+bool onion_link_take_changed(void);
+
+#endif // ONION_LINK_H
@@ -0,0 +1,97 @@
+/**
+ * @file onion_pipeline.c
+ * @brief Pure detection kernels (baseline estimator, debounce integrator) and the per-sweep step.
+ * @note No ESP-IDF or FreeRTOS dependencies: this file also builds with ONION_HOST_BUILD.
+ */
+
+#include "onion_pipeline.h"
+#include "string.h"
+
+onion_mask_t onion_baseline_classify(onion_baseline_t *b, const uint16_t raw[MUX_CHANNELS_COUNT],
+                                     onion_mask_t prev_mask, const onion_key_t *lut, int64_t now_us) {
+    const uint32_t now_ms = (uint32_t)(now_us / 1000);
+
+    if (!b->valid) {
+        for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+            b->q[ch] = (uint32_t)raw[ch] << ONION_BASELINE_FRAC_BITS;
+        }
+        b->valid = true;
+    }
+
+    onion_mask_t mask = 0;
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        const onion_mask_t bit = ONION_MASK_BIT(ch);
+        const uint32_t x = (uint32_t)raw[ch] << ONION_BASELINE_FRAC_BITS;
+        const uint16_t delta = lut[ch].delta;
+
+        if (ONION_BASELINE_IS_ABSOLUTE(delta)) {
+            /* Absolute mode: fixed threshold from SET with no baseline */
+            if (raw[ch] < lut[ch].threshold) mask |= bit;
+            continue;
+        }
+
+        const int32_t depth = (int32_t)(b->q[ch] >> ONION_BASELINE_FRAC_BITS) - (int32_t)raw[ch];
+        const int32_t release = (int32_t)delta - (int32_t)(delta >> ONION_TOUCH_HYSTERESIS_SHIFT);
+        const bool pressed = (prev_mask & bit) ? (depth >= release) : (depth >= (int32_t)delta);
+
+        if (pressed && !(b->held_mask & bit)) {
+            b->held_mask |= bit;
+            b->held_since_ms[ch] = now_ms;
+        }
+        if (pressed && now_ms - b->held_since_ms[ch] >= ONION_BASELINE_STUCK_MS) {
+            /* Held longer than any real touch: the untouched level moved, adopt it */
+            b->q[ch] = x;
+            b->held_mask &= ~bit;
+        } else if (pressed) {
+            mask |= bit;
+        } else {
+            b->held_mask &= ~bit;
+            if (x >= b->q[ch]) {
+                b->q[ch] += (x - b->q[ch]) >> ONION_BASELINE_RISE_SHIFT;
+            } else if (depth < (int32_t)(delta >> 1)) {
+                /* Only drift down on readings clearly outside the touch band */
+                b->q[ch] -= (b->q[ch] - x) >> ONION_BASELINE_FALL_SHIFT;
+            }
+        }
+    }
+    return mask;
+}
+
+onion_mask_t onion_debounce_filter(onion_debounce_t *d, onion_mask_t detect_mask, const onion_key_t *lut) {
+    onion_mask_t diff = detect_mask ^ d->stable_mask;
+
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        const onion_mask_t bit = ONION_MASK_BIT(ch);
+
+        if (!(diff & bit)) {
+            if (d->pending[ch] > 0) {
+                /* Candidate transition reverted before it was accepted */
+                __atomic_store_n(&d->bounces[ch], d->bounces[ch] + 1, __ATOMIC_RELAXED);
+                d->pending[ch] = 0;
+            }
+            continue;
+        }
+
+        uint8_t need = (detect_mask & bit) ? lut[ch].press_debounce : lut[ch].release_debounce;
+        if (++d->pending[ch] >= need) {
+            d->stable_mask ^= bit;
+            d->pending[ch] = 0;
+        }
+    }
+    return d->stable_mask;
+}
+
+void onion_pipeline_init(onion_pipeline_t *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+bool onion_pipeline_step(onion_pipeline_t *p, const uint16_t raw[MUX_CHANNELS_COUNT],
+                         const onion_key_t *lut, int64_t now_us, onion_hid_report_t *report) {
+    p->detect_mask = onion_baseline_classify(&p->baseline, raw, p->detect_mask, lut, now_us);
+    onion_mask_t mask = onion_debounce_filter(&p->debounce, p->detect_mask, lut);
+
+    if (mask == p->pressed_mask) return false;
+    p->pressed_mask = mask;
+    if (report) onion_hid_build_report(mask, lut, report);
+    return true;
+}
@@ -0,0 +1,52 @@
+/**
+ * @file onion_pipeline.h
+ * @brief Hardware-free per-sweep logic: detection, debounce and HID report building.
+ *
+ * This is the seam between the platform and the logic. The firmware feeds it
+ * sweeps from the scan engine (onion_touch_sweep()) and hands the reports to
+ * NimBLE; everything behind this header depends only on the C library and
+ * onion_config.h, so the same sources build on a PC with -DONION_HOST_BUILD.
+ *
+ * host/ builds them that way together with onion_replay, which replays
+ * recorded "RAW:" lines through onion_pipeline_step() and the action engine
+ * and checks the emitted reports against host/captures/ (run by ctest).
+ */
+
+#ifndef ONION_PIPELINE_H
+#define ONION_PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "onion_config.h"
+#include "onion_baseline.h"
+#include "onion_debounce.h"
+#include "onion_hid.h"
+
+/**
+ * @brief Complete per-channel filter state of one pipeline instance.
+ */
+typedef struct {
+    onion_baseline_t baseline;
+    onion_debounce_t debounce;
+    onion_mask_t detect_mask;/**< Undebounced detector output of the previous sweep */
+    onion_mask_t pressed_mask;/**< Debounced output of the previous sweep */
+} onion_pipeline_t;
+
+/**
+ * @brief Resets an instance: baselines unseeded, every channel released.
+ */
+void onion_pipeline_init(onion_pipeline_t *p);
+
+/**
+ * @brief Runs one sweep through detection and debounce; builds a report on change.
+ * @param p Pipeline instance.
+ * @param raw Raw value per channel.
+ * @param lut Configuration table.
+ * @param now_us Time of the sweep (timestamp_us of the frame).
+ * @param report Keyboard state, written only when the function returns true (may be NULL).
+ * @return true if the debounced pressed mask changed.
+ */
+bool onion_pipeline_step(onion_pipeline_t *p, const uint16_t raw[MUX_CHANNELS_COUNT],
+                         const onion_key_t *lut, int64_t now_us, onion_hid_report_t *report);
+
+#endif // ONION_PIPELINE_H
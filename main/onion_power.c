@@ -0,0 +1,99 @@
+/**
+ * @file onion_power.c
+ * @brief Implementation of the controller power state machine.
+ */
+
+#include "onion_power.h"
+#include "onion_config.h"
+#include "onion_scan.h"
+#include "onion_link.h"
+#include "onion_ble.h"
+#include "onion_storage.h"
+#include "esp_pm.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "ONION_POWER";
+
+static controller_state_t power_state = STATE_ACTIVE;
+static int64_t last_activity_us = 0;
+static esp_pm_lock_handle_t sweep_lock = NULL;
+
+int onion_power_init(void) {
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Automatic light sleep unavailable (%s)", esp_err_to_name(err));
+    }
+
+    /* Held only while a sweep is captured and classified */
+    err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "onion_sweep", &sweep_lock);
+    if (err != ESP_OK) return err;
+#else
+    ESP_LOGW(TAG, "CONFIG_PM_ENABLE is off; standby only slows the scan rate.");
+#endif
+    return ESP_OK;
+}
+
+void onion_power_sweep_begin(void) {
+    if (sweep_lock) esp_pm_lock_acquire(sweep_lock);
+    if (power_state == STATE_STANDBY) {
+        onion_scan_start();
+    }
+}
+
+void onion_power_sweep_end(void) {
+    if (power_state == STATE_STANDBY) {
+        onion_scan_stop();
+    }
+    if (sweep_lock) esp_pm_lock_release(sweep_lock);
+}
+
+/**
+ * @brief Applies everything that depends on the controller state.
+ */
+static void power_enter(controller_state_t state) {
+    power_state = state;
+
+    if (state == STATE_ACTIVE) {
+        onion_scan_set_averaging(ONION_ACTIVE_AVG_SAMPLES);
+        onion_scan_start(); /* Free-running from now on */
+    } else {
+        onion_scan_stop();  /* Only runs inside onion_power_sweep_begin/end */
+        /* Nobody is touching pads: commit pending changes now, in the flush task,
+         * so a flash write or erase never delays the next standby sweep */
+        onion_config_flush_soon();
+        onion_scan_set_averaging(ONION_STANDBY_AVG_SAMPLES);
+    }
+    onion_link_set_state(state);
+    onion_ble_set_adv_state(state);
+
+    ESP_LOGI(TAG, "Entering %s", state == STATE_ACTIVE ? "STATE_ACTIVE" : "STATE_STANDBY");
+}
+
+controller_state_t onion_power_update(const onion_frame_t *frame) {
+    /* The undebounced mask wakes on the first standby sweep that sees a touch; the
+     * debounced one would take press_debounce standby periods */
+    if (frame->detect_mask != 0 || frame->pressed_mask != 0 || frame->changed_mask != 0) {
+        last_activity_us = frame->timestamp_us;
+        if (power_state != STATE_ACTIVE) power_enter(STATE_ACTIVE);
+    } else if (power_state == STATE_ACTIVE &&
+               (frame->timestamp_us - last_activity_us) > (int64_t)ONION_STANDBY_TIMEOUT_MS * 1000) {
+        power_enter(STATE_STANDBY);
+    }
+    return power_state;
+}
+
+controller_state_t onion_power_get_state(void) {
+    return power_state;
+}
+
+uint32_t onion_power_get_scan_period_ms(void) {
+    return (power_state == STATE_ACTIVE) ? ONION_ACTIVE_SCAN_PERIOD_MS : ONION_STANDBY_SCAN_PERIOD_MS;
+}
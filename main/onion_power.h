@@ -0,0 +1,52 @@
+/**
+ * @file onion_power.h
+ * @brief STATE_STANDBY / STATE_ACTIVE power manager.
+ *
+ * The controller state decides the scan rate, the ADC averaging depth, the
+ * BLE connection parameters and the advertising interval. In STATE_STANDBY the
+ * scan engine only runs for the duration of a sweep, so between sweeps no PM
+ * lock is held and ESP-IDF automatic light sleep can power the chip down.
+ */
+
+#ifndef ONION_POWER_H
+#define ONION_POWER_H
+
+#include <stdint.h>
+#include "onion_config.h"
+#include "onion_touch.h"
+
+/**
+ * @brief Configures dynamic frequency scaling / automatic light sleep and the sweep PM lock.
+ * @note Must be called before onion_touch_init().
+ * @return ESP_OK on success; PM being disabled in sdkconfig is not an error.
+ */
+int onion_power_init(void);
+
+/**
+ * @brief Prepares the hardware for one sweep (holds the PM lock, starts the ADC in standby).
+ */
+void onion_power_sweep_begin(void);
+
+/**
+ * @brief Ends a sweep (stops the ADC in standby, releases the PM lock).
+ */
+void onion_power_sweep_end(void);
+
+/**
+ * @brief Feeds a classified frame into the state machine and applies state changes.
+ * @param frame The sweep that was just processed.
+ * @return The state in effect for the next sweep.
+ */
+controller_state_t onion_power_update(const onion_frame_t *frame);
+
+/**
+ * @brief Returns the current controller state.
+ */
+controller_state_t onion_power_get_state(void);
+
+/**
+ * @brief Delay between sweeps in the current state, in milliseconds.
+ */
+uint32_t onion_power_get_scan_period_ms(void);
+
+#endif // ONION_POWER_H
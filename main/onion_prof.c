@@ -0,0 +1,93 @@
+/**
+ * @file onion_prof.c
+ * @brief Implementation of the on-demand task and memory profile.
+ */
+
+#include "onion_prof.h"
+#include "string.h"
+
+#if CONFIG_ONION_PROF
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "os/os_mbuf.h"
+
+/**
+ * @brief Run-time counter of a task at the previous query.
+ */
+typedef struct {
+    TaskHandle_t handle;
+    uint32_t runtime;
+} prof_prev_t;
+
+/* Static so the query does not need a large stack in the command task */
+static TaskStatus_t prof_status[ONION_PROF_MAX_TASKS];
+static prof_prev_t prof_prev[ONION_PROF_MAX_TASKS];
+static size_t prof_prev_count = 0;
+static uint32_t prof_prev_total = 0;
+
+/**
+ * @brief Run-time counter of a task at the previous query (0 for tasks not seen before).
+ */
+static uint32_t prof_prev_runtime(TaskHandle_t handle) {
+    for (size_t i = 0; i < prof_prev_count; i++) {
+        if (prof_prev[i].handle == handle) return prof_prev[i].runtime;
+    }
+    return 0;
+}
+
+size_t onion_prof_tasks(onion_prof_task_t *out, size_t max, uint32_t *window_us) {
+    uint32_t total = 0;
+    size_t n = uxTaskGetSystemState(prof_status, ONION_PROF_MAX_TASKS, &total);
+
+    /* The counter wraps; unsigned differences stay right across one wrap */
+    uint32_t window = total - prof_prev_total;
+    if (n > max) n = max;
+
+    for (size_t i = 0; i < n; i++) {
+        const TaskStatus_t *s = &prof_status[i];
+        uint32_t ran = s->ulRunTimeCounter - prof_prev_runtime(s->xHandle);
+        uint64_t permille = window ? ((uint64_t)ran * 1000) / window : 0;
+        BaseType_t core = xTaskGetCoreID(s->xHandle);
+
+        strncpy(out[i].name, s->pcTaskName, sizeof(out[i].name) - 1);
+        out[i].name[sizeof(out[i].name) - 1] = '\0';
+        out[i].core = (core == tskNO_AFFINITY) ? -1 : (int8_t)core;
+        out[i].priority = (uint8_t)s->uxCurrentPriority;
+        out[i].cpu_permille = (uint16_t)(permille > 1000 ? 1000 : permille);
+        out[i].stack_free = s->usStackHighWaterMark;   /* StackType_t is one byte on ESP-IDF */
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        prof_prev[i].handle = prof_status[i].xHandle;
+        prof_prev[i].runtime = prof_status[i].ulRunTimeCounter;
+    }
+    prof_prev_count = n;
+    prof_prev_total = total;
+    *window_us = window;
+    return n;
+}
+
+bool onion_prof_mem(onion_prof_mem_t *out) {
+    out->heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    out->heap_min = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    out->heap_largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    out->mbuf_free = (uint16_t)os_msys_num_free();
+    out->mbuf_total = (uint16_t)os_msys_count();
+    return true;
+}
+
+#else
+
+size_t onion_prof_tasks(onion_prof_task_t *out, size_t max, uint32_t *window_us) {
+    *window_us = 0;
+    return 0;
+}
+
+bool onion_prof_mem(onion_prof_mem_t *out) {
+    memset(out, 0, sizeof(*out));
+    return false;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/**
+ * @file onion_prof.h
+ * @brief On-demand CPU, stack and memory profile for the PROF command.
+ *
+ * Nothing runs between queries: each call walks the FreeRTOS task list and
+ * the heap and mbuf pools once. CPU shares are computed over the window since
+ * the previous task query, so polling PROF at a fixed rate yields a load graph.
+ * The only standing cost is the run-time counter FreeRTOS reads on every
+ * context switch, selected together with CONFIG_ONION_PROF.
+ */
+
+#ifndef ONION_PROF_H
+#define ONION_PROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+/** @brief Most tasks reported per query; later tasks are left out. */
+#define ONION_PROF_MAX_TASKS 24
+
+/**
+ * @brief One task's profile.
+ */
+typedef struct {
+    char name[16];
+    int8_t core;            /**< Core the task is pinned to, -1 if it floats */
+    uint8_t priority;       /**< Current priority */
+    uint16_t cpu_permille;  /**< Share of one core's time since the previous query */
+    uint32_t stack_free;    /**< High-water mark: fewest stack bytes ever left free */
+} onion_prof_task_t;
+
+/**
+ * @brief Heap and NimBLE mbuf pool usage.
+ */
+typedef struct {
+    uint32_t heap_free;     /**< Free 8-bit capable heap, bytes */
+    uint32_t heap_min;      /**< Lowest heap_free since boot */
+    uint32_t heap_largest;  /**< Largest allocatable block */
+    uint16_t mbuf_free;     /**< Free msys mbufs */
+    uint16_t mbuf_total;    /**< msys mbufs in all pools */
+} onion_prof_mem_t;
+
+/**
+ * @brief Snapshots every task and restarts the CPU measurement window.
+ * @note Not reentrant; the command dispatcher serialises callers.
+ * @param window_us Receives the length of the measured window.
+ * @return Number of entries written, 0 if profiling is compiled out.
+ */
+size_t onion_prof_tasks(onion_prof_task_t *out, size_t max, uint32_t *window_us);
+
+/**
+ * @brief Reads heap and mbuf pool usage.
+ * @return false if profiling is compiled out.
+ */
+bool onion_prof_mem(onion_prof_mem_t *out);
+
+#endif // ONION_PROF_H
@@ -0,0 +1,60 @@
+/**
+ * @file onion_report_queue.c
+ * @brief Broadcast ring buffer implementation for HID keyboard states.
+ */
+
+#include "onion_report_queue.h"
+#include "onion_stats.h"
+
+#define QUEUE_MASK (ONION_REPORT_QUEUE_LEN - 1)
+
+_Static_assert((ONION_REPORT_QUEUE_LEN & QUEUE_MASK) == 0, "ONION_REPORT_QUEUE_LEN must be a power of two");
+
+void onion_report_queue_init(onion_report_queue_t *q) {
+    q->head = 0;
+    q->tail = 0;
+}
+
+bool onion_report_queue_push(onion_report_queue_t *q, const onion_hid_report_t *report, int64_t origin_us) {
+    uint32_t head = q->head;
+    uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ONION_REPORT_QUEUE_LEN) return false;
+
+    q->slots[head & QUEUE_MASK] = *report;
+    q->stamps[head & QUEUE_MASK].origin_us = origin_us;
+    q->stamps[head & QUEUE_MASK].queued_us = ONION_STATS_NOW();
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void onion_report_queue_cursor_reset(const onion_report_queue_t *q, onion_report_cursor_t *c) {
+    c->pos = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+size_t onion_report_queue_count(const onion_report_queue_t *q, const onion_report_cursor_t *c) {
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    return (size_t)(head - c->pos);
+}
+
+const onion_hid_report_t *onion_report_queue_peek(const onion_report_queue_t *q,
+                                                  const onion_report_cursor_t *c, size_t idx) {
+    if (idx >= onion_report_queue_count(q, c)) return NULL;
+    return &q->slots[(c->pos + idx) & QUEUE_MASK];
+}
+
+const onion_report_stamp_t *onion_report_queue_peek_stamp(const onion_report_queue_t *q,
+                                                          const onion_report_cursor_t *c, size_t idx) {
+    if (idx >= onion_report_queue_count(q, c)) return NULL;
+    return &q->stamps[(c->pos + idx) & QUEUE_MASK];
+}
+
+void onion_report_queue_advance(const onion_report_queue_t *q, onion_report_cursor_t *c, size_t n) {
+    size_t count = onion_report_queue_count(q, c);
+    c->pos += (uint32_t)(n < count ? n : count);
+}
+
+void onion_report_queue_release(onion_report_queue_t *q, const onion_report_cursor_t *slowest) {
+    uint32_t pos = slowest ? slowest->pos : __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&q->tail, pos, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,94 @@
+/**
+ * @file onion_report_queue.h
+ * @brief Lock-free single-producer broadcast queue of HID keyboard states.
+ *
+ * The scan loop pushes one entry per changed sweep; every connected host
+ * reads the same entries through its own cursor, so a state is built and
+ * stored once however many hosts receive it. All cursors live in the NimBLE
+ * host task, which hands slots back to the producer by releasing up to the
+ * slowest cursor. Only the producer writes head and only the host task
+ * writes tail and the cursors, so no lock is needed between the two tasks.
+ */
+
+#ifndef ONION_REPORT_QUEUE_H
+#define ONION_REPORT_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "onion_config.h"
+#include "onion_hid.h"
+
+/**
+ * @brief Latency timestamps carried next to each report (0 when statistics are compiled out).
+ */
+typedef struct {
+    int64_t origin_us;  /**< Start of the sweep that produced the report */
+    int64_t queued_us;  /**< Time the report was pushed */
+} onion_report_stamp_t;
+
+/**
+ * @brief Queue storage. Treat as opaque outside onion_report_queue.c.
+ */
+typedef struct {
+    onion_hid_report_t slots[ONION_REPORT_QUEUE_LEN];
+    onion_report_stamp_t stamps[ONION_REPORT_QUEUE_LEN];
+    uint32_t head; /**< Next slot to write (producer owned) */
+    uint32_t tail; /**< Oldest slot a cursor may still read (consumer owned) */
+} onion_report_queue_t;
+
+/**
+ * @brief One consumer's read position. Treat as opaque outside onion_report_queue.c.
+ */
+typedef struct {
+    uint32_t pos;
+} onion_report_cursor_t;
+
+/**
+ * @brief Resets the queue to empty. Not safe while producer or consumers run.
+ */
+void onion_report_queue_init(onion_report_queue_t *q);
+
+/**
+ * @brief Appends a report (producer side).
+ * @param origin_us Start of the sweep that produced the report (latency statistics).
+ * @return false if the queue is full; the caller must retry later.
+ */
+bool onion_report_queue_push(onion_report_queue_t *q, const onion_hid_report_t *report, int64_t origin_us);
+
+/**
+ * @brief Moves a cursor past everything queued so far (consumer side).
+ */
+void onion_report_queue_cursor_reset(const onion_report_queue_t *q, onion_report_cursor_t *c);
+
+/**
+ * @brief Number of reports waiting for the cursor (consumer side).
+ */
+size_t onion_report_queue_count(const onion_report_queue_t *q, const onion_report_cursor_t *c);
+
+/**
+ * @brief Returns the idx-th report waiting for the cursor without consuming it.
+ * @return Pointer into the queue, or NULL if fewer than idx+1 reports wait.
+ */
+const onion_hid_report_t *onion_report_queue_peek(const onion_report_queue_t *q,
+                                                  const onion_report_cursor_t *c, size_t idx);
+
+/**
+ * @brief Returns the timestamps of the idx-th report waiting for the cursor.
+ * @return Pointer into the queue, or NULL if fewer than idx+1 reports wait.
+ */
+const onion_report_stamp_t *onion_report_queue_peek_stamp(const onion_report_queue_t *q,
+                                                          const onion_report_cursor_t *c, size_t idx);
+
+/**
+ * @brief Consumes up to n reports for the cursor (consumer side).
+ */
+void onion_report_queue_advance(const onion_report_queue_t *q, onion_report_cursor_t *c, size_t n);
+
+/**
+ * @brief Hands slots back to the producer (consumer side).
+ * @param slowest The cursor with the most reports waiting, or NULL if no cursor is active.
+ */
+void onion_report_queue_release(onion_report_queue_t *q, const onion_report_cursor_t *slowest);
+
+#endif // ONION_REPORT_QUEUE_H
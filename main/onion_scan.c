@@ -0,0 +1,585 @@
+/**
+ * @file onion_scan.c
+ * @brief Continuous ADC scan engine with Gray-code MUX stepping from the conversion-done ISR.
+ */
+
+#include "onion_scan.h"
+#include "onion_config.h"
+#include "onion_touch.h"
+#include "onion_stats.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_adc/adc_continuous.h"
+#include "soc/soc_caps.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "string.h"
+
+static const char *TAG = "ONION_SCAN";
+
+#define SCAN_MAX_FRAME_BYTES (ONION_SCAN_SAMPLES_PER_STEP * ONION_MUX_COUNT * SOC_ADC_DIGI_RESULT_BYTES)
+#define SCAN_RING_MASK       (ONION_SCAN_RING_LEN - 1)
+/** @brief Shortest frame accepted after calibration (keeps the ISR rate bounded). */
+#define SCAN_MIN_FRAME_SAMPLES 4
+/** @brief log2(ONION_SCAN_AVG_SAMPLES_MAX). */
+#define SCAN_AVG_SHIFT_MAX (ONION_SCAN_AVG_SAMPLES_MAX >= 8 ? 3 : ONION_SCAN_AVG_SAMPLES_MAX >= 4 ? 2 : \
+                            ONION_SCAN_AVG_SAMPLES_MAX >= 2 ? 1 : 0)
+
+/*
+ * Result layout of the digital controller: TYPE1 (data, channel) exists only on
+ * the classic ESP32 and the S2; the C3, S3 and later chips write TYPE2 (data,
+ * channel, unit). Every result is read through these accessors.
+ */
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define SCAN_OUTPUT_FORMAT     ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define SCAN_RESULT_CHANNEL(d) ((d)->type1.channel)
+#define SCAN_RESULT_DATA(d)    ((d)->type1.data)
+#else
+#define SCAN_OUTPUT_FORMAT     ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define SCAN_RESULT_CHANNEL(d) ((d)->type2.channel)
+#define SCAN_RESULT_DATA(d)    ((d)->type2.data)
+#endif
+
+_Static_assert((ONION_SCAN_RING_LEN & SCAN_RING_MASK) == 0, "ONION_SCAN_RING_LEN must be a power of two");
+_Static_assert((SCAN_MAX_FRAME_BYTES % SOC_ADC_DIGI_DATA_BYTES_PER_CONV) == 0, "DMA frame must hold whole conversions");
+_Static_assert(ONION_SCAN_SETTLE_SAMPLES < ONION_SCAN_SAMPLES_PER_STEP, "No samples left after settling");
+_Static_assert((1 << SCAN_AVG_SHIFT_MAX) == ONION_SCAN_AVG_SAMPLES_MAX, "Averaging depth must be 1, 2, 4 or 8");
+_Static_assert(ONION_MUX_ADDRESSES == 16, "Gray-code sweep order is written for 4 select lines");
+_Static_assert(ONION_MUX_COUNT >= 1 && ONION_MUX_COUNT <= SOC_ADC_PATT_LEN_MAX, "One conversion pattern entry per MUX");
+_Static_assert((uint64_t)ONION_SCAN_SAMPLE_FREQ_HZ * ONION_MUX_COUNT <= SOC_ADC_SAMPLE_FREQ_THRES_HIGH,
+               "ADC cannot convert every MUX output at ONION_SCAN_SAMPLE_FREQ_HZ");
+
+/** @brief ADC1 input of each MUX (topology table from onion_config.h). */
+static const DRAM_ATTR uint8_t mux_adc_channel[ONION_MUX_COUNT] = ONION_MUX_ADC_CHANNELS;
+
+/** @brief MUX index per value of the 4-bit result channel field, 0xFF for inputs that carry no MUX (read by the ISR). */
+static DRAM_ATTR uint8_t adc_to_mux[16];
+
+static adc_continuous_handle_t adc_handle = NULL;
+static SemaphoreHandle_t sweep_sem = NULL;
+static StaticSemaphore_t sweep_sem_buf;
+static SemaphoreHandle_t scan_lock = NULL;  /**< Serializes start/stop against frame reconfiguration */
+static StaticSemaphore_t scan_lock_buf;
+static bool running = false;
+/** @brief Set once onion_scan_init() has succeeded; commands arriving earlier over BLE are refused. */
+static bool scan_ready = false;
+
+/** @brief Conversions per MUX output in the DMA frame currently programmed into the driver. */
+static uint32_t frame_samples = ONION_SCAN_SAMPLES_PER_STEP;
+
+/** @brief log2 of the settled samples averaged per step, counted from the end of the frame. */
+static uint32_t avg_shift = SCAN_AVG_SHIFT_MAX;
+
+/** @brief Leading conversions discarded per channel. */
+static uint8_t settle[MUX_CHANNELS_COUNT];
+
+/**
+ * @brief Averaging window per channel, rebuilt whenever frame, settle or averaging change (read by the ISR).
+ * The window is the last 1 << win_shift[ch] conversions of the channel from win_first[ch] on,
+ * shortened to a smaller power of two when the settle time leaves less room, so the ISR
+ * averages with a shift and compares nothing against the configuration.
+ */
+static DRAM_ATTR uint8_t win_first[MUX_CHANNELS_COUNT];
+static DRAM_ATTR uint8_t win_shift[MUX_CHANNELS_COUNT];
+
+/**
+ * @brief Sweep order: the reflected Gray code, so every step flips one select line.
+ * Fewer switching edges mean less charge injection into the MUX output.
+ */
+static const DRAM_ATTR uint8_t sweep_order[16] = {
+    0, 1, 3, 2, 6, 7, 5, 4, 12, 13, 15, 14, 10, 11, 9, 8
+};
+
+#if CONFIG_ONION_STATS
+/** @brief esp_timer time of the previous conversion-done callback (0 after a start). */
+static int64_t last_step_us = 0;
+#endif
+
+/** @brief Position in sweep_order currently driven on S0-S3 (owned by the ISR while running). */
+static uint8_t mux_pos = 0;
+
+/** @brief esp_timer time at which sweep_order[mux_pos] was selected (owned by the ISR while running). */
+static int64_t switch_us = 0;
+
+/**
+ * @brief Shortest switch-to-callback time of a frame whose averaging windows were all
+ * converted after the switch (rebuilt with the windows, read by the ISR).
+ */
+static DRAM_ATTR uint32_t frame_clean_us = 0;
+
+/** @brief Frames discarded because they were converted at the previous MUX address. */
+static uint32_t frame_drops = 0;
+
+/**
+ * @brief Single-producer (ISR) / single-consumer (task) ring of tagged samples.
+ * ring_head is written only by the ISR, ring_tail only by onion_scan_read().
+ */
+static onion_scan_sample_t ring[ONION_SCAN_RING_LEN];
+static uint32_t ring_head = 0;
+static uint32_t ring_tail = 0;
+static uint32_t ring_overruns = 0;
+
+/** @brief SETTLE calibration: worst observed settle per channel while cal_sweeps > 0. */
+static uint8_t cal_settle[MUX_CHANNELS_COUNT];
+static uint32_t cal_sweeps = 0;
+static SemaphoreHandle_t cal_sem = NULL;
+static StaticSemaphore_t cal_sem_buf;
+
+/**
+ * @brief MUX index of a conversion result; folds to a constant with a single multiplexer.
+ */
+static inline uint32_t IRAM_ATTR scan_mux_of(const adc_digi_output_data_t *d) {
+#if ONION_MUX_COUNT == 1
+    return 0;
+#else
+    return adc_to_mux[SCAN_RESULT_CHANNEL(d)];
+#endif
+}
+
+#if !CONFIG_ONION_SCAN_FILTER_MEAN
+/**
+ * @brief Reduces one averaging window with the filter selected in menuconfig.
+ * @param w Window conversions (reordered by the median).
+ * @param shift log2 of the window length.
+ */
+static inline uint16_t IRAM_ATTR scan_reduce(uint16_t *w, uint32_t shift) {
+    const uint32_t n = 1u << shift;
+#if CONFIG_ONION_SCAN_FILTER_MEDIAN
+    if (n < 3) return (uint16_t)((w[0] + w[n - 1]) >> 1);
+    for (uint32_t i = 1; i < n; i++) {
+        uint16_t v = w[i];
+        uint32_t j = i;
+        for (; j > 0 && w[j - 1] > v; j--) w[j] = w[j - 1];
+        w[j] = v;
+    }
+    return (uint16_t)((w[(n - 1) / 2] + w[n / 2]) >> 1);
+#else
+    uint32_t sum = 0, lo = UINT16_MAX, hi = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        sum += w[i];
+        if (w[i] < lo) lo = w[i];
+        if (w[i] > hi) hi = w[i];
+    }
+    if (n < 4) return (uint16_t)(sum >> shift);
+    return (uint16_t)((sum - lo - hi) / (n - 2));
+#endif
+}
+#endif
+
+/**
+ * @brief Recomputes win_first / win_shift for the current frame length (caller holds scan_lock or the engine is idle).
+ */
+static void scan_update_windows(void) {
+    uint32_t tail = 0;
+
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        uint32_t room = (frame_samples > settle[ch]) ? frame_samples - settle[ch] : 1;
+        uint32_t shift = avg_shift;
+        while (shift > 0 && (1u << shift) > room) shift--;
+        win_first[ch] = (uint8_t)(frame_samples - (1u << shift));
+        win_shift[ch] = (uint8_t)shift;
+        if (frame_samples - win_first[ch] > tail) tail = frame_samples - win_first[ch];
+    }
+
+    /* Capped below a full frame so callback jitter alone never drops a frame */
+    uint32_t clean = tail * 1000000u / ONION_SCAN_SAMPLE_FREQ_HZ;
+    uint32_t cap = frame_samples * 750000u / ONION_SCAN_SAMPLE_FREQ_HZ;
+    frame_clean_us = clean < cap ? clean : cap;
+}
+
+/**
+ * @brief Counts the leading conversions of one ADC input that are not yet within tolerance of the step's final value.
+ * @param channel ADC1 channel to measure; the other inputs interleaved in the frame are skipped.
+ */
+static inline uint32_t IRAM_ATTR scan_measure_settle(const adc_digi_output_data_t *p, uint32_t count,
+                                                     uint8_t channel) {
+    uint32_t total = 0, tail = 0, final = 0;
+
+    for (uint32_t i = count; i > 0; i--) {
+        if (SCAN_RESULT_CHANNEL(&p[i - 1]) != channel) continue;
+        if (tail < 4) {
+            final += SCAN_RESULT_DATA(&p[i - 1]);
+            tail++;
+        }
+        total++;
+    }
+    if (tail < 4) return 0;
+    final /= 4;
+
+    uint32_t k = total;
+    for (uint32_t i = count; i > 0 && k > 0; i--) {
+        if (SCAN_RESULT_CHANNEL(&p[i - 1]) != channel) continue;
+        int32_t d = (int32_t)SCAN_RESULT_DATA(&p[i - 1]) - (int32_t)final;
+        if (d > ONION_SETTLE_TOLERANCE || d < -ONION_SETTLE_TOLERANCE) break;
+        k--;
+    }
+    return k;
+}
+
+/**
+ * @brief DMA frame callback: tags the finished frame, then advances the MUX.
+ *
+ * The frame that just completed was converted while sweep_order[mux_pos] was
+ * selected on every multiplexer; its conversions alternate between the MUX
+ * outputs and are split by the channel field of each result. Switching the
+ * address here lets the MUXes settle during the leading settle[ch]
+ * conversions of the next frame, which also absorb the interrupt latency.
+ */
+static bool IRAM_ATTR scan_conv_done_cb(adc_continuous_handle_t handle,
+                                        const adc_continuous_evt_data_t *edata, void *user_data) {
+    const int64_t now = esp_timer_get_time();
+
+    /*
+     * The tag assumes one callback per frame, right after it ends. A callback
+     * delayed past the next frame boundary (flash cache disabled, a long critical
+     * section) leaves the DMA converting at the old address, and those frames then
+     * complete shortly after the late switch. Drop them and keep the address, so
+     * this step is taken again from the next clean frame instead of being stored
+     * under the wrong pads.
+     */
+    if (now - switch_us < frame_clean_us) {
+        frame_drops++;
+        return false;
+    }
+
+    const uint8_t addr = sweep_order[mux_pos];
+    mux_pos = (mux_pos + 1) % ONION_MUX_ADDRESSES;
+    set_mux_address(sweep_order[mux_pos]);
+    switch_us = now;
+
+#if CONFIG_ONION_STATS
+    if (last_step_us != 0) onion_stats_record(ONION_STAT_STEP, now - last_step_us);
+    last_step_us = now;
+#endif
+
+    const adc_digi_output_data_t *p = (const adc_digi_output_data_t *)edata->conv_frame_buffer;
+    const uint32_t count = edata->size / SOC_ADC_DIGI_RESULT_BYTES;
+    uint32_t seen[ONION_MUX_COUNT] = {0};
+#if CONFIG_ONION_SCAN_FILTER_MEAN
+    uint32_t sum[ONION_MUX_COUNT] = {0};
+#else
+    uint16_t win[ONION_MUX_COUNT][ONION_SCAN_AVG_SAMPLES_MAX];
+#endif
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint32_t m = scan_mux_of(&p[i]);
+        if (m >= ONION_MUX_COUNT) continue;
+        const uint32_t ch = m * ONION_MUX_ADDRESSES + addr;
+        /* Unsigned wrap turns "first <= k < first + width" into one compare */
+        const uint32_t k = seen[m]++ - win_first[ch];
+        if (k < (1u << win_shift[ch])) {
+#if CONFIG_ONION_SCAN_FILTER_MEAN
+            sum[m] += SCAN_RESULT_DATA(&p[i]);
+#else
+            win[m][k] = SCAN_RESULT_DATA(&p[i]);
+#endif
+        }
+    }
+
+    bool complete = true;
+    for (int m = 0; m < ONION_MUX_COUNT; m++) {
+        const uint32_t ch = m * ONION_MUX_ADDRESSES + addr;
+        if (seen[m] < win_first[ch] + (1u << win_shift[ch])) complete = false;
+    }
+    if (complete) {
+        uint32_t head = ring_head;
+        uint32_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+        if (head - tail < ONION_SCAN_RING_LEN) {
+            for (int m = 0; m < ONION_MUX_COUNT; m++) {
+                const uint32_t shift = win_shift[m * ONION_MUX_ADDRESSES + addr];
+#if CONFIG_ONION_SCAN_FILTER_MEAN
+                ring[head & SCAN_RING_MASK].value[m] = (uint16_t)(sum[m] >> shift);
+#else
+                ring[head & SCAN_RING_MASK].value[m] = scan_reduce(win[m], shift);
+#endif
+            }
+            ring[head & SCAN_RING_MASK].addr = addr;
+            __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+        } else {
+            ring_overruns++;
+        }
+    }
+
+    BaseType_t woken = pdFALSE;
+    if (cal_sweeps > 0) {
+        for (int m = 0; m < ONION_MUX_COUNT; m++) {
+            const int ch = m * ONION_MUX_ADDRESSES + addr;
+            uint32_t k = scan_measure_settle(p, count, mux_adc_channel[m]);
+            if (k > cal_settle[ch]) cal_settle[ch] = (uint8_t)k;
+        }
+        if (mux_pos == 0 && --cal_sweeps == 0) {
+            xSemaphoreGiveFromISR(cal_sem, &woken);
+        }
+    }
+    if (mux_pos == 0) {
+        xSemaphoreGiveFromISR(sweep_sem, &woken);
+    }
+    return woken == pdTRUE;
+}
+
+/**
+ * @brief Allocates the continuous ADC driver for frames of the given length.
+ * @param samples Conversions per MUX output and step.
+ */
+static esp_err_t scan_open(uint32_t samples) {
+    esp_err_t err;
+    const uint32_t frame_bytes = samples * ONION_MUX_COUNT * SOC_ADC_DIGI_RESULT_BYTES;
+
+    adc_continuous_handle_cfg_t handle_cfg = {
+        .max_store_buf_size = frame_bytes * 4,
+        .conv_frame_size = frame_bytes,
+        /* Frames are consumed in the ISR; let the driver recycle its internal pool */
+        .flags.flush_pool = 1,
+    };
+    err = adc_continuous_new_handle(&handle_cfg, &adc_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ADC continuous handle allocation failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    /* One pattern entry per MUX: the controller cycles through the outputs conversion by conversion */
+    adc_digi_pattern_config_t pattern[ONION_MUX_COUNT];
+    for (int m = 0; m < ONION_MUX_COUNT; m++) {
+        pattern[m] = (adc_digi_pattern_config_t){
+            .atten = ONION_SCAN_ATTEN,
+            .channel = mux_adc_channel[m] & 0x7,
+            .unit = ADC_UNIT_1,
+            .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+        };
+    }
+    adc_continuous_config_t dig_cfg = {
+        .pattern_num = ONION_MUX_COUNT,
+        .adc_pattern = pattern,
+        .sample_freq_hz = ONION_SCAN_SAMPLE_FREQ_HZ * ONION_MUX_COUNT,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = SCAN_OUTPUT_FORMAT,
+    };
+    err = adc_continuous_config(adc_handle, &dig_cfg);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ADC continuous config failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    adc_continuous_evt_cbs_t cbs = {
+        .on_conv_done = scan_conv_done_cb,
+    };
+    err = adc_continuous_register_event_callbacks(adc_handle, &cbs, NULL);
+    if (err != ESP_OK) return err;
+
+    frame_samples = samples;
+    scan_update_windows();
+    return ESP_OK;
+}
+
+/**
+ * @brief Selects the first address of the sweep before the engine (re)starts.
+ */
+static void scan_rewind(void) {
+    mux_pos = 0;
+    set_mux_address(sweep_order[0]);
+    switch_us = esp_timer_get_time();
+#if CONFIG_ONION_STATS
+    last_step_us = 0;
+#endif
+}
+
+/**
+ * @brief Releases the ADC driver, also one that scan_open() left half-configured.
+ */
+static void scan_close(void) {
+    if (adc_handle == NULL) return;
+    adc_continuous_deinit(adc_handle);
+    adc_handle = NULL;
+}
+
+/**
+ * @brief Stops the engine if needed, reallocates it with a new frame length and resumes (caller holds scan_lock).
+ * If the new length cannot be opened the engine is reopened at the previous one.
+ */
+static esp_err_t scan_set_frame(uint32_t samples) {
+    if (samples == frame_samples) return ESP_OK;
+
+    const uint32_t prev = frame_samples;
+    bool was_running = running;
+    if (running) {
+        running = false;
+        adc_continuous_stop(adc_handle);
+    }
+    scan_close();
+
+    esp_err_t err = scan_open(samples);
+    if (err != ESP_OK) {
+        scan_close();
+        ESP_LOGE(TAG, "Frame length %u failed (%s), keeping %u samples", (unsigned)samples, esp_err_to_name(err),
+                 (unsigned)prev);
+        if (scan_open(prev) != ESP_OK) scan_close();
+    }
+    if (adc_handle != NULL && was_running) {
+        scan_rewind();
+        esp_err_t start = adc_continuous_start(adc_handle);
+        running = (start == ESP_OK);
+        if (err == ESP_OK) err = start;
+    }
+    ESP_LOGI(TAG, "Frame length %u samples (%u us per step)", (unsigned)frame_samples,
+             (unsigned)(frame_samples * 1000000u / ONION_SCAN_SAMPLE_FREQ_HZ));
+    return err;
+}
+
+int onion_scan_init(void) {
+    sweep_sem = xSemaphoreCreateBinaryStatic(&sweep_sem_buf);
+    cal_sem = xSemaphoreCreateBinaryStatic(&cal_sem_buf);
+    scan_lock = xSemaphoreCreateMutexStatic(&scan_lock_buf);
+
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        settle[ch] = ONION_SCAN_SETTLE_SAMPLES;
+    }
+    memset(adc_to_mux, 0xFF, sizeof(adc_to_mux));
+    for (int m = 0; m < ONION_MUX_COUNT; m++) {
+        if (adc_to_mux[mux_adc_channel[m]] != 0xFF) {
+            ESP_LOGE(TAG, "MUX %d shares ADC1 channel %u with MUX %u", m, mux_adc_channel[m],
+                     adc_to_mux[mux_adc_channel[m]]);
+            return ESP_ERR_INVALID_ARG;
+        }
+        adc_to_mux[mux_adc_channel[m]] = (uint8_t)m;
+    }
+    if (scan_open(ONION_SCAN_SAMPLES_PER_STEP) != ESP_OK) return ESP_FAIL;
+    __atomic_store_n(&scan_ready, true, __ATOMIC_RELEASE);
+
+    ESP_LOGI(TAG, "Scan engine ready: %d MUX x %d Hz, %d samples/step, %d settle.", ONION_MUX_COUNT,
+             ONION_SCAN_SAMPLE_FREQ_HZ, ONION_SCAN_SAMPLES_PER_STEP, ONION_SCAN_SETTLE_SAMPLES);
+    return ESP_OK;
+}
+
+int onion_scan_start(void) {
+    if (!__atomic_load_n(&scan_ready, __ATOMIC_ACQUIRE)) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (!running) {
+        scan_rewind();
+        err = adc_continuous_start(adc_handle);
+        running = (err == ESP_OK);
+    }
+    xSemaphoreGive(scan_lock);
+    return err;
+}
+
+int onion_scan_stop(void) {
+    if (!__atomic_load_n(&scan_ready, __ATOMIC_ACQUIRE)) return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (running) {
+        running = false;
+        err = adc_continuous_stop(adc_handle);
+    }
+    xSemaphoreGive(scan_lock);
+    return err;
+}
+
+void onion_scan_set_averaging(uint8_t samples) {
+    uint32_t shift = 0;
+
+    if (!__atomic_load_n(&scan_ready, __ATOMIC_ACQUIRE)) return;
+
+    if (samples > ONION_SCAN_AVG_SAMPLES_MAX) samples = ONION_SCAN_AVG_SAMPLES_MAX;
+    while ((2u << shift) <= samples) shift++;
+
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    avg_shift = shift;
+    scan_update_windows();
+    xSemaphoreGive(scan_lock);
+}
+
+int onion_scan_set_settle(const uint8_t samples[MUX_CHANNELS_COUNT]) {
+    uint8_t prev[MUX_CHANNELS_COUNT];
+    uint32_t worst = 0;
+
+    if (!__atomic_load_n(&scan_ready, __ATOMIC_ACQUIRE)) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    memcpy(prev, settle, sizeof(prev));
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        uint8_t s = samples[ch];
+        if (s > ONION_SCAN_SAMPLES_PER_STEP - 1) s = ONION_SCAN_SAMPLES_PER_STEP - 1;
+        settle[ch] = s;
+        if (s > worst) worst = s;
+    }
+
+    /* The DMA frame length is global: size it for the slowest channel plus full averaging */
+    uint32_t n = worst + ONION_SCAN_AVG_SAMPLES_MAX;
+    n = (n + 1) & ~1u;
+    if (n < SCAN_MIN_FRAME_SAMPLES) n = SCAN_MIN_FRAME_SAMPLES;
+    if (n > ONION_SCAN_SAMPLES_PER_STEP) n = ONION_SCAN_SAMPLES_PER_STEP;
+
+    esp_err_t err = scan_set_frame(n);
+    /* The frame kept its previous length: keep the settle times it was sized for */
+    if (err != ESP_OK) memcpy(settle, prev, sizeof(prev));
+    scan_update_windows();
+    xSemaphoreGive(scan_lock);
+    return err;
+}
+
+bool onion_scan_calibrate_settle(uint8_t out[MUX_CHANNELS_COUNT], TickType_t timeout) {
+    if (!__atomic_load_n(&scan_ready, __ATOMIC_ACQUIRE)) return false;
+
+    /* Measure on the longest frame so slow channels have room to settle */
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    uint32_t restore = frame_samples;
+    esp_err_t err = scan_set_frame(ONION_SCAN_SAMPLES_PER_STEP);
+    memset(cal_settle, 0, sizeof(cal_settle));
+    xSemaphoreTake(cal_sem, 0);
+    __atomic_store_n(&cal_sweeps, ONION_SETTLE_CAL_SWEEPS, __ATOMIC_RELEASE);
+    xSemaphoreGive(scan_lock);
+
+    /* The lock is free while waiting: standby sweeps still start and stop the engine */
+    bool done = (err == ESP_OK) && xSemaphoreTake(cal_sem, timeout) == pdTRUE;
+
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    __atomic_store_n(&cal_sweeps, 0, __ATOMIC_RELEASE);
+    if (!done) scan_set_frame(restore);
+    xSemaphoreGive(scan_lock);
+
+    if (!done) {
+        ESP_LOGW(TAG, "Settle calibration timed out");
+        return false;
+    }
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        uint32_t s = cal_settle[ch] + ONION_SETTLE_MARGIN;
+        out[ch] = (uint8_t)(s < ONION_SCAN_SAMPLES_PER_STEP ? s : ONION_SCAN_SAMPLES_PER_STEP - 1);
+    }
+    return true;
+}
+
+size_t onion_scan_read(onion_scan_sample_t *out, size_t max) {
+    uint32_t tail = ring_tail;
+    uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    while (tail != head && n < max) {
+        out[n++] = ring[tail & SCAN_RING_MASK];
+        tail++;
+    }
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+bool onion_scan_wait_sweep(TickType_t timeout) {
+    return xSemaphoreTake(sweep_sem, timeout) == pdTRUE;
+}
+
+void onion_scan_clear_sweep(void) {
+    xSemaphoreTake(sweep_sem, 0);
+}
+
+uint32_t onion_scan_get_step_count(void) {
+    return __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) + ring_overruns;
+}
+
+uint32_t onion_scan_get_overruns(void) {
+    return ring_overruns;
+}
+
+uint32_t onion_scan_get_frame_drops(void) {
+    return frame_drops;
+}
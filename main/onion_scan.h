@@ -0,0 +1,123 @@
+/**
+ * @file onion_scan.h
+ * @brief DMA-driven multiplexer scan engine.
+ *
+ * The engine runs the ADC in continuous (DMA) mode on the output of every
+ * multiplexer listed in ONION_MUX_ADC_CHANNELS. Every completed DMA frame
+ * belongs to one MUX address, shared by all multiplexers through the common
+ * select lines, and interleaves the conversions of all MUX outputs: the
+ * conversion-done callback reduces the settled part of each output (mean,
+ * median or trimmed mean, see CONFIG_ONION_SCAN_FILTER_*), pushes
+ * the values into a ring buffer tagged with that address and steps the MUXes
+ * to the next address. The conversion rate is scaled by the MUX count, so a
+ * step, and a sweep, takes the same time with one multiplexer or several.
+ * The CPU never busy-waits for the multiplexer or the ADC.
+ *
+ * Channels are visited in Gray-code order, so each step flips a single select
+ * line. The number of leading conversions discarded is set per channel, and
+ * the DMA frame is sized for the slowest channel, so a board with low source
+ * impedance runs short frames and fast sweeps.
+ */
+
+#ifndef ONION_SCAN_H
+#define ONION_SCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "onion_config.h"
+
+/**
+ * @brief Filtered readings of one address step, one per multiplexer (conversion codes).
+ */
+typedef struct {
+    uint16_t value[ONION_MUX_COUNT]; /**< Mean, median or trimmed mean of the settled samples; channel m * ONION_MUX_ADDRESSES + addr */
+    uint8_t  addr;                   /**< MUX address the values were sampled on */
+} onion_scan_sample_t;
+
+/**
+ * @brief Allocates the continuous ADC driver and configures the conversion pattern.
+ * @note MUX select GPIOs must already be configured as outputs.
+ * @return ESP_OK on success, or an error code from the ADC driver.
+ */
+int onion_scan_init(void);
+
+/**
+ * @brief Selects MUX address 0 and starts free-running conversions (no-op if running).
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE before onion_scan_init(), or an error code from the ADC driver.
+ */
+int onion_scan_start(void);
+
+/**
+ * @brief Stops conversions (no-op if stopped). Samples already in the ring buffer stay readable.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE before onion_scan_init(), or an error code from the ADC driver.
+ */
+int onion_scan_stop(void);
+
+/**
+ * @brief Sets how many settled samples of each MUX output and step are averaged.
+ * The newest samples of the frame are used; the channel's settle samples are
+ * always discarded, and a channel whose settle time leaves less room averages
+ * the largest power of two that fits. Takes effect on the next frame.
+ * @param samples Averaging depth, clamped to ONION_SCAN_AVG_SAMPLES_MAX and rounded down to a power of two.
+ */
+void onion_scan_set_averaging(uint8_t samples);
+
+/**
+ * @brief Applies per-channel settle times and resizes the DMA frame to the slowest channel.
+ * * Briefly stops and reallocates the ADC driver if the frame length changes. If the
+ * driver rejects the new length, the engine resumes with the previous frame and settle times.
+ * @param samples Conversions to discard per channel after switching to it.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE before onion_scan_init(), or an error code from the ADC driver.
+ */
+int onion_scan_set_settle(const uint8_t samples[MUX_CHANNELS_COUNT]);
+
+/**
+ * @brief Measures how many conversions each channel needs to settle after a MUX switch.
+ * * Runs the longest frame for ONION_SETTLE_CAL_SWEEPS sweeps and records, per
+ * channel, the worst count of leading samples outside ONION_SETTLE_TOLERANCE of
+ * the step's final value, plus ONION_SETTLE_MARGIN. The result is not applied;
+ * pass it to onion_scan_set_settle(). Blocks the caller; not for the sweep task.
+ * @param out Measured settle samples per channel.
+ * @param timeout Maximum time to wait, in ticks.
+ * @return true if the measurement completed, false on timeout or before onion_scan_init().
+ */
+bool onion_scan_calibrate_settle(uint8_t out[MUX_CHANNELS_COUNT], TickType_t timeout);
+
+/**
+ * @brief Drains tagged samples from the ring buffer (single consumer).
+ * @param out Destination array.
+ * @param max Capacity of the destination array.
+ * @return Number of samples copied.
+ */
+size_t onion_scan_read(onion_scan_sample_t *out, size_t max);
+
+/**
+ * @brief Blocks until the engine completes a sweep over all MUX addresses (every channel of every MUX).
+ * @param timeout Maximum time to wait, in ticks.
+ * @return true if a sweep completed within the timeout.
+ */
+bool onion_scan_wait_sweep(TickType_t timeout);
+
+/**
+ * @brief Discards a pending sweep-complete notification, if any.
+ */
+void onion_scan_clear_sweep(void);
+
+/**
+ * @brief Total MUX address steps produced since boot, including dropped ones (each reads ONION_MUX_COUNT channels).
+ */
+uint32_t onion_scan_get_step_count(void);
+
+/**
+ * @brief Number of samples dropped because the ring buffer was full.
+ */
+uint32_t onion_scan_get_overruns(void);
+
+/**
+ * @brief Number of DMA frames discarded because a late callback left them converted at the previous MUX address.
+ */
+uint32_t onion_scan_get_frame_drops(void);
+
+#endif // ONION_SCAN_H
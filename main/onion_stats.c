@@ -0,0 +1,121 @@
+/**
+ * @file onion_stats.c
+ * @brief Implementation of the per-stage latency histograms.
+ */
+
+#include "onion_stats.h"
+#include "esp_attr.h"
+#include "string.h"
+
+/** @brief Exact buckets below this value, then four per power of two. */
+#define STATS_LINEAR      8
+/** @brief Samples are clamped to 2^20 us (about 1 s). */
+#define STATS_MAX_EXP     20
+#define STATS_BUCKETS     (STATS_LINEAR + (STATS_MAX_EXP - 2) * 4)
+
+static const char *const stat_names[ONION_STAT_COUNT] = {
+    "wake", "step", "acquire", "classify", "submit", "notify", "e2e",
+};
+
+const char *onion_stats_name(onion_stat_id_t id) {
+    return (id < ONION_STAT_COUNT) ? stat_names[id] : "?";
+}
+
+#if CONFIG_ONION_STATS
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    bool     reset;   /**< Set by readers, honoured by the writer */
+    uint32_t bucket[STATS_BUCKETS];
+} stat_hist_t;
+
+static DRAM_ATTR stat_hist_t hist[ONION_STAT_COUNT];
+
+/**
+ * @brief Maps a duration to its log-linear bucket.
+ */
+static inline uint32_t IRAM_ATTR stats_bucket(uint32_t v) {
+    if (v < STATS_LINEAR) return v;
+    uint32_t e = 31 - (uint32_t)__builtin_clz(v);   /* e >= 3 */
+    if (e >= STATS_MAX_EXP) return STATS_BUCKETS - 1;
+    return STATS_LINEAR + (e - 3) * 4 + ((v >> (e - 2)) & 3);
+}
+
+/**
+ * @brief Largest duration that falls into a bucket.
+ */
+static uint32_t stats_bucket_upper(uint32_t idx) {
+    if (idx < STATS_LINEAR) return idx;
+    uint32_t e = (idx - STATS_LINEAR) / 4 + 3;
+    uint32_t m = (idx - STATS_LINEAR) % 4;
+    return ((5 + m) << (e - 2)) - 1;
+}
+
+void IRAM_ATTR onion_stats_record(onion_stat_id_t id, int64_t us) {
+    if (us < 0 || id >= ONION_STAT_COUNT) return;
+    stat_hist_t *h = &hist[id];
+    const uint32_t v = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+
+    if (__atomic_load_n(&h->reset, __ATOMIC_ACQUIRE)) {
+        h->count = 0;
+        h->sum = 0;
+        h->max = 0;
+        h->min = UINT32_MAX;
+        for (int i = 0; i < STATS_BUCKETS; i++) h->bucket[i] = 0;
+        __atomic_store_n(&h->reset, false, __ATOMIC_RELEASE);
+    }
+
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->sum += v;
+    h->bucket[stats_bucket(v)]++;
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+bool onion_stats_get(onion_stat_id_t id, onion_stat_summary_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (id >= ONION_STAT_COUNT) return false;
+
+    const stat_hist_t *h = &hist[id];
+    uint32_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    if (count == 0 || h->reset) return true;
+
+    out->count = count;
+    out->min = h->min;
+    out->max = h->max;
+    out->avg = (uint32_t)(h->sum / count);
+
+    /* Walk the histogram up to the 99th percentile */
+    uint32_t target = count - count / 100;
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= target) {
+            uint32_t upper = stats_bucket_upper(i);
+            out->p99 = (upper < out->max) ? upper : out->max;
+            break;
+        }
+    }
+    return true;
+}
+
+void onion_stats_reset(void) {
+    for (int i = 0; i < ONION_STAT_COUNT; i++) {
+        __atomic_store_n(&hist[i].reset, true, __ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+bool onion_stats_get(onion_stat_id_t id, onion_stat_summary_t *out) {
+    memset(out, 0, sizeof(*out));
+    return false;
+}
+
+void onion_stats_reset(void) {
+}
+
+#endif // CONFIG_ONION_STATS
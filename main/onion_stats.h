@@ -0,0 +1,78 @@
+/**
+ * @file onion_stats.h
+ * @brief Lock-free latency histograms for the scan-to-notify path.
+ *
+ * Each stage keeps a log-linear histogram (four buckets per power of two,
+ * microsecond resolution below 8 us) plus count, min, max and sum. Every stage
+ * has exactly one writer (ISR, sweep task or NimBLE host task), so recording
+ * is a handful of plain stores and never blocks. Readers may observe a sample
+ * half-recorded; the figures are statistics, not accounting.
+ *
+ * With CONFIG_ONION_STATS disabled, ONION_STATS_NOW() and onion_stats_record()
+ * compile to nothing.
+ */
+
+#ifndef ONION_STATS_H
+#define ONION_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+/**
+ * @brief Instrumented stages, in pipeline order.
+ */
+typedef enum {
+    ONION_STAT_WAKE,      /**< Sweep timer expiry until the sweep task runs */
+    ONION_STAT_STEP,      /**< Interval between MUX steps (one channel read) */
+    ONION_STAT_ACQUIRE,   /**< Waiting for the scan engine to complete a sweep */
+    ONION_STAT_CLASSIFY,  /**< Baseline, hysteresis and debounce over all channels */
+    ONION_STAT_SUBMIT,    /**< send_key_report() call */
+    ONION_STAT_NOTIFY,    /**< Report queued until the host accepted the notification */
+    ONION_STAT_E2E,       /**< Sweep start until the host accepted the notification */
+    ONION_STAT_COUNT
+} onion_stat_id_t;
+
+/**
+ * @brief Summary of one stage, in microseconds.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t avg;
+    uint32_t p99;   /**< Upper edge of the bucket holding the 99th percentile */
+    uint32_t max;
+} onion_stat_summary_t;
+
+#if CONFIG_ONION_STATS
+/** @brief Timestamp for a probe, in microseconds. */
+#define ONION_STATS_NOW() esp_timer_get_time()
+
+/**
+ * @brief Adds one sample to a stage (ISR safe; one writer per stage).
+ * @param us Duration in microseconds; negative values are ignored.
+ */
+void onion_stats_record(onion_stat_id_t id, int64_t us);
+#else
+#define ONION_STATS_NOW() ((int64_t)0)
+static inline void onion_stats_record(onion_stat_id_t id, int64_t us) { (void)id; (void)us; }
+#endif
+
+/**
+ * @brief Computes the summary of a stage.
+ * @return false if statistics are compiled out.
+ */
+bool onion_stats_get(onion_stat_id_t id, onion_stat_summary_t *out);
+
+/**
+ * @brief Short lowercase name of a stage, for serial output.
+ */
+const char *onion_stats_name(onion_stat_id_t id);
+
+/**
+ * @brief Asks every stage to start over; each writer clears its stage on its next sample.
+ */
+void onion_stats_reset(void);
+
+#endif // ONION_STATS_H
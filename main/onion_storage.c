@@ -0,0 +1,344 @@
+/**
+ * @file onion_storage.c
+ * @brief Implementation of the deferred-commit NVS configuration store.
+ */
+
+#include "onion_storage.h"
+#include "onion_config.h"
+#include "onion_touch.h"
+#include "onion_cali.h"
+#include "onion_telemetry.h"
+#include "onion_scan.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "string.h"
+#include <stdlib.h>
+
+/* Logging and NVS Storage constants */
+static const char *TAG = "ONION_CONFIG";
+static const char *NVS_NAMESPACE = "onion_storage";
+static const char *NVS_KEY_LUT = "onion_lut";
+/** @brief Action table of the split layout (ONION_CONFIG_VERSION_SPLIT and older). */
+static const char *NVS_KEY_ACT_LEGACY = "onion_act";
+
+/** @brief Largest blob accepted from NVS (current layout plus room for future fields). */
+#define CONFIG_BLOB_MAX (ONION_CONFIG_IMAGE_MAX - 2)
+
+/** @brief Flush task notification bits: a change (restarts the quiet window) / commit without waiting. */
+#define FLUSH_NOTIFY_CHANGE (1u << 0)
+#define FLUSH_NOTIFY_NOW    (1u << 1)
+
+static nvs_handle_t nvs = 0;
+static bool nvs_ready = false;
+static bool config_dirty = false;
+static bool legacy_act_stored = false; /**< onion_act still in NVS, erased by the next write */
+static TaskHandle_t flush_task = NULL;
+static SemaphoreHandle_t nvs_lock = NULL;
+static StaticSemaphore_t nvs_lock_buf;
+static StackType_t flush_task_stack[ONION_FLUSH_TASK_STACK];
+static StaticTask_t flush_task_buf;
+
+/** @brief Length of header + entries in the current layout; the action table follows. */
+#define CONFIG_BLOB_LEN (sizeof(onion_config_header_t) + MUX_CHANNELS_COUNT * sizeof(onion_key_t))
+
+/** @brief Pad table and action table validated by onion_config_import() (caller serialised). */
+static onion_key_t import_lut[MUX_CHANNELS_COUNT];
+static onion_action_table_t import_actions;
+
+/**
+ * @brief Writes header + the current onion_lut + the action table in the stored layout.
+ * @param out CONFIG_BLOB_MAX bytes.
+ * @return Blob length.
+ */
+static size_t config_serialize(uint8_t *out) {
+    onion_config_header_t header = {
+        .magic = ONION_CONFIG_MAGIC,
+        .version = ONION_CONFIG_VERSION,
+        .channels = MUX_CHANNELS_COUNT,
+        .entry_size = sizeof(onion_key_t),
+    };
+    onion_key_t lut[MUX_CHANNELS_COUNT];
+
+    onion_lut_snapshot(lut);
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), lut, sizeof(lut));
+    return CONFIG_BLOB_LEN + onion_lut_snapshot_actions(out + CONFIG_BLOB_LEN);
+}
+
+/**
+ * @brief Serializes the configuration and stores it as one blob (caller holds nvs_lock).
+ */
+static esp_err_t config_write(void) {
+    static uint8_t blob[CONFIG_BLOB_MAX];
+
+    /* Clear the flag first: a change arriving during the write re-arms it */
+    config_dirty = false;
+    size_t len = config_serialize(blob);
+
+    esp_err_t err = nvs_set_blob(nvs, NVS_KEY_LUT, blob, len);
+    if (err == ESP_OK && legacy_act_stored) {
+        /* The new blob carries the actions and is never read together with this key */
+        esp_err_t erase = nvs_erase_key(nvs, NVS_KEY_ACT_LEGACY);
+        if (erase == ESP_OK || erase == ESP_ERR_NVS_NOT_FOUND) legacy_act_stored = false;
+    }
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Flash update successful.");
+    } else {
+        config_dirty = true;
+        ESP_LOGE(TAG, "Flash update failed (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
+/**
+ * @brief Rewrites an entry stored in raw counts into mV on this board's curve.
+ * The delta is converted as the span between the threshold and threshold + delta.
+ */
+static void config_migrate_raw(int ch, onion_key_t *key) {
+    uint32_t top = (uint32_t)key->threshold + key->delta;
+    uint16_t thr_mv = onion_cali_raw_to_mv(ch, key->threshold);
+    uint16_t top_mv = onion_cali_raw_to_mv(ch, (uint16_t)(top > 4095 ? 4095 : top));
+
+    if (key->delta != 0) {
+        key->delta = (top_mv > thr_mv) ? (uint16_t)(top_mv - thr_mv) : 1;
+    }
+    key->threshold = thr_mv;
+}
+
+/**
+ * @brief Validates the header of an onion_lut blob.
+ * @return Length of header + entries (the action table follows), or 0 if the header is unusable or len is shorter.
+ */
+static size_t config_check_blob(const uint8_t *blob, size_t len, onion_config_header_t *header) {
+    if (len < sizeof(*header)) return 0;
+    memcpy(header, blob, sizeof(*header));
+
+    if (header->magic != ONION_CONFIG_MAGIC) return 0;
+    if (header->version < ONION_CONFIG_VERSION_RAW || header->version > ONION_CONFIG_VERSION) return 0;
+    if (header->channels == 0 || header->entry_size == 0) return 0;
+
+    size_t need = sizeof(*header) + (size_t)header->channels * header->entry_size;
+    return len >= need ? need : 0;
+}
+
+/**
+ * @brief Copies the entries of a checked blob into a draft table.
+ * * A blob written for a different channel count (a MUX added or removed) keeps the
+ * pads both layouts share; the remaining pads keep their current values. Builds
+ * without the absolute fallback give pads stored with delta 0 the default depth.
+ */
+static void config_copy_entries(onion_key_t *lut, const uint8_t *blob, const onion_config_header_t *header) {
+    size_t copy = header->entry_size < sizeof(onion_key_t) ? header->entry_size : sizeof(onion_key_t);
+    int channels = header->channels < MUX_CHANNELS_COUNT ? header->channels : MUX_CHANNELS_COUNT;
+
+    for (int i = 0; i < channels; i++) {
+        memcpy(&lut[i], blob + sizeof(*header) + (size_t)i * header->entry_size, copy);
+        if (header->version == ONION_CONFIG_VERSION_RAW) config_migrate_raw(i, &lut[i]);
+#if CONFIG_ONION_FILTER_ADAPTIVE
+        /* Written by a build that tested it against the absolute threshold: depth 0 would always trigger */
+        if (lut[i].delta == 0) lut[i].delta = DEFAULT_DELTA;
+#endif
+    }
+}
+
+/**
+ * @brief Loads the action table of the split layout into the draft; a missing or malformed one leaves it empty.
+ */
+static void config_load_legacy_actions(onion_action_table_t *actions) {
+    uint8_t *blob = malloc(ONION_ACTION_TABLE_MAX);
+    size_t len = ONION_ACTION_TABLE_MAX;
+    esp_err_t err = blob ? nvs_get_blob(nvs, NVS_KEY_ACT_LEGACY, blob, &len) : ESP_ERR_NO_MEM;
+
+    if (err == ESP_OK) {
+        legacy_act_stored = true;
+        /* Merged into the onion_lut blob with the next flush */
+        config_dirty = true;
+        if (!onion_action_table_load(actions, blob, len)) {
+            ESP_LOGW(TAG, "Stored action table is malformed, actions disabled.");
+        }
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Action table read failed (%s)", esp_err_to_name(err));
+    }
+    free(blob);
+}
+
+/**
+ * @brief Checks the tunables of every entry against the ranges the serial commands accept.
+ */
+static bool config_entries_valid(const onion_key_t *lut) {
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        if (lut[i].press_debounce < 1 || lut[i].press_debounce > ONION_DEBOUNCE_MAX) return false;
+        if (lut[i].release_debounce < 1 || lut[i].release_debounce > ONION_DEBOUNCE_MAX) return false;
+        if (lut[i].settle_samples >= ONION_SCAN_SAMPLES_PER_STEP) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Validates a stored blob and applies its entries and action table over the defaults.
+ * @return true if the blob was applied.
+ */
+static bool config_apply_blob(const uint8_t *blob, size_t len) {
+    onion_config_header_t header;
+    size_t blob_len = config_check_blob(blob, len, &header);
+
+    if (blob_len == 0) return false;
+    /* Older layouts end after the entries */
+    if (header.version < ONION_CONFIG_VERSION && blob_len != len) return false;
+
+    config_copy_entries(onion_lut_edit_begin(), blob, &header);
+    if (header.version < ONION_CONFIG_VERSION) {
+        config_load_legacy_actions(onion_lut_edit_actions());
+    } else if (!onion_action_table_load(onion_lut_edit_actions(), blob + blob_len, len - blob_len)) {
+        ESP_LOGW(TAG, "Stored action table is malformed, actions disabled.");
+    }
+    onion_lut_edit_commit();
+
+    if (header.version == ONION_CONFIG_VERSION_RAW) {
+        /* Rewritten in the new layout with the next flush */
+        ESP_LOGI(TAG, "Migrated stored thresholds from raw counts to mV.");
+        config_dirty = true;
+    }
+    return true;
+}
+
+/**
+ * FreeRTOS Task: onion_config_flush
+ * Waits for the first change, then keeps waiting until the configuration has
+ * been quiet for ONION_CONFIG_FLUSH_DELAY_MS before committing it once.
+ * FLUSH_NOTIFY_NOW skips the rest of the quiet window.
+ */
+static void onion_config_flush_task(void *pvParameters) {
+    while (1) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, portMAX_DELAY);
+        while (!(bits & FLUSH_NOTIFY_NOW) &&
+               xTaskNotifyWait(0, UINT32_MAX, &bits, pdMS_TO_TICKS(ONION_CONFIG_FLUSH_DELAY_MS)) == pdTRUE) {
+            /* Another change inside the window: restart the idle timeout */
+        }
+        onion_config_flush();
+    }
+}
+
+/**
+ * @brief Shutdown hook: commits pending changes before esp_restart().
+ */
+static void config_shutdown_handler(void) {
+    onion_config_flush();
+}
+
+int onion_config_init(void) {
+    esp_err_t err;
+
+    err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS partition layout changed, erasing.");
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err == ESP_OK) err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "NVS Open failed (%s). Fallback to hardcoded defaults.", esp_err_to_name(err));
+        return err;
+    }
+    nvs_ready = true;
+    nvs_lock = xSemaphoreCreateMutexStatic(&nvs_lock_buf);
+
+    uint8_t *blob = malloc(CONFIG_BLOB_MAX);
+    size_t required_size = CONFIG_BLOB_MAX;
+    err = blob ? nvs_get_blob(nvs, NVS_KEY_LUT, blob, &required_size) : ESP_ERR_NO_MEM;
+
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "Factory reset: No stored config. Provisioning NVS...");
+        onion_config_save();
+    } else if (err == ESP_OK && config_apply_blob(blob, required_size)) {
+        ESP_LOGI(TAG, "Configuration synced from NVS storage.");
+    } else if (err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH) {
+        ESP_LOGW(TAG, "Stored config has an unknown layout. Re-provisioning defaults...");
+        onion_config_save();
+    } else {
+        ESP_LOGE(TAG, "NVS Data Corruption (%s)", esp_err_to_name(err));
+    }
+    free(blob);
+
+    flush_task = xTaskCreateStatic(onion_config_flush_task, "config_flush", ONION_FLUSH_TASK_STACK, NULL, 1,
+                                   flush_task_stack, &flush_task_buf);
+    esp_register_shutdown_handler(config_shutdown_handler);
+    return ESP_OK;
+}
+
+void onion_config_mark_dirty(void) {
+    config_dirty = true;
+    if (flush_task) xTaskNotify(flush_task, FLUSH_NOTIFY_CHANGE, eSetBits);
+}
+
+void onion_config_flush_soon(void) {
+    if (flush_task && config_dirty) xTaskNotify(flush_task, FLUSH_NOTIFY_NOW, eSetBits);
+}
+
+int onion_config_flush(void) {
+    if (!nvs_ready || !config_dirty) return ESP_OK;
+
+    xSemaphoreTake(nvs_lock, portMAX_DELAY);
+    esp_err_t err = config_dirty ? config_write() : ESP_OK;
+    xSemaphoreGive(nvs_lock);
+    return err;
+}
+
+int onion_config_save(void) {
+    if (!nvs_ready) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(nvs_lock, portMAX_DELAY);
+    esp_err_t err = config_write();
+    xSemaphoreGive(nvs_lock);
+    return err;
+}
+
+size_t onion_config_export(uint8_t *out) {
+    size_t len = config_serialize(out);
+
+    uint16_t crc = onion_telemetry_crc16(0xFFFF, out, len);
+    out[len] = (uint8_t)(crc & 0xFF);
+    out[len + 1] = (uint8_t)(crc >> 8);
+    return len + 2;
+}
+
+int onion_config_import(const uint8_t *image, size_t len) {
+    onion_config_header_t header;
+
+    if (len < 2 || len > ONION_CONFIG_IMAGE_MAX) return ESP_ERR_INVALID_SIZE;
+    len -= 2;
+    uint16_t crc = (uint16_t)(image[len] | (image[len + 1] << 8));
+    if (onion_telemetry_crc16(0xFFFF, image, len) != crc) return ESP_ERR_INVALID_CRC;
+
+    /* Everything is checked before the draft is touched: a bad image changes nothing */
+    size_t blob_len = config_check_blob(image, len, &header);
+    if (blob_len == 0) return ESP_ERR_INVALID_ARG;
+    if (!onion_action_table_load(&import_actions, image + blob_len, len - blob_len)) return ESP_ERR_INVALID_ARG;
+    /* Pads the image does not cover keep their running values */
+    onion_lut_snapshot(import_lut);
+    config_copy_entries(import_lut, image, &header);
+    if (!config_entries_valid(import_lut)) return ESP_ERR_INVALID_ARG;
+
+    memcpy(onion_lut_edit_begin(), import_lut, sizeof(import_lut));
+    memcpy(onion_lut_edit_actions(), &import_actions, sizeof(import_actions));
+    onion_lut_edit_commit();
+
+    /* The engine takes the imported settle times now, as after SETTLE */
+    uint8_t settle[MUX_CHANNELS_COUNT];
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        settle[i] = import_lut[i].settle_samples;
+    }
+    esp_err_t err = onion_scan_set_settle(settle);
+    if (err != ESP_OK) ESP_LOGW(TAG, "Imported settle times not applied (%s)", esp_err_to_name(err));
+
+    /* Superseded by this write, so the flush task has nothing left to do */
+    return onion_config_save();
+}
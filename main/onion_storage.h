@@ -0,0 +1,103 @@
+/**
+ * @file onion_storage.h
+ * @brief Deferred, versioned NVS persistence of the onion_lut configuration.
+ *
+ * Configuration changes only mark the RAM copy dirty. A low-priority task
+ * commits it once no further change has arrived for ONION_CONFIG_FLUSH_DELAY_MS,
+ * so a calibration session with hundreds of SETs costs one flash write.
+ * Explicit saves (SAVE command) and restarts flush immediately. The NVS handle
+ * stays open for the lifetime of the firmware.
+ *
+ * Pads and actions are stored together in the onion_lut blob: the header,
+ * the entries, then the action table (see onion_action.h; the remaining
+ * bytes, none for an empty table). One nvs_set_blob() replaces both, so a
+ * power loss never leaves pads of one configuration with actions of another.
+ *
+ * The whole configuration also travels as one image for bulk provisioning
+ * (GETALL / SETALL): the stored blob followed by a CRC-16/CCITT-FALSE over
+ * it, little-endian.
+ */
+
+#ifndef ONION_STORAGE_H
+#define ONION_STORAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "onion_config.h"
+
+/** @brief Marker at the start of the stored blob ("ON"). */
+#define ONION_CONFIG_MAGIC   0x4E4F
+/** @brief Bump when onion_key_t changes incompatibly; appended fields need no bump. */
+#define ONION_CONFIG_VERSION 3
+/** @brief Last layout with the action table under its own key (onion_act); merged on the next write. */
+#define ONION_CONFIG_VERSION_SPLIT 2
+/** @brief Last layout with thresholds and deltas in raw ADC counts; migrated to mV on load. */
+#define ONION_CONFIG_VERSION_RAW 1
+
+/**
+ * @brief Header stored in front of the onion_lut entries.
+ *
+ * Entries are loaded field-prefix-wise: a blob written with a smaller
+ * entry_size (older firmware, fewer trailing fields) keeps the defaults of
+ * the new fields instead of being read as corrupt data.
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t magic;      /**< ONION_CONFIG_MAGIC */
+    uint8_t  version;    /**< ONION_CONFIG_VERSION of the writer */
+    uint8_t  channels;   /**< Number of entries that follow */
+    uint16_t entry_size; /**< sizeof(onion_key_t) of the writer */
+} onion_config_header_t;
+
+/** @brief Largest configuration image accepted by onion_config_import() (room for appended entry fields). */
+#define ONION_CONFIG_IMAGE_MAX (sizeof(onion_config_header_t) + MUX_CHANNELS_COUNT * 4 * sizeof(onion_key_t) + \
+                                ONION_ACTION_TABLE_MAX + 2)
+
+/**
+ * @brief Initializes the NVS partition, opens the namespace and loads the stored configuration.
+ * * Starts the deferred-commit task and registers a flush on restart.
+ * @return ESP_OK on success, or an NVS error code (defaults stay in effect).
+ */
+int onion_config_init(void);
+
+/**
+ * @brief Marks the RAM configuration as changed; it is committed after the idle timeout.
+ */
+void onion_config_mark_dirty(void);
+
+/**
+ * @brief Asks the flush task to commit pending changes without waiting for the idle timeout.
+ * @note Returns at once, so time-critical tasks can call it instead of onion_config_flush().
+ */
+void onion_config_flush_soon(void);
+
+/**
+ * @brief Commits the configuration now if it is dirty.
+ * @return ESP_OK on success or when there is nothing to write.
+ */
+int onion_config_flush(void);
+
+/**
+ * @brief Unconditionally writes and commits the current configuration.
+ * @return ESP_OK on success.
+ */
+int onion_config_save(void);
+
+/**
+ * @brief Serializes the running configuration into an image (header, entries, action table, CRC).
+ * @param out ONION_CONFIG_IMAGE_MAX bytes.
+ * @return Image length.
+ */
+size_t onion_config_export(uint8_t *out);
+
+/**
+ * @brief Validates an image, applies pads and actions as one configuration bank and commits it to NVS.
+ * * Debounce and settle values must be in the ranges DB: and SETTLE produce. The
+ * settle times take effect in the scan engine at once.
+ * @note Not reentrant; the command dispatcher serialises callers.
+ * @return ESP_OK on success; ESP_ERR_INVALID_SIZE, ESP_ERR_INVALID_CRC or ESP_ERR_INVALID_ARG
+ * leave the running configuration untouched; an NVS error means it is applied but not yet stored.
+ */
+int onion_config_import(const uint8_t *image, size_t len);
+
+#endif // ONION_STORAGE_H
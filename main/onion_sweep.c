@@ -0,0 +1,202 @@
+/**
+ * @file onion_sweep.c
+ * @brief Pinned sweep task and its esp_timer pacing.
+ */
+
+#include "onion_sweep.h"
+#include "onion_config.h"
+#include "onion_ble.h"
+#include "onion_touch.h"
+#include "onion_hid.h"
+#include "onion_action.h"
+#include "onion_link.h"
+#include "onion_power.h"
+#include "onion_telemetry.h"
+#include "onion_gatt_tlm.h"
+#include "onion_stats.h"
+#include "onion_evlog.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "host/ble_hs.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "ONION_SWEEP";
+
+static TaskHandle_t sweep_task = NULL;
+static StackType_t sweep_task_stack[ONION_SWEEP_TASK_STACK];
+static StaticTask_t sweep_task_buf;
+static esp_timer_handle_t sweep_timer = NULL;
+static uint32_t sweep_period_ms = 0;
+
+/** @brief esp_timer time of the most recent expiry (written by the timer callback). */
+static volatile int64_t tick_us = 0;
+
+static onion_sweep_stats_t stats;
+static onion_action_engine_t actions;
+
+/**
+ * @brief esp_timer callback: wakes the sweep task on the fixed grid.
+ * Dispatched from the timer ISR when supported, so the esp_timer task on the
+ * other core does not add its own scheduling delay.
+ */
+static void IRAM_ATTR sweep_tick(void *arg) {
+    tick_us = esp_timer_get_time();
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(sweep_task, &woken);
+    if (woken == pdTRUE) esp_timer_isr_dispatch_need_yield();
+#else
+    xTaskNotifyGive(sweep_task);
+#endif
+}
+
+/**
+ * @brief Restarts the pacing timer when the power state changed the scan period.
+ */
+static void sweep_apply_period(void) {
+    uint32_t period = onion_power_get_scan_period_ms();
+    if (period == sweep_period_ms) return;
+
+    sweep_period_ms = period;
+    esp_timer_stop(sweep_timer);
+    esp_timer_start_periodic(sweep_timer, (uint64_t)period * 1000);
+}
+
+/**
+ * @brief Spacing of macro steps: one per connection event of the (first) connected host.
+ */
+static uint32_t sweep_step_us(void) {
+    onion_link_params_t params;
+    if (!onion_link_get_params(&params) || params.interval == 0) return ONION_ACTION_DEFAULT_STEP_US;
+    return (uint32_t)params.interval * 1250;
+}
+
+static inline void stats_max(uint32_t *slot, int64_t value) {
+    if (value > 0 && (uint64_t)value > *slot) *slot = (uint32_t)value;
+}
+
+/**
+ * FreeRTOS Task: onion_sweep
+ * One sweep per timer expiry: every channel is sampled and classified exactly
+ * once, transitions go out as one HID report, then the power state machine
+ * decides the period of the next expiry.
+ */
+static void onion_sweep_task(void *pvParameters) {
+    onion_frame_t frame;
+    bool report_pending = false;
+
+    onion_action_init(&actions);
+
+    while (1) {
+        uint32_t ticks = 0;
+        while (ticks == 0 && onion_telemetry_is_binary()) {
+            /* The binary stream takes every engine sweep; only the timer-paced ones run the pipeline */
+            ticks = ulTaskNotifyTake(pdTRUE, 0);
+            if (ticks == 0 && onion_touch_sample(&frame, pdMS_TO_TICKS(20))) onion_telemetry_publish(&frame);
+        }
+        if (ticks == 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            int64_t wake_us = esp_timer_get_time() - tick_us;
+            stats_max(&stats.max_wake_us, wake_us);
+            onion_stats_record(ONION_STAT_WAKE, wake_us);
+        }
+        const int64_t start_us = tick_us;
+
+        /* One configuration bank for the whole cycle: SET/DB never land mid-sweep */
+        const onion_action_table_t *act;
+        const onion_key_t *lut = onion_lut_acquire(&act);
+        onion_power_sweep_begin();
+        bool swept = onion_touch_sweep(&frame, lut, pdMS_TO_TICKS(20));
+        onion_power_sweep_end();
+        if (!swept) {
+            onion_lut_release();
+            stats.timeouts++;
+            ESP_LOGW(TAG, "Scan engine sweep timeout");
+            continue;
+        }
+        if (stats.sweeps++ == 0) {
+            onion_evlog_record(frame.timestamp_us, ONION_EVLOG_BOOT_STAGE, ONION_BOOT_SCAN_LIVE, 0);
+            ESP_LOGI(TAG, "Pads live %lld ms after boot", (long long)(frame.timestamp_us / 1000));
+        }
+
+        /* Flight recorder: every debounced edge with the reading that caused it */
+        for (onion_mask_t edges = frame.changed_mask; edges != 0; edges &= edges - 1) {
+            const int ch = __builtin_ctz(edges);
+            const bool pressed = (frame.pressed_mask & ONION_MASK_BIT(ch)) != 0;
+            onion_evlog_record(frame.timestamp_us, pressed ? ONION_EVLOG_PRESS : ONION_EVLOG_RELEASE,
+                               (uint8_t)ch, frame.raw[ch]);
+        }
+
+        /* Tap/hold, layers, chords and macros; with an empty action table pads map 1:1 to keycodes */
+        onion_action_step(&actions, act, lut, frame.pressed_mask, frame.timestamp_us,
+                          sweep_step_us());
+
+        /** * @note Reports are only queued on state changes to prevent flooding
+         * the BLE stack; the whole state goes out as one notification.
+         */
+        bool resubmit = report_pending || onion_ble_report_resync_due();
+        if (onion_action_peek(&actions) != NULL || resubmit) {
+            int64_t submit_us = ONION_STATS_NOW();
+            const onion_hid_report_t *report;
+            int rc = 0;
+
+            /* Queue the HID reports for the BLE host in order; on backpressure retry next sweep */
+            while ((report = onion_action_peek(&actions)) != NULL &&
+                   (rc = send_key_report(report, start_us)) != BLE_HS_EBUSY) {
+                onion_action_pop(&actions);
+            }
+            /* A new host (or a rejected state) gets the current state even without a change */
+            if (rc != BLE_HS_EBUSY && resubmit) rc = send_key_report(onion_action_state(&actions), start_us);
+            report_pending = (rc == BLE_HS_EBUSY);
+            if (report_pending) onion_evlog_record(esp_timer_get_time(), ONION_EVLOG_REPORT_BUSY, 0, 0);
+            onion_stats_record(ONION_STAT_SUBMIT, ONION_STATS_NOW() - submit_us);
+            stats_max(&stats.max_cycle_us, esp_timer_get_time() - start_us);
+
+            ESP_LOGD(TAG, "Pressed mask: 0x%0*lx", MUX_CHANNELS_COUNT / 4, (unsigned long)frame.pressed_mask);
+        }
+
+        onion_lut_release();
+
+        /* Hand the sweep to the serial binary stream and the BLE stream (each a no-op unless active) */
+        onion_telemetry_publish(&frame);
+        onion_gatt_tlm_publish(&frame);
+
+        /* Power State Machine: active 10 ms grid, standby 50 ms grid with light sleep in between */
+        onion_power_update(&frame);
+        sweep_apply_period();
+    }
+}
+
+int onion_sweep_start(void) {
+    const esp_timer_create_args_t timer_args = {
+        .callback = sweep_tick,
+        .name = "sweep",
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+        .dispatch_method = ESP_TIMER_ISR,
+#endif
+        .skip_unhandled_events = true,
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &sweep_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Sweep timer creation failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+
+    sweep_task = xTaskCreateStaticPinnedToCore(onion_sweep_task, "onion_sweep", ONION_SWEEP_TASK_STACK, NULL,
+                                               ONION_SWEEP_TASK_PRIO, sweep_task_stack, &sweep_task_buf,
+                                               ONION_SWEEP_TASK_CORE);
+    sweep_apply_period();
+    return ESP_OK;
+}
+
+void onion_sweep_get_stats(onion_sweep_stats_t *out, bool reset) {
+    *out = stats;
+    if (reset) {
+        stats.max_wake_us = 0;
+        stats.max_cycle_us = 0;
+    }
+}
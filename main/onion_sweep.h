@@ -0,0 +1,43 @@
+/**
+ * @file onion_sweep.h
+ * @brief Timer-paced input pipeline: sweep, classify, dispatch HID report, telemetry, power.
+ *
+ * The pipeline runs in its own task pinned to the core that does not run the
+ * BT controller (ONION_SWEEP_TASK_CORE), above the NimBLE host and serial
+ * tasks. A periodic esp_timer notifies it at the scan period of the current
+ * power state, so sweeps start on a fixed grid instead of after a tick-granular
+ * vTaskDelay. With the binary telemetry stream active the task also streams
+ * the engine sweeps between two expiries; they skip the pipeline, so debounce
+ * counts and other per-sweep constants keep their meaning while streaming.
+ */
+
+#ifndef ONION_SWEEP_H
+#define ONION_SWEEP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Worst-case timings observed by the sweep task since the last reset.
+ */
+typedef struct {
+    uint32_t max_wake_us;   /**< Timer expiry until the task ran */
+    uint32_t max_cycle_us;  /**< Timer expiry until the HID report was handed to the BLE queue */
+    uint32_t sweeps;        /**< Sweeps processed */
+    uint32_t timeouts;      /**< Sweeps the scan engine failed to deliver */
+} onion_sweep_stats_t;
+
+/**
+ * @brief Creates the pacing timer and starts the pinned sweep task.
+ * @note The scan engine, BLE and power manager must already be initialized.
+ * @return ESP_OK on success, or an error code.
+ */
+int onion_sweep_start(void);
+
+/**
+ * @brief Copies the timing statistics.
+ * @param reset Clears the maxima after reading.
+ */
+void onion_sweep_get_stats(onion_sweep_stats_t *out, bool reset);
+
+#endif // ONION_SWEEP_H
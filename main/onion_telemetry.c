@@ -0,0 +1,265 @@
+/**
+ * @file onion_telemetry.c
+ * @brief COBS/CRC16 packet framing and the telemetry TX task (binary and ASCII).
+ */
+
+#include "onion_telemetry.h"
+#include "onion_config.h"
+#include "onion_link.h"
+#include "onion_debounce.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include "string.h"
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+#include "driver/usb_serial_jtag.h"
+#else
+#include "driver/uart.h"
+#endif
+
+/** @brief Header (type + seq) and CRC around the payload. */
+#define TLM_RAW_MAX     (3 + ONION_TLM_MAX_PAYLOAD + 2)
+/** @brief COBS adds one byte per 254 plus the leading code byte, then the delimiter. */
+#define TLM_ENCODED_MAX (TLM_RAW_MAX + (TLM_RAW_MAX / 254) + 2)
+
+/** @brief TX queue item: a sweep to encode, or an ASCII pacing tick carrying a snapshot. */
+typedef struct {
+    bool ascii;
+    onion_tlm_frame_t frame;
+} tlm_item_t;
+
+static QueueHandle_t frame_queue = NULL;
+static StaticQueue_t frame_queue_buf;
+static uint8_t frame_queue_storage[ONION_TLM_QUEUE_LEN * sizeof(tlm_item_t)];
+static StackType_t tx_task_stack[ONION_TLM_TX_STACK];
+static StaticTask_t tx_task_buf;
+static esp_timer_handle_t ascii_timer = NULL;
+static bool streaming = false;
+static bool binary_mode = false;
+static uint16_t tx_seq = 0;
+static uint32_t tx_drops = 0;
+
+uint16_t onion_telemetry_crc16(uint16_t crc, const uint8_t *data, size_t len) {
+    static const uint16_t nibble_table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+        0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    };
+    for (size_t i = 0; i < len; i++) {
+        crc = (uint16_t)((crc << 4) ^ nibble_table[(crc >> 12) ^ (data[i] >> 4)]);
+        crc = (uint16_t)((crc << 4) ^ nibble_table[(crc >> 12) ^ (data[i] & 0x0F)]);
+    }
+    return crc;
+}
+
+size_t onion_telemetry_encode(uint8_t type, uint16_t seq, const void *payload, size_t len,
+                              uint8_t *out, size_t out_max) {
+    uint8_t raw[TLM_RAW_MAX];
+
+    if (len > ONION_TLM_MAX_PAYLOAD) return 0;
+    if (out_max < len + 5 + ((len + 5) / 254) + 2) return 0;
+
+    raw[0] = type;
+    raw[1] = (uint8_t)(seq & 0xFF);
+    raw[2] = (uint8_t)(seq >> 8);
+    memcpy(&raw[3], payload, len);
+    uint16_t crc = onion_telemetry_crc16(0xFFFF, raw, len + 3);
+    raw[len + 3] = (uint8_t)(crc & 0xFF);
+    raw[len + 4] = (uint8_t)(crc >> 8);
+
+    /* COBS: every zero is replaced by the distance to the next zero */
+    size_t raw_len = len + 5;
+    size_t code_pos = 0;
+    size_t o = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < raw_len; i++) {
+        if (raw[i] == 0x00) {
+            out[code_pos] = code;
+            code_pos = o++;
+            code = 1;
+        } else {
+            out[o++] = raw[i];
+            if (++code == 0xFF) {
+                out[code_pos] = code;
+                code_pos = o++;
+                code = 1;
+            }
+        }
+    }
+    out[code_pos] = code;
+    out[o++] = 0x00;
+    return o;
+}
+
+/**
+ * @brief Writes bytes straight to the console driver, bypassing stdio.
+ */
+static int console_write(const uint8_t *buf, size_t len) {
+#if CONFIG_ESP_CONSOLE_USB_SERIAL_JTAG
+    return usb_serial_jtag_write_bytes(buf, len, portMAX_DELAY);
+#else
+    return uart_write_bytes(CONFIG_ESP_CONSOLE_UART_NUM, buf, len);
+#endif
+}
+
+int onion_telemetry_send(uint8_t type, const void *payload, size_t len) {
+    uint8_t buf[TLM_ENCODED_MAX];
+
+    uint16_t seq = __atomic_fetch_add(&tx_seq, 1, __ATOMIC_RELAXED);
+    size_t n = onion_telemetry_encode(type, seq, payload, len, buf, sizeof(buf));
+    if (n == 0) return ESP_ERR_INVALID_SIZE;
+    return (console_write(buf, n) == (int)n) ? ESP_OK : ESP_FAIL;
+}
+
+void onion_telemetry_report_link(void) {
+    onion_link_params_t params = {0};
+    onion_link_get_params(&params);
+
+    if (binary_mode) {
+        onion_tlm_link_t pkt = {
+            .interval_us = params.interval * 1250u,
+            .latency = params.latency,
+            .timeout_ms = params.timeout * 10u,
+            .tx_phy = params.tx_phy,
+            .rx_phy = params.rx_phy,
+            .tx_octets = params.tx_octets,
+            .rx_octets = params.rx_octets,
+        };
+        onion_telemetry_send(ONION_TLM_PKT_LINK, &pkt, sizeof(pkt));
+        return;
+    }
+    printf("LINK:%u,%u,%u,%u,%u,%u,%u\n", params.interval * 1250u, params.latency, params.timeout * 10u,
+           params.tx_phy, params.rx_phy, params.tx_octets, params.rx_octets);
+    fflush(stdout);
+}
+
+void onion_telemetry_report_bounces(void) {
+    onion_tlm_bounce_t pkt;
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        pkt.count[i] = onion_debounce_get_bounces(i);
+    }
+
+    if (binary_mode) {
+        onion_telemetry_send(ONION_TLM_PKT_BOUNCE, &pkt, sizeof(pkt));
+        return;
+    }
+    char buf[8 + MUX_CHANNELS_COUNT * 11];
+    int n = snprintf(buf, sizeof(buf), "BOUNCE:");
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%lu%s", (unsigned long)pkt.count[i],
+                      (i == MUX_CHANNELS_COUNT - 1) ? "\n" : ",");
+    }
+    console_write((const uint8_t *)buf, (size_t)n);
+}
+
+/**
+ * @brief Formats the legacy "RAW:v0,...,v15" line into one buffer and writes it once.
+ */
+static void tlm_write_ascii(const onion_tlm_frame_t *pkt) {
+    char buf[8 + MUX_CHANNELS_COUNT * 6];
+    int n = snprintf(buf, sizeof(buf), "RAW:");
+    for (int i = 0; i < MUX_CHANNELS_COUNT; i++) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%u%s", pkt->raw[i], (i == MUX_CHANNELS_COUNT - 1) ? "\n" : ",");
+    }
+    console_write((const uint8_t *)buf, (size_t)n);
+}
+
+/**
+ * @brief esp_timer callback: paces the ASCII stream at ONION_TLM_ASCII_PERIOD_MS.
+ */
+static void tlm_ascii_tick(void *arg) {
+    tlm_item_t item = { .ascii = true };
+    onion_frame_t frame;
+    if (!onion_touch_get_frame(&frame)) return;
+
+    item.frame.timestamp_us = (uint32_t)frame.timestamp_us;
+    memcpy(item.frame.raw, frame.raw, sizeof(item.frame.raw));
+    item.frame.pressed_mask = frame.pressed_mask;
+    if (xQueueSend(frame_queue, &item, 0) != pdTRUE) {
+        tx_drops++;
+    }
+}
+
+/**
+ * FreeRTOS Task: telemetry_tx
+ * Blocks on the TX queue. Binary mode writes every published sweep as one
+ * packet, so the stream follows the scan rate; ASCII mode writes one line
+ * per timer tick.
+ */
+static void onion_telemetry_tx_task(void *pvParameters) {
+    tlm_item_t item;
+
+    while (1) {
+        if (xQueueReceive(frame_queue, &item, portMAX_DELAY) != pdTRUE) continue;
+        if (!streaming) continue;
+
+        if (onion_link_take_changed()) {
+            onion_telemetry_report_link();
+        }
+        if (item.ascii) {
+            tlm_write_ascii(&item.frame);
+        } else {
+            onion_telemetry_send(ONION_TLM_PKT_FRAME, &item.frame, sizeof(item.frame));
+        }
+    }
+}
+
+int onion_telemetry_init(void) {
+    frame_queue = xQueueCreateStatic(ONION_TLM_QUEUE_LEN, sizeof(tlm_item_t), frame_queue_storage, &frame_queue_buf);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = tlm_ascii_tick,
+        .name = "tlm_ascii",
+        .skip_unhandled_events = true,
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &ascii_timer);
+    if (err != ESP_OK) return err;
+
+    xTaskCreateStatic(onion_telemetry_tx_task, "telemetry_tx", ONION_TLM_TX_STACK, NULL, 4,
+                      tx_task_stack, &tx_task_buf);
+    return ESP_OK;
+}
+
+void onion_telemetry_start(bool binary) {
+    esp_timer_stop(ascii_timer);
+    xQueueReset(frame_queue);
+    binary_mode = binary;
+    streaming = true;
+
+    onion_link_take_changed();
+    onion_telemetry_report_link();
+    if (!binary) {
+        esp_timer_start_periodic(ascii_timer, (uint64_t)ONION_TLM_ASCII_PERIOD_MS * 1000);
+    }
+}
+
+void onion_telemetry_stop(void) {
+    streaming = false;
+    binary_mode = false;
+    esp_timer_stop(ascii_timer);
+    xQueueReset(frame_queue);
+}
+
+bool onion_telemetry_is_binary(void) {
+    return streaming && binary_mode;
+}
+
+void onion_telemetry_publish(const onion_frame_t *frame) {
+    if (!streaming || !binary_mode) return;
+
+    tlm_item_t item = { .ascii = false };
+    item.frame.timestamp_us = (uint32_t)frame->timestamp_us;
+    memcpy(item.frame.raw, frame->raw, sizeof(item.frame.raw));
+    item.frame.pressed_mask = frame->pressed_mask;
+
+    if (xQueueSend(frame_queue, &item, 0) != pdTRUE) {
+        tx_drops++;
+    }
+}
+
+uint32_t onion_telemetry_get_drops(void) {
+    return tx_drops;
+}
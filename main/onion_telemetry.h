@@ -0,0 +1,126 @@
+/**
+ * @file onion_telemetry.h
+ * @brief Binary framed telemetry stream for the OnionConfigurator.
+ *
+ * Every packet is [type, seq_lo, seq_hi, payload..., crc_lo, crc_hi], with a
+ * CRC-16/CCITT-FALSE over type, seq and payload. Packets are COBS-encoded and
+ * terminated by a 0x00 byte, so the host can resynchronise on any delimiter
+ * (e.g. after log output interleaved on the same port). All multi-byte fields
+ * are little-endian. Packets are written straight to the console driver
+ * (UART or USB-Serial-JTAG), bypassing stdio.
+ */
+
+#ifndef ONION_TELEMETRY_H
+#define ONION_TELEMETRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "onion_config.h"
+#include "onion_touch.h"
+
+/* --- Packet types --- */
+#define ONION_TLM_PKT_FRAME 0x01 /**< onion_tlm_frame_t: one sensor sweep */
+#define ONION_TLM_PKT_LINK  0x02 /**< onion_tlm_link_t: negotiated BLE connection parameters */
+#define ONION_TLM_PKT_BOUNCE 0x03 /**< onion_tlm_bounce_t: rejected debounce transitions */
+
+/** @brief Largest payload accepted by onion_telemetry_send() (a bounce table plus headroom). */
+#define ONION_TLM_MAX_PAYLOAD (MUX_CHANNELS_COUNT * 4 + 32)
+
+/**
+ * @brief Payload of ONION_TLM_PKT_FRAME.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp_us;              /**< Low 32 bits of the sweep timestamp */
+    uint16_t raw[MUX_CHANNELS_COUNT];   /**< Calibrated reading per channel, in mV */
+    onion_mask_t pressed_mask;          /**< Bit n set while channel n is touched */
+} onion_tlm_frame_t;
+
+/**
+ * @brief Payload of ONION_TLM_PKT_LINK.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t interval_us;
+    uint16_t latency;
+    uint16_t timeout_ms;
+    uint8_t  tx_phy;     /**< 1 = 1M, 2 = 2M, 3 = Coded */
+    uint8_t  rx_phy;
+    uint16_t tx_octets;  /**< Negotiated LL payload per PDU */
+    uint16_t rx_octets;
+} onion_tlm_link_t;
+
+/**
+ * @brief Payload of ONION_TLM_PKT_BOUNCE.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t count[MUX_CHANNELS_COUNT]; /**< Rejected bounces per channel since boot */
+} onion_tlm_bounce_t;
+
+/**
+ * @brief Creates the TX queue, the ASCII pacing timer and the TX task.
+ * @note The console driver must already be installed (see onion_comms_init()).
+ * @return ESP_OK on success, or an error code.
+ */
+int onion_telemetry_init(void);
+
+/**
+ * @brief Starts streaming: ASCII "RAW:" lines paced by a timer, or binary packets per sweep.
+ * Reports the current link parameters first.
+ */
+void onion_telemetry_start(bool binary);
+
+/**
+ * @brief Stops the stream and discards queued output.
+ */
+void onion_telemetry_stop(void);
+
+/**
+ * @brief Reports the negotiated BLE connection parameters and radio settings
+ * ("LINK:itvl_us,latency,timeout_ms,tx_phy,rx_phy,tx_octets,rx_octets", all 0 without a host).
+ * Sent as an ONION_TLM_PKT_LINK packet while the binary stream is active.
+ */
+void onion_telemetry_report_link(void);
+
+/**
+ * @brief Reports the rejected-bounce counters ("BOUNCE:n0,...,n15").
+ * Sent as an ONION_TLM_PKT_BOUNCE packet while the binary stream is active.
+ */
+void onion_telemetry_report_bounces(void);
+
+/**
+ * @brief Returns true while the binary stream is negotiated.
+ */
+bool onion_telemetry_is_binary(void);
+
+/**
+ * @brief Hands a sweep to the TX task (non-blocking, drops the frame if the queue is full).
+ * @note Does nothing unless the binary stream is active.
+ */
+void onion_telemetry_publish(const onion_frame_t *frame);
+
+/**
+ * @brief Frames and writes one packet to the console driver.
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if the payload is too long, or ESP_FAIL on a write error.
+ */
+int onion_telemetry_send(uint8_t type, const void *payload, size_t len);
+
+/**
+ * @brief Builds a COBS-encoded, 0x00-terminated packet.
+ * @param out Destination buffer.
+ * @param out_max Capacity of the destination buffer.
+ * @return Encoded length including the delimiter, or 0 if out is too small.
+ */
+size_t onion_telemetry_encode(uint8_t type, uint16_t seq, const void *payload, size_t len,
+                              uint8_t *out, size_t out_max);
+
+/**
+ * @brief CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF).
+ */
+uint16_t onion_telemetry_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+/**
+ * @brief Number of frames or ticks dropped because the TX queue was full.
+ */
+uint32_t onion_telemetry_get_drops(void);
+
+#endif // ONION_TELEMETRY_H
@@ -1,137 +1,261 @@
 /**
  * @file onion_touch.c
- * @brief Implementation of touch sensing, multiplexer control, and NVS configuration.
+ * @brief Implementation of touch sensing and multiplexer control.
  */
 
 #include "onion_touch.h"
 #include "onion_config.h"
-#include "onion_ble.h"
+#include "onion_scan.h"
+#include "onion_cali.h"
+#include "onion_baseline.h"
+#include "onion_debounce.h"
+#include "onion_stats.h"
 #include "driver/gpio.h"
-#include "driver/adc.h"
-#include "esp_rom_sys.h"
-#include "nvs_flash.h"
-#include "nvs.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "string.h"
 
-/* Logging and NVS Storage constants */
-static const char *TAG = "ONION_CONFIG";
-static const char *NVS_NAMESPACE = "onion_storage";
-static const char *NVS_KEY_LUT = "onion_lut";
+static const char *TAG = "ONION_TOUCH";
 
-/** * @brief Internal state tracker to identify changes between polling cycles.
+/** * @brief Pressed mask of the previous frame, used to derive changed_mask.
  */
-static bool last_states[16] = {0};
+static onion_mask_t last_pressed_mask = 0;
+
+/** @brief Undebounced detector output of the previous frame (baseline hysteresis state). */
+static onion_mask_t last_detect_mask = 0;
+
+/** @brief Table entry with the default threshold, baseline delta, debounce and settle settings. */
+#define ONION_KEY(code) { code, DEFAULT_THRESHOLD, DEFAULT_DELTA, DEFAULT_PRESS_DEBOUNCE, \
+                          DEFAULT_RELEASE_DEBOUNCE, ONION_SCAN_SETTLE_SAMPLES }
 
 /**
- * @brief Default Lookup Table (LUT) containing HID keycodes and touch thresholds.
- * @note This table is overwritten if valid data is found in NVS.
+ * @brief Configuration banks: one is active (read-only), the other is the writers' draft.
+ * @note Bank 0 holds the defaults until onion_config_init() swaps in the NVS content.
  */
-onion_key_t onion_lut[16] = {
-    {0x1A, DEFAULT_THRESHOLD, false}, {0x16, DEFAULT_THRESHOLD, false}, {0x04, DEFAULT_THRESHOLD, false}, {0x07, DEFAULT_THRESHOLD, false},
-    {0x2C, DEFAULT_THRESHOLD, false}, {0x08, DEFAULT_THRESHOLD, false}, {0x0B, DEFAULT_THRESHOLD, false}, {0x0A, DEFAULT_THRESHOLD, false},
-    {0x14, DEFAULT_THRESHOLD, false}, {0x2B, DEFAULT_THRESHOLD, false}, {0x4F, DEFAULT_THRESHOLD, false}, {0x50, DEFAULT_THRESHOLD, false},
-    {0x52, DEFAULT_THRESHOLD, false}, {0x51, DEFAULT_THRESHOLD, false}, {0x1F, DEFAULT_THRESHOLD, false}, {0x29, DEFAULT_THRESHOLD, false}
+static onion_key_t lut_bank[2][MUX_CHANNELS_COUNT] = {
+    {
+        ONION_KEY(0x1A), ONION_KEY(0x16), ONION_KEY(0x04), ONION_KEY(0x07),
+        ONION_KEY(0x2C), ONION_KEY(0x08), ONION_KEY(0x0B), ONION_KEY(0x0A),
+        ONION_KEY(0x14), ONION_KEY(0x2B), ONION_KEY(0x4F), ONION_KEY(0x50),
+        ONION_KEY(0x52), ONION_KEY(0x51), ONION_KEY(0x1F), ONION_KEY(0x29),
+#if MUX_CHANNELS_COUNT > 16
+        /* Pads on additional multiplexers start unassigned */
+        [16 ... MUX_CHANNELS_COUNT - 1] = ONION_KEY(0x00),
+#endif
+    },
 };
+/** @brief Action tables of the two banks (empty until onion_config_init() loads one). */
+static onion_action_table_t act_bank[2];
+static int lut_active = 0;
+/** @brief Bank the sweep task is classifying with, or -1 between sweeps. */
+static int lut_in_use = -1;
+static SemaphoreHandle_t lut_lock = NULL;
+static StaticSemaphore_t lut_lock_buf;
+
+/** @brief Working copy of the newest conversion code per channel (sweep task only). */
+static uint16_t last_raw_values[MUX_CHANNELS_COUNT];
+
+/**
+ * @brief Seqlock-published copy of the last classified frame.
+ * frame_seq is odd while the sweep task rewrites published_frame.
+ */
+static onion_frame_t published_frame;
+static uint32_t frame_seq = 0;
+
+/** @brief GPIO bank-0 output bits that select a MUX address. */
+#define MUX_ADDR_BITS(a) ((((a) >> 0) & 1u) << MUX_S0 | (((a) >> 1) & 1u) << MUX_S1 | \
+                          (((a) >> 2) & 1u) << MUX_S2 | (((a) >> 3) & 1u) << MUX_S3)
+
+_Static_assert(MUX_S0 < 32 && MUX_S1 < 32 && MUX_S2 < 32 && MUX_S3 < 32,
+               "MUX select lines must share the first GPIO output register");
+
+static const DRAM_ATTR uint32_t mux_addr_bits[16] = {
+    MUX_ADDR_BITS(0),  MUX_ADDR_BITS(1),  MUX_ADDR_BITS(2),  MUX_ADDR_BITS(3),
+    MUX_ADDR_BITS(4),  MUX_ADDR_BITS(5),  MUX_ADDR_BITS(6),  MUX_ADDR_BITS(7),
+    MUX_ADDR_BITS(8),  MUX_ADDR_BITS(9),  MUX_ADDR_BITS(10), MUX_ADDR_BITS(11),
+    MUX_ADDR_BITS(12), MUX_ADDR_BITS(13), MUX_ADDR_BITS(14), MUX_ADDR_BITS(15),
+};
+
+/** @brief Select bits currently driven (only the lines that change are written). */
+static uint32_t mux_out_bits = 0;
 
 /**
- * @brief Switches the 16-channel multiplexer to the requested channel.
- * @param addr Target channel address (0-15).
+ * @brief Switches every multiplexer to the requested address (shared select lines).
+ * @note Called from the scan engine ISR; settling is handled by the engine
+ *       discarding the leading samples of each step, so no delay here.
+ *       Lines are written through the set/clear registers, so a Gray-code
+ *       step costs one register write and no intermediate address appears.
+ * @param addr Target MUX address (0-15).
  */
-void set_mux_address(uint8_t addr) {
-    gpio_set_level(MUX_S0, (addr >> 0) & 0x01);
-    gpio_set_level(MUX_S1, (addr >> 1) & 0x01);
-    gpio_set_level(MUX_S2, (addr >> 2) & 0x01);
-    gpio_set_level(MUX_S3, (addr >> 3) & 0x01);
+void IRAM_ATTR set_mux_address(uint8_t addr) {
+    const uint32_t bits = mux_addr_bits[addr & 0x0F];
+    const uint32_t set = bits & ~mux_out_bits;
+    const uint32_t clr = mux_out_bits & ~bits;
 
-    esp_rom_delay_us(100);
+    /* Register addresses rather than the GPIO struct: its fields are plain words only on the classic ESP32 */
+    if (set) REG_WRITE(GPIO_OUT_W1TS_REG, set);
+    if (clr) REG_WRITE(GPIO_OUT_W1TC_REG, clr);
+    mux_out_bits = bits;
 }
 
 /**
- * @brief Performs a raw touch read on a specific MUX channel.
- * @param channel The MUX channel to evaluate.
- * @return true if touched (raw value < threshold), false otherwise.
+ * @brief Spreads address steps from the scan engine over the channels of every MUX.
  */
-bool onion_touch_read(uint8_t channel) {
-    set_mux_address(channel);
-    
-    esp_rom_delay_us(20); 
-
-    uint32_t raw_sum = 0;
-    for(int i = 0; i < 4; i++) {
-        raw_sum += adc1_get_raw(MUX_INPUT_PIN);
+static void onion_touch_latch(const onion_scan_sample_t *samples, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        for (int m = 0; m < ONION_MUX_COUNT; m++) {
+            last_raw_values[m * ONION_MUX_ADDRESSES + samples[i].addr] = samples[i].value[m];
+        }
     }
-    uint16_t adc_raw = (uint16_t)(raw_sum >> 2);
-    
-    last_raw_values[channel] = adc_raw;
-    
-    return (adc_raw < onion_lut[channel].threshold);
 }
 
 /**
- * @brief State-machine helper to detect press/release transitions.
- * @param channel The MUX channel to check.
- * @return true if the state changed since the last call.
+ * @brief Latches the newest complete sweep from the scan engine into last_raw_values.
+ * @param timeout Maximum time to wait for each sweep boundary, in ticks.
+ * @return true once every MUX address has been re-sampled.
  */
-bool onion_touch_has_changed(uint8_t channel) {
-    bool current_state = onion_touch_read(channel);
-    if (current_state != last_states[channel]) {
-        last_states[channel] = current_state;
-        return true;
+static bool onion_touch_sync(TickType_t timeout) {
+    static onion_scan_sample_t samples[ONION_SCAN_RING_LEN];
+    size_t n, fresh = 0;
+
+    /* Apply whatever is buffered, then collect until every address has been re-sampled */
+    onion_scan_clear_sweep();
+    n = onion_scan_read(samples, ONION_SCAN_RING_LEN);
+    onion_touch_latch(samples, n);
+
+    while (fresh < ONION_MUX_ADDRESSES) {
+        if (!onion_scan_wait_sweep(timeout)) return false;
+        n = onion_scan_read(samples, ONION_SCAN_RING_LEN);
+        onion_touch_latch(samples, n);
+        fresh += n;
     }
-    return false;
+    return true;
 }
 
 /**
- * @brief Opens NVS and loads the onion_lut blob.
- * @return ESP_OK on success, or appropriate error code.
+ * @brief Captures one sweep and classifies every channel exactly once.
+ * @param frame Output frame.
+ * @param timeout Maximum time to wait for the scan engine, in ticks.
+ * @return true if the frame is valid.
  */
-int onion_config_init(void){
-    nvs_handle_t handle;
-    esp_err_t err;
+bool onion_touch_sweep(onion_frame_t *frame, const onion_key_t *lut, TickType_t timeout) {
+    int64_t t0 = ONION_STATS_NOW();
+    if (!onion_touch_sync(timeout)) return false;
+    int64_t t1 = ONION_STATS_NOW();
+    onion_stats_record(ONION_STAT_ACQUIRE, t1 - t0);
 
-    /* Initialize NVS partition if not already done by app_main */
-    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGW(TAG, "NVS Open failed (%s). Fallback to hardcoded defaults.", esp_err_to_name(err));
-        return err;
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        frame->raw[ch] = onion_cali_raw_to_mv(ch, last_raw_values[ch]);
     }
+    frame->timestamp_us = esp_timer_get_time();
+    last_detect_mask = onion_baseline_process(frame->raw, last_detect_mask, lut, frame->timestamp_us);
+    onion_mask_t mask = onion_debounce_process(last_detect_mask, lut);
+    onion_stats_record(ONION_STAT_CLASSIFY, ONION_STATS_NOW() - t1);
+
+    frame->pressed_mask = mask;
+    frame->changed_mask = mask ^ last_pressed_mask;
+    frame->detect_mask = last_detect_mask;
+    __atomic_store_n(&last_pressed_mask, mask, __ATOMIC_RELAXED);
 
-    size_t required_size = sizeof(onion_lut);
-    err = nvs_get_blob(handle, NVS_KEY_LUT, onion_lut, &required_size);
-    
-    if (err == ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGI(TAG, "Factory reset: No stored config. Provisioning NVS...");
-        onion_config_save();
-    } else if (err != ESP_OK) {
-        ESP_LOGE(TAG, "NVS Data Corruption (%s)", esp_err_to_name(err));
-    } else {
-        ESP_LOGI(TAG, "Configuration synced from NVS storage.");
+    /* Publish for readers on other tasks; they retry instead of blocking us */
+    __atomic_store_n(&frame_seq, frame_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    published_frame = *frame;
+    __atomic_store_n(&frame_seq, frame_seq + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool onion_touch_sample(onion_frame_t *frame, TickType_t timeout) {
+    if (!onion_touch_sync(timeout)) return false;
+
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        frame->raw[ch] = onion_cali_raw_to_mv(ch, last_raw_values[ch]);
     }
+    frame->pressed_mask = __atomic_load_n(&last_pressed_mask, __ATOMIC_RELAXED);
+    frame->changed_mask = 0;
+    frame->detect_mask = last_detect_mask;
+    frame->timestamp_us = esp_timer_get_time();
+    return true;
+}
 
-    nvs_close(handle);
-    return ESP_OK;
+bool onion_touch_get_frame(onion_frame_t *out) {
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&frame_seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) return false;
+        *out = published_frame;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&frame_seq, __ATOMIC_RELAXED));
+    return true;
 }
 
-/**
- * @brief Commits the current onion_lut state to persistent storage.
- * @return ESP_OK on success.
- */
-int onion_config_save(void) {
-    nvs_handle_t handle;
-    esp_err_t err;
+onion_mask_t onion_touch_get_pressed_mask(void) {
+    return __atomic_load_n(&last_pressed_mask, __ATOMIC_RELAXED);
+}
+
+/* --- Configuration bank swap --- */
 
-    err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
-    if (err != ESP_OK) return err;
+void onion_lut_init(void) {
+    lut_lock = xSemaphoreCreateMutexStatic(&lut_lock_buf);
+}
+
+const onion_key_t *onion_lut_acquire(const onion_action_table_t **actions) {
+    int bank;
 
-    err = nvs_set_blob(handle, NVS_KEY_LUT, onion_lut, sizeof(onion_lut));
-    if (err == ESP_OK) {
-        err = nvs_commit(handle);
-        ESP_LOGI(TAG, "Flash update successful.");
+    /* Re-check after announcing, so a concurrent swap cannot hand out a bank being rewritten */
+    do {
+        bank = __atomic_load_n(&lut_active, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&lut_in_use, bank, __ATOMIC_SEQ_CST);
+    } while (bank != __atomic_load_n(&lut_active, __ATOMIC_SEQ_CST));
+    *actions = &act_bank[bank];
+    return lut_bank[bank];
+}
+
+void onion_lut_release(void) {
+    __atomic_store_n(&lut_in_use, -1, __ATOMIC_SEQ_CST);
+}
+
+onion_key_t *onion_lut_edit_begin(void) {
+    xSemaphoreTake(lut_lock, portMAX_DELAY);
+
+    int draft = !lut_active;
+    /* The previous active bank may still be classifying the current sweep */
+    while (__atomic_load_n(&lut_in_use, __ATOMIC_SEQ_CST) == draft) {
+        vTaskDelay(1);
     }
+    memcpy(lut_bank[draft], lut_bank[lut_active], sizeof(lut_bank[0]));
+    memcpy(&act_bank[draft], &act_bank[lut_active], sizeof(act_bank[0]));
+    return lut_bank[draft];
+}
 
-    nvs_close(handle);
-    return err;
+void onion_lut_edit_commit(void) {
+    __atomic_store_n(&lut_active, !lut_active, __ATOMIC_SEQ_CST);
+    xSemaphoreGive(lut_lock);
+}
+
+void onion_lut_snapshot(onion_key_t out[MUX_CHANNELS_COUNT]) {
+    xSemaphoreTake(lut_lock, portMAX_DELAY);
+    memcpy(out, lut_bank[lut_active], sizeof(lut_bank[0]));
+    xSemaphoreGive(lut_lock);
+}
+
+onion_action_table_t *onion_lut_edit_actions(void) {
+    return &act_bank[!lut_active];
+}
+
+size_t onion_lut_snapshot_actions(uint8_t *out) {
+    xSemaphoreTake(lut_lock, portMAX_DELAY);
+    size_t len = act_bank[lut_active].len;
+    memcpy(out, act_bank[lut_active].blob, len);
+    xSemaphoreGive(lut_lock);
+    return len;
 }
 
 /**
@@ -146,9 +270,25 @@ int onion_touch_init(void) {
                         (1ULL << MUX_S2) | (1ULL << MUX_S3)
     };
     gpio_config(&io_conf);
+    REG_WRITE(GPIO_OUT_W1TC_REG, MUX_ADDR_BITS(0x0F));
+    mux_out_bits = 0;
 
-    adc1_config_width(ADC_WIDTH_BIT_12); // Rozdzielczość 0-4095
-    adc1_config_channel_atten(ADC1_CHANNEL_6, ADC_ATTEN_DB_11); // Zakres do ok. 3.3V
+    /* 12-bit continuous conversions on every MUX output, range up to ~3.3V */
+    int err = onion_scan_init();
+
+    /* Frame length follows the settle times measured by the SETTLE command */
+    onion_key_t lut[MUX_CHANNELS_COUNT];
+    uint8_t settle[MUX_CHANNELS_COUNT];
+    onion_lut_snapshot(lut);
+    for (int ch = 0; ch < MUX_CHANNELS_COUNT; ch++) {
+        settle[ch] = lut[ch].settle_samples;
+    }
+    if (err == ESP_OK) err = onion_scan_set_settle(settle);
+    if (err == ESP_OK) err = onion_scan_start();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Scan engine start failed (%s)", esp_err_to_name(err));
+        return err;
+    }
 
     ESP_LOGI(TAG, "ADC i MUX logic initialized.");
 
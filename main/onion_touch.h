@@ -2,7 +2,8 @@
  * @file onion_touch.h
  * @brief Touch sensor and Multiplexer management module.
  * * This module handles the hardware abstraction for the capacitive touch 
- * sensors connected via a 16-channel analog multiplexer (MUX).
+ * sensors connected via ONION_MUX_COUNT 16-channel analog multiplexers (MUX)
+ * with shared select lines; channel n is address n % 16 of MUX n / 16.
  */
 
 #ifndef ONION_TOUCH_H
@@ -10,52 +11,121 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "freertos/FreeRTOS.h"
 #include "onion_config.h"
+#include "onion_action.h"
 #include "driver/gpio.h"
 #include "esp_rom_sys.h"
 
 /**
- * @brief Global lookup table containing keycodes and touch thresholds.
- * Defined in onion_touch.c.
+ * @brief Snapshot of one complete sweep over all MUX channels.
  */
-extern onion_key_t onion_lut[16];
+typedef struct {
+    uint16_t raw[MUX_CHANNELS_COUNT]; /**< Averaged, calibrated reading per channel, in mV */
+    onion_mask_t pressed_mask;        /**< Bit n set while channel n is touched */
+    onion_mask_t changed_mask;        /**< Bits that toggled since the previous frame */
+    onion_mask_t detect_mask;         /**< Undebounced detector output (touch seen this sweep) */
+    int64_t  timestamp_us;            /**< esp_timer time at which the sweep completed */
+} onion_frame_t;
+
+/*
+ * Configuration (keycodes, thresholds, debounce, action table) lives in two banks. Readers
+ * always see one complete, immutable bank; writers fill the other bank and
+ * publish it with a single pointer swap, so a change never lands halfway
+ * through a sweep.
+ */
+
+/**
+ * @brief Creates the writers' lock of the configuration banks.
+ * @note Call first in app_main(), before any task that edits or snapshots the configuration starts.
+ */
+void onion_lut_init(void);
+
+/**
+ * @brief Pins the active configuration bank for one sweep (sweep task only).
+ * @param actions Receives the action table of the same bank.
+ * @return The active table; both stay valid until onion_lut_release().
+ */
+const onion_key_t *onion_lut_acquire(const onion_action_table_t **actions);
+
+/**
+ * @brief Ends the sweep that used the table from onion_lut_acquire().
+ */
+void onion_lut_release(void);
+
+/**
+ * @brief Starts a configuration change: locks out other writers and returns a draft copy of the active table.
+ * * Blocks at most until the sweep task releases the draft bank.
+ * @return Draft table; publish it with onion_lut_edit_commit().
+ */
+onion_key_t *onion_lut_edit_begin(void);
 
 /**
- * @brief Configures the GPIO address pins for the hardware multiplexer.
- * * @param addr The 4-bit channel address (0-15) to be set on S0-S3 pins.
+ * @brief Atomically makes the draft the active table and unlocks writers.
+ */
+void onion_lut_edit_commit(void);
+
+/**
+ * @brief Copies the active table (for serial replies and persistence).
+ */
+void onion_lut_snapshot(onion_key_t out[MUX_CHANNELS_COUNT]);
+
+/**
+ * @brief Action table of the draft bank, between onion_lut_edit_begin() and onion_lut_edit_commit().
+ * Fill it with onion_action_table_load().
+ */
+onion_action_table_t *onion_lut_edit_actions(void);
+
+/**
+ * @brief Copies the blob of the active action table.
+ * @param out Buffer of ONION_ACTION_TABLE_MAX bytes.
+ * @return Blob length (0 for an empty table).
+ */
+size_t onion_lut_snapshot_actions(uint8_t *out);
+
+/**
+ * @brief Drives the shared S0-S3 select lines of the hardware multiplexers.
+ * * @param addr The 4-bit MUX address (0-15) to be set on S0-S3 pins.
  */
 void set_mux_address(uint8_t addr);
 
 /**
- * @brief Reads the current state of a specific touch channel.
- * * @param channel The MUX channel index to read.
- * @return true if the channel is currently touched (below threshold), false otherwise.
+ * @brief Waits for the scan engine to complete a fresh sweep and classifies it.
+ * * Every channel is sampled exactly once per frame; the pressed state lives only
+ * in the returned mask, so classification and HID dispatch work on one consistent view.
+ * The frame is then published for onion_touch_get_frame().
+ * * @param frame Output frame (raw values, pressed/changed masks, timestamp).
+ * @param lut Configuration bank pinned with onion_lut_acquire().
+ * @param timeout Maximum time to wait, in ticks.
+ * @return true if a complete sweep was captured, false on timeout.
  */
-bool onion_touch_read(uint8_t channel);
+bool onion_touch_sweep(onion_frame_t *frame, const onion_key_t *lut, TickType_t timeout);
 
 /**
- * @brief Detects if a touch state change has occurred on a specific channel.
- * * Compares the current raw reading with the previous state stored in onion_lut.
- * * @param channel The MUX channel index to check.
- * @return true if the state (Pressed vs Released) has changed since the last check.
+ * @brief Captures a fresh sweep without classifying it, for streams that want every engine sweep.
+ * * The masks are those of the last onion_touch_sweep() (changed_mask 0); debounce and
+ * baseline state are not advanced and the frame is not published.
+ * @param frame Output frame.
+ * @param timeout Maximum time to wait, in ticks.
+ * @return true if a complete sweep was captured, false on timeout.
  */
-bool onion_touch_has_changed(uint8_t channel);
+bool onion_touch_sample(onion_frame_t *frame, TickType_t timeout);
 
 /**
- * @brief Saves current touch configurations/thresholds to Non-Volatile Storage (NVS).
- * * @return 0 on success, or a non-zero error code.
+ * @brief Copies the most recently published frame without blocking the sweep task.
+ * * Safe from any task; retries internally if a sweep is published during the copy.
+ * @return false if no sweep has been published yet.
  */
-int onion_config_save(void);
+bool onion_touch_get_frame(onion_frame_t *out);
 
 /**
- * @brief Initializes the NVS flash storage and loads saved configurations.
- * * @return 0 on success, or a non-zero error code.
+ * @brief Returns the pressed mask of the most recent frame (bit n = channel n).
  */
-int onion_config_init(void);
+onion_mask_t onion_touch_get_pressed_mask(void);
 
 /**
  * @brief Performs hardware initialization for the touch pads and MUX GPIOs.
- * * Sets up the touch peripheral clock and configures the MUX selector pins as outputs.
+ * * Configures the MUX selector pins as outputs and starts the DMA scan engine.
  * * @return 0 on success, or a non-zero error code.
  */
 int onion_touch_init(void);